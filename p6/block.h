@@ -13,4 +13,11 @@ void block_init( void);
 void block_read( int block, char *mem);
 void block_write( int block, char *mem);
 void my_bzero_block( int block);
+
+//FAKE build: more images beside the one block_init opens, which is device 0
+#define BLOCK_MAX_DEVICES 8
+int block_open( const char *image);//device id, -1 on failure
+void block_close( int dev);
+void dev_block_read( int dev, int block, char *mem);
+void dev_block_write( int dev, int block, char *mem);
 #endif
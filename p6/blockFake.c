@@ -1,51 +1,75 @@
 #include <stdio.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "common.h"
 #include "block.h"
 
-static FILE *fd;
-
-#include <errno.h>
+//pread/pwrite carry their own offset, so threads can share an image
+//one file per device, device 0 is ./disk
+static int dev_fd[BLOCK_MAX_DEVICES];
+static int dev_used[BLOCK_MAX_DEVICES];
 
 void 
 block_init( void) {
-    int ret;
+    if ( dev_used[0])
+	close( dev_fd[0]);
+    dev_fd[0] = open( "./disk", O_RDWR | O_CREAT, 0644);
+    assert( dev_fd[0] >= 0);
+    dev_used[0] = 1;
+}
 
-    fd = fopen( "./disk", "r+");
-    if ( fd == NULL) 
-	fd = fopen( "./disk", "w+");
-    assert( fd);
+int 
+block_open( const char *image) {
+    int dev;
 
-    ret = fseek( fd, 0, SEEK_SET);
-    assert( ret == 0);
+    for ( dev = 1; dev < BLOCK_MAX_DEVICES; dev++)
+	if ( !__sync_lock_test_and_set( &dev_used[dev], 1))
+	    break;
+    if ( dev == BLOCK_MAX_DEVICES)
+	return -1;
+    dev_fd[dev] = open( image, O_RDWR | O_CREAT, 0644);
+    if ( dev_fd[dev] < 0) {
+	__sync_lock_release( &dev_used[dev]);
+	return -1;
+    }
+    return dev;
 }
 
 void 
-block_read( int block, char *mem) {
+block_close( int dev) {
+    close( dev_fd[dev]);
+    __sync_lock_release( &dev_used[dev]);
+}
+
+void 
+dev_block_read( int dev, int block, char *mem) {
     int ret;
 
-    ret = fseek( fd, block * BLOCK_SIZE, SEEK_SET);
-    assert( ret == 0);
-    
-    ret = fread( mem, 1, BLOCK_SIZE, fd);
-    if ( ret == 0) { /* End of file */
-	ret = BLOCK_SIZE;
-	bzero_block( mem);
-    }
-    assert( ret == BLOCK_SIZE);
+    ret = pread( dev_fd[dev], mem, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+    assert( ret >= 0);
+    for ( ; ret < BLOCK_SIZE; ret++) /* End of file */
+	mem[ret] = 0;
 }
 
 void 
-block_write( int block, char *mem) {
+dev_block_write( int dev, int block, char *mem) {
     int ret;
     
-    ret = fseek( fd, block * BLOCK_SIZE, SEEK_SET);
-    assert( ret == 0);
-    
-    ret = fwrite( mem, 1, BLOCK_SIZE, fd);
+    ret = pwrite( dev_fd[dev], mem, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
     assert( ret == BLOCK_SIZE);
 }
 
+void 
+block_read( int block, char *mem) {
+    dev_block_read( 0, block, mem);
+}
+
+void 
+block_write( int block, char *mem) {
+    dev_block_write( 0, block, mem);
+}
+
 void
 bzero_block( char *block) {
     int i;
@@ -61,10 +85,7 @@ void my_bzero_block( int block){
     int i;
     for(i=0;i<8;i++)
     {
-        ret = fseek( fd, (block*8+i) * BLOCK_SIZE, SEEK_SET);
-        assert( ret == 0);
-        
-        ret = fwrite( block_buff, 1, BLOCK_SIZE, fd);
+        ret = pwrite( dev_fd[0], block_buff, BLOCK_SIZE, (off_t)(block*8+i) * BLOCK_SIZE);
         assert( ret == BLOCK_SIZE);
     }
     
@@ -107,6 +107,9 @@ typedef unsigned long ulong_t;
 #define FS_O_RDONLY 1
 #define FS_O_WRONLY 2
 #define FS_O_RDWR 3
+#define FS_O_ACCMODE 3 //flags & FS_O_ACCMODE is one of the three above
+#define FS_O_TRUNC 4 //cut a writable file to 0 bytes on open
+#define FS_O_APPEND 8 //every fs_write/fs_writev goes to the end of the file
 
 typedef struct {
     // Fill in your stat here, this is just an example
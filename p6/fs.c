@@ -1,6 +1,9 @@
 /*
  * Implementation of a Unix-like file system.
 */
+#ifdef FAKE
+#define _GNU_SOURCE //for pthread_rwlockattr_setkind_np
+#endif
 #include "util.h"
 #include "common.h"
 #include "block.h"
@@ -8,1339 +11,4211 @@
 
 #ifdef FAKE
 #include <stdio.h>
+#include <time.h>
 #define ERROR_MSG(m) printf m;
 #else
 #define ERROR_MSG(m)
 #endif
 
-//
-static void new_block_write( int block, char *mem)
+//the kernel has one device, the FAKE build one per mounted image
+static void sector_write(fs_t *fs, int sector, char *mem)
+{
+#ifdef FAKE
+	dev_block_write(fs->dev,sector,mem);
+#else
+	block_write(sector,mem);
+#endif
+}
+static void sector_read(fs_t *fs, int sector, char *mem)
+{
+#ifdef FAKE
+	dev_block_read(fs->dev,sector,mem);
+#else
+	block_read(sector,mem);
+#endif
+}
+static void raw_block_write(fs_t *fs, int block, char *mem)
 {
 	int i;
 	for(i=0;i<NEW_BLOCK_SIZE/BLOCK_SIZE;i++)
 	{
-		block_write(block*8+i,mem+i*BLOCK_SIZE);
+		sector_write(fs,block*8+i,mem+i*BLOCK_SIZE);
 	}
 }
-static void new_block_read( int block, char *mem)
+static void raw_block_read(fs_t *fs, int block, char *mem)
 {
 	int i;
 	for(i=0;i<NEW_BLOCK_SIZE/BLOCK_SIZE;i++)
 	{
-		block_read(block*8+i,mem+i*BLOCK_SIZE);
+		sector_read(fs,block*8+i,mem+i*BLOCK_SIZE);
 	}
 }
 
-//static helper func
-static void strcpy_safe(char *src,char *dest,int dest_max_len)//dest max len without final '\0' buffer
+//write-back block cache------------------------------
+//only while fs->writeback is on (FAKE build); blocks are written in the cache,
+//and the flusher thread takes them to the device once they are old enough or
+//too many are dirty; a writer that finds dirty_ratio of the cache dirty waits
+//bcache_lock is the innermost lock, the device writes of the flusher run outside it
+#ifdef FAKE
+static uint32_t now_ms(void)
 {
-	if(strlen(src)>dest_max_len)
-		bcopy((unsigned char *)src,(unsigned char *)dest,dest_max_len);
-	else
-		bcopy((unsigned char *)src,(unsigned char *)dest,strlen(src));
-	dest[dest_max_len]='\0';
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec*1000+t.tv_nsec/1000000;
 }
-
-//useful var--------------------------------------
-static char block_scratch[NEW_BLOCK_SIZE];//inode read/write/free use scratch
-static char block_scratch_1[NEW_BLOCK_SIZE];
-
-static char inode_bitmap_block_scratch[NEW_BLOCK_SIZE];
-static char dblock_bitmap_block_scratch[NEW_BLOCK_SIZE];
-
-static char super_block_scratch[NEW_BLOCK_SIZE];
-
-static super_b * my_sb= (super_b *)super_block_scratch;
-
-static file_desc fd_table[MAX_OPEN_FILE_NUM];
-
-static uint16_t pwd;//start from 0 as inode index
-
-static uint16_t inode_bitmap_last=0;//MAX_FILE_COUNT-1;//start from end
-static uint16_t dblock_bitmap_last=0;//DATA_BLOCK_NUMBER-1;//start from end
-
-//superblock write helper------------------
-static void sb_write()
+//for pthread_cond_timedwait
+static void deadline_after(int ms,struct timespec *until)
 {
-	new_block_write(SUPER_BLOCK,super_block_scratch);
-	new_block_write(SUPER_BLOCK_BACKUP,super_block_scratch);
+	clock_gettime(CLOCK_REALTIME,until);
+	until->tv_nsec+=(long)ms%1000*1000000;
+	until->tv_sec+=ms/1000+until->tv_nsec/1000000000;
+	until->tv_nsec%=1000000000;
 }
-//bitmap helper-----------------------------
-
-static int read_bitmap_block(int i_d,int index)// 0 for inode bitmap,1 for data bitmap
+static bool_t bcache_over(fs_t *fs,int ratio)
 {
-	char *bitmap_block_scratch;
-	if(i_d)
-		bitmap_block_scratch=dblock_bitmap_block_scratch;
-	else
-		bitmap_block_scratch=inode_bitmap_block_scratch;
-	int nbyte=index/8;
-	uint8_t the_byte=bitmap_block_scratch[nbyte];
-	int mask_off=index%8;
-	uint8_t mask=1<<mask_off;
-	return (mask & the_byte)? 1:0;
+	return fs->bcache_dirty*100>=BCACHE_BLOCKS*ratio;
 }
-
-static void write_bitmap_block(int i_d,int index,int val) // 0 for inode bitmap,1 for data bitmap
+//caller holds bcache_lock
+static void bcache_clean(fs_t *fs,bcache_entry *e)
 {
-	char *bitmap_block_scratch;
-	if(i_d)
-		bitmap_block_scratch=dblock_bitmap_block_scratch;
-	else
-		bitmap_block_scratch=inode_bitmap_block_scratch;
-
-	int nbyte=index/8;
-	uint8_t the_byte=bitmap_block_scratch[nbyte];
-	int mask_off=index%8;
-	uint8_t mask=1<<mask_off;
-	the_byte = the_byte &(~mask);
-	if(val)
-		the_byte = the_byte | mask;
-
-	bitmap_block_scratch[nbyte]=the_byte;
-	
-	if(i_d)
-		new_block_write(my_sb->dblock_bitmap_place,bitmap_block_scratch);
-	else
-		new_block_write(my_sb->inode_bitmap_place,bitmap_block_scratch);
+	e->dirty=FALSE;
+	fs->bcache_dirty--;
 }
-static int find_next_free(int i_d)//must alloc(write 1) after this function find the result
+//a slot for block, loaded from the device if load is set; caller holds bcache_lock
+static bcache_entry *bcache_get(fs_t *fs,int block,bool_t load)
 {
-	int i;
-	int res;
-	if(i_d){
-		i=(dblock_bitmap_last+1)%DATA_BLOCK_NUMBER;
-		while(i!=dblock_bitmap_last){
-			res=read_bitmap_block(DBLOCK_BITMAP,i);
-			if(res==0)
+	int slot=fs->bcache_slot[block];
+	if(slot<0)
+	{
+		bcache_entry *victim;
+		for(;;)
+		{
+			//least recently used, clean ones first; never one the flusher is writing
+			int i;
+			victim=NULL;
+			for(i=0;i<BCACHE_BLOCKS;i++)
 			{
-				dblock_bitmap_last=i;
-				return i;
+				bcache_entry *e=&fs->bcache[i];
+				if(e->writing)
+					continue;
+				if(victim==NULL || (victim->dirty && !e->dirty)
+					|| (victim->dirty==e->dirty && e->last_use<victim->last_use))
+					victim=e;
 			}
-			i++;
-			if(i==DATA_BLOCK_NUMBER)
-				i=0;
+			if(victim!=NULL)
+				break;
+			pthread_cond_wait(&fs->bcache_flushed,&fs->bcache_lock);
 		}
-	}
-	else{
-		i=(inode_bitmap_last+1)%MAX_FILE_COUNT;
-		while(i!=inode_bitmap_last){
-			res=read_bitmap_block(INODE_BITMAP,i);
-			if(res==0)
+		if(victim->block>=0)
+		{
+			if(victim->dirty)
 			{
-				inode_bitmap_last=i;
-				return i;
+				raw_block_write(fs,victim->block,victim->data);
+				bcache_clean(fs,victim);
 			}
-			i++;
-			if(i==MAX_FILE_COUNT)
-				i=0;
+			fs->bcache_slot[victim->block]=-1;
 		}
+		slot=victim-fs->bcache;
+		victim->block=block;
+		fs->bcache_slot[block]=slot;
+		if(load)
+			raw_block_read(fs,block,victim->data);
 	}
-	return -1;
+	bcache_entry *e=&fs->bcache[slot];
+	e->last_use=++fs->bcache_clock;
+	return e;
 }
-//dblock alloc & free & read & write --------------------------
-static int dblock_alloc(void)
+static void bcache_read(fs_t *fs,int block,int off,int len,char *mem)
 {
-	int search_res=-1;
-	search_res=find_next_free(DBLOCK_BITMAP);
-	if(search_res>=0)
-	{
-		write_bitmap_block(DBLOCK_BITMAP,search_res,1);
-		my_sb->dblock_count++;
-		sb_write();
-		my_bzero_block(my_sb->dblock_start+search_res);
-		return search_res;
-	}
-	ERROR_MSG(("alloc data block fail"))
-	return -1;
+	FS_LOCK(&fs->bcache_lock);
+	bcache_entry *e=bcache_get(fs,block,TRUE);
+	bcopy((unsigned char *)e->data+off,(unsigned char *)mem,len);
+	FS_UNLOCK(&fs->bcache_lock);
 }
-static void dblock_free(int index)
+static void bcache_write(fs_t *fs,int block,char *mem)
 {
-	int temp=read_bitmap_block(DBLOCK_BITMAP,index);
-	if (temp)
+	FS_LOCK(&fs->bcache_lock);
+	bcache_entry *e=bcache_get(fs,block,FALSE);
+	bcopy((unsigned char *)mem,(unsigned char *)e->data,NEW_BLOCK_SIZE);
+	if(!e->dirty)
 	{
-		my_sb->dblock_count--;
-		sb_write();
+		e->dirty=TRUE;
+		e->dirtied=now_ms();
+		fs->bcache_dirty++;
 	}
-	write_bitmap_block(DBLOCK_BITMAP,index,0);
+	if(bcache_over(fs,fs->wb.background_ratio))
+		pthread_cond_signal(&fs->bcache_kick);
+	while(bcache_over(fs,fs->wb.dirty_ratio) && fs->writeback)//throttle
+	{
+		pthread_cond_signal(&fs->bcache_kick);
+		pthread_cond_wait(&fs->bcache_flushed,&fs->bcache_lock);
+	}
+	FS_UNLOCK(&fs->bcache_lock);
 }
-//caller prepare space for whole data block
-static void dblock_read(int index,char* block_buff)
+//write back the dirty blocks, all of them or only the expired ones; caller holds bcache_lock,
+//which is dropped around each device write
+static void bcache_flush(fs_t *fs,bool_t all)
 {
-	new_block_read(my_sb->dblock_start+index,block_buff);
+	char block_scratch[NEW_BLOCK_SIZE];
+	uint32_t now=now_ms();
+	int i;
+	for(i=0;i<BCACHE_BLOCKS;i++)
+	{
+		bcache_entry *e=&fs->bcache[i];
+		if(!e->dirty || e->writing)
+			continue;
+		if(!all && now-e->dirtied<(uint32_t)fs->wb.expire_ms && !bcache_over(fs,fs->wb.background_ratio))
+			continue;
+		//a write that lands meanwhile makes it dirty again, and it goes out next round
+		int block=e->block;
+		bcopy((unsigned char *)e->data,(unsigned char *)block_scratch,NEW_BLOCK_SIZE);
+		bcache_clean(fs,e);
+		e->writing=TRUE;
+		FS_UNLOCK(&fs->bcache_lock);
+		raw_block_write(fs,block,block_scratch);
+		FS_LOCK(&fs->bcache_lock);
+		e->writing=FALSE;
+		pthread_cond_broadcast(&fs->bcache_flushed);
+	}
 }
-//caller prepare space for whole data block
-static void dblock_write(int index,char* block_buff)
+//everything on the device, including what the flusher is writing now; caller holds bcache_lock
+static void bcache_sync(fs_t *fs)
 {
-	new_block_write(my_sb->dblock_start+index,block_buff);
+	for(;;)
+	{
+		bool_t dirty=FALSE,writing=FALSE;
+		int i;
+		bcache_flush(fs,TRUE);
+		for(i=0;i<BCACHE_BLOCKS;i++)
+		{
+			dirty|=fs->bcache[i].dirty;
+			writing|=fs->bcache[i].writing;
+		}
+		if(writing)
+			pthread_cond_wait(&fs->bcache_flushed,&fs->bcache_lock);
+		else if(!dirty)
+			return;
+	}
 }
-//inode alloc & free & read & write & init helper ----------------------------------
-static int inode_alloc(void)
+static void *bcache_flusher(void *arg)
 {
-	int search_res=-1;
-	search_res=find_next_free(INODE_BITMAP);
-	if(search_res>=0)
+	fs_t *fs=(fs_t *)arg;
+	FS_LOCK(&fs->bcache_lock);
+	while(fs->writeback)
 	{
-		write_bitmap_block(INODE_BITMAP,search_res,1);
-		my_sb->inode_count++;
-		sb_write();
-		return search_res;
+		struct timespec until;
+		deadline_after(fs->wb.interval_ms,&until);
+		pthread_cond_timedwait(&fs->bcache_kick,&fs->bcache_lock,&until);
+		bcache_flush(fs,FALSE);
 	}
-	return -1;
+	FS_UNLOCK(&fs->bcache_lock);
+	return NULL;
 }
+#endif
 
-//caller prepare space for inode and check valid
-static void inode_read(int index,inode* inode_buff)
+//the block's place on the device, through the write-back cache when it's on
+static void home_block_write(fs_t *fs, int block, char *mem)
 {
-	char temp_block_scratch[NEW_BLOCK_SIZE];
-	new_block_read(my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
-	inode *inode_block_scratch=(inode *)temp_block_scratch;
-	bcopy((unsigned char *)(inode_block_scratch+(index%INODE_PER_BLOCK)),(unsigned char *)inode_buff,sizeof(inode));
+#ifdef FAKE
+	if(fs->writeback)
+	{
+		bcache_write(fs,block,mem);
+		return;
+	}
+#endif
+	raw_block_write(fs,block,mem);
 }
-//caller prepare space for inode and check valid
-static void inode_write(int index,inode* inode_buff)
+static void home_block_read(fs_t *fs, int block, char *mem)
 {
-	char temp_block_scratch[NEW_BLOCK_SIZE];
-	new_block_read(my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
-	inode *inode_block_scratch=(inode *)temp_block_scratch;
-	bcopy((unsigned char *)inode_buff,(unsigned char *)(inode_block_scratch+(index%INODE_PER_BLOCK)),sizeof(inode));
-	new_block_write(my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
+#ifdef FAKE
+	if(fs->writeback)
+	{
+		bcache_read(fs,block,0,NEW_BLOCK_SIZE,mem);
+		return;
+	}
+#endif
+	raw_block_read(fs,block,mem);
 }
-static void inode_init(inode *p,int type) // 0 for dir , 1 for file
+static void home_block_read_part(fs_t *fs, int block, int off, int len, char *mem)
 {
-	p->size=0;
-	p->type=type;
-	p->link_count=1;
-	bzero((char *)p->blocks,sizeof(uint16_t)*(DIRECT_BLOCK+1));
+#ifdef FAKE
+	if(fs->writeback)
+	{
+		bcache_read(fs,block,off,len,mem);
+		return;
+	}
+#endif
+	char sector_scratch[BLOCK_SIZE];
+	sector_read(fs,block*8+off/BLOCK_SIZE,sector_scratch);
+	bcopy((unsigned char *)sector_scratch+off%BLOCK_SIZE,(unsigned char *)mem,len);
 }
-static int inode_create(int type)// 0 for dir 1 for file , create and init ! 
+
+
+//metadata journal------------------------------------
+//on a volume with SB_FEATURE_JOURNAL (FAKE build) superblock, bitmap, inode
+//table, directory and index block writes land in jbuf; each fs call runs as a
+//handle between txn_begin and txn_end, and every JOURNAL_COMMIT_MS the journal
+//thread waits for the running handles and logs every block they changed as
+//one transaction, so a crash never leaves an operation half done on disk.
+//Committed blocks are written home by the same thread, and once the log is
+//half used it starts over.
+//A transaction has to fit in the log, so handles are admitted against it: a
+//file call reserves JOURNAL_HANDLE_CREDITS blocks and waits for a commit when
+//they aren't left, a namespace call (txn_begin_ns) runs alone. Only a
+//namespace call that outgrows the log by itself, like removing a big tree, is
+//committed early, and that commit holds nothing half done but its own work.
+//File data goes home directly, before the metadata pointing at it commits; a
+//block jbuf or the log has an image of isn't handed out for data until the
+//log starts over, or replaying the old image would clobber it. Likewise a
+//data block freed by the running transaction stays out of the allocator until
+//that transaction commits, since a crash before then replays the inode that
+//still points at it.
+//the kernel replays the log at fs_init and then runs write-through.
+static uint32_t journal_sum(char *mem,uint32_t h)
 {
-	inode temp_inode;
-	int alloc_index;
-	alloc_index=inode_alloc();
-	if(alloc_index<0){
-		ERROR_MSG(("no enough inode space for new inode!\n"))
-		return -1;
+	int i;
+	for(i=0;i<NEW_BLOCK_SIZE;i++)
+	{
+		h^=(uint8_t)mem[i];
+		h*=16777619u;
 	}
-	inode_init(&temp_inode,type);
-	inode_write(alloc_index,&temp_inode);
-	return alloc_index;
+	return h;
 }
-static void inode_free(int index)//free the inode, also free its data
+static char zero_block[NEW_BLOCK_SIZE];//never written, source of zeros for file_truncate and the log
+//an empty log whose first transaction will be seq
+static void journal_restart(fs_t *fs,int start,uint32_t seq)
 {
-	int temp=read_bitmap_block(INODE_BITMAP,index);
-	inode inode_temp;
-	if (temp)
+	char header_scratch[NEW_BLOCK_SIZE];
+	bzero(header_scratch,NEW_BLOCK_SIZE);
+	journal_header *h=(journal_header *)header_scratch;
+	h->magic=JOURNAL_MAGIC;
+	h->seq=seq;
+	raw_block_write(fs,start+1,zero_block);//no stale descriptor right after the header
+	raw_block_write(fs,start,header_scratch);
+}
+//redo the transactions committed in the log of sb's volume and empty it,
+//before anything else reads the volume; return the next sequence number
+static uint32_t journal_replay(fs_t *fs,super_b *sb)
+{
+	char desc_scratch[NEW_BLOCK_SIZE];
+	char image_scratch[NEW_BLOCK_SIZE];
+	journal_header *h=(journal_header *)desc_scratch;
+	journal_desc *d=(journal_desc *)desc_scratch;
+	int start=sb->journal_start;
+	raw_block_read(fs,start,desc_scratch);
+	uint32_t seq=h->magic==JOURNAL_MAGIC?h->seq:0;
+	int pos=1;
+	int i;
+	while(pos<sb->journal_blocks)
 	{
-		inode_read(index,&inode_temp);
-		int used_data_blocks;//total blocks used , not included indirect index block
-		used_data_blocks=(inode_temp.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
-		if(used_data_blocks>DIRECT_BLOCK)//use indirect block
+		raw_block_read(fs,start+pos,desc_scratch);
+		if(d->magic!=JOURNAL_MAGIC || d->seq!=seq || d->count==0 || d->count>JOURNAL_TXN_MAX
+			|| pos+1+d->count>sb->journal_blocks)
+			break;
+		uint32_t sum=2166136261u;
+		for(i=0;i<d->count;i++)
 		{
-			//use scratch here
-			dblock_read(inode_temp.blocks[DIRECT_BLOCK],block_scratch);
-			int i;
-			for(i=0;i<=DIRECT_BLOCK;i++)
-				dblock_free(inode_temp.blocks[i]);
-			uint16_t *block_list=(uint16_t *)block_scratch;
-			for(i=0;i<used_data_blocks-DIRECT_BLOCK;i++)
-				dblock_free(block_list[i]);
+			if(d->blocks[i]==0 || d->blocks[i]>=FS_SIZE/8 || (d->blocks[i]>=start && d->blocks[i]<start+sb->journal_blocks))
+				break;
+			raw_block_read(fs,start+pos+1+i,image_scratch);
+			sum=journal_sum(image_scratch,sum);
 		}
-		else{
-			int i;
-			for(i=0;i<used_data_blocks;i++)
-				dblock_free(inode_temp.blocks[i]);
+		if(i<d->count || sum!=d->checksum)//torn: the crash came before the commit
+			break;
+		for(i=0;i<d->count;i++)
+		{
+			raw_block_read(fs,start+pos+1+i,image_scratch);
+			raw_block_write(fs,d->blocks[i],image_scratch);
+			if(d->blocks[i]==SUPER_BLOCK)
+				raw_block_write(fs,SUPER_BLOCK_BACKUP,image_scratch);
 		}
-		write_bitmap_block(INODE_BITMAP,index,0);
-		my_sb->inode_count--;
-		sb_write();
+		pos+=1+d->count;
+		seq++;
 	}
+	journal_restart(fs,start,seq);
+	return seq;
 }
-//this doesn't change inode.size
-static int alloc_dblock_mount_to_inode(int inode_id)
+#ifdef FAKE
+//committed contents of block, to its place on disk
+static void journal_home(fs_t *fs,int block,char *mem)
 {
-	int alloc_res;
-	inode temp;
-	inode_read(inode_id,&temp);
-	int next_block=(temp.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;//start from 0 , mean the next in-inode blocks id
-	if(next_block>MAX_BLOCKS_INDEX_IN_INODE)
-	{
-		ERROR_MSG(("beyond one inode can handle!\n"))
-		return -1;
-	}
-	if(next_block>=DIRECT_BLOCK)//need indirect block
+	home_block_write(fs,block,mem);
+	if(block==SUPER_BLOCK)//only the main copy is logged
+		home_block_write(fs,SUPER_BLOCK_BACKUP,mem);
+}
+//a slot for block, evicting a clean one; caller holds journal_lock
+static jbuf_entry *jbuf_get(fs_t *fs,int block)
+{
+	int slot=fs->jbuf_slot[block];
+	if(slot>=0)
+		return &fs->jbuf[slot];
+	//at most JOURNAL_TXN_MAX are dirty and one is being written, so a victim is there
+	jbuf_entry *victim=NULL;
+	int i;
+	for(i=0;i<JBUF_BLOCKS;i++)
 	{
-		if(next_block==DIRECT_BLOCK)//need indirect block ,but the indirect index block has not been alloced
+		jbuf_entry *e=&fs->jbuf[i];
+		if(e->block<0)
 		{
-			alloc_res=dblock_alloc();
-			if(alloc_res<0)
-				return -1;
-			temp.blocks[DIRECT_BLOCK]=alloc_res;
-		}
-		dblock_read(temp.blocks[DIRECT_BLOCK],block_scratch);
-		uint16_t *block_list=(uint16_t *)block_scratch;
-		
-		alloc_res=dblock_alloc();
-		if(alloc_res<0){
-			if(next_block==DIRECT_BLOCK)
-				dblock_free(temp.blocks[DIRECT_BLOCK]);
-			return -1;
+			victim=e;
+			break;
 		}
-		block_list[next_block-DIRECT_BLOCK]=alloc_res;
-		dblock_write(temp.blocks[DIRECT_BLOCK],block_scratch);
+		if(!e->dirty && !e->writing && (victim==NULL || (victim->pending && !e->pending)))
+			victim=e;
 	}
-	else
+	if(victim->block>=0)
 	{
-		alloc_res=dblock_alloc();
-		if(alloc_res<0)
-			return -1;
-		temp.blocks[next_block]=alloc_res;
+		if(victim->pending)
+			journal_home(fs,victim->block,victim->ckpt);
+		fs->jbuf_slot[victim->block]=-1;
 	}
-	// ERROR_MSG(("inode %d need a block in-inode id %d, alloc_res %d\n",inode_id,next_block,alloc_res))
-	inode_write(inode_id,&temp);
-	return alloc_res;
+	victim->block=block;
+	victim->dirty=FALSE;
+	victim->pending=FALSE;
+	fs->jbuf_slot[block]=victim-fs->jbuf;
+	return victim;
 }
-
-//directories ---------------------------------------------------
-
-//this func doesn't check same filename,so we may need to use find before we really insert one file to dir 
-static int dir_entry_add(int dir_index,int son_index,char *filename)
+//write the committed blocks home, one at a time outside journal_lock;
+//caller holds journal_lock
+static void journal_checkpoint(fs_t *fs)
 {
-	//ERROR_MSG(("create new_file %s ,in dir %d,new_inode %d,\n",filename,dir_index,son_index))
-	//read_bitmap_block(INODE_BITMAP,dir_index)
-	inode dir_inode;
-	inode_read(dir_index,&dir_inode);
-	int next_i;
-	next_i=dir_inode.size/(sizeof(dir_entry));
-	int next_i_inblock;
-	next_i_inblock=next_i/DIR_ENTRY_PER_BLOCK;
-
-	dir_entry new_entry;
-	new_entry.inode_id=son_index;
-	bzero(new_entry.file_name,MAX_FILE_NAME);
-	strcpy_safe(filename,new_entry.file_name,MAX_FILE_NAME);
-
-	if(next_i%DIR_ENTRY_PER_BLOCK==0)//need new block
-	{	
-		int alloc_res=alloc_dblock_mount_to_inode(dir_index);
-		if(alloc_res<0)
-		{
-			ERROR_MSG(("can't alloc dblock when insert dir_entry into dir\n"))
-			return -1;
-		}
-		//update inode 
-		inode_read(dir_index,&dir_inode);
-
-		dblock_read(alloc_res,block_scratch);
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		entry_list[0]=new_entry;
-		dblock_write(alloc_res,block_scratch);
-	}
-	else
+	char block_scratch[NEW_BLOCK_SIZE];
+	int i;
+	for(i=0;i<JBUF_BLOCKS;i++)
 	{
-		if(next_i_inblock>=DIRECT_BLOCK){//indirect block
-			dblock_read(dir_inode.blocks[DIRECT_BLOCK],block_scratch);
-			uint16_t *block_list=(uint16_t *)block_scratch;
-			next_i_inblock=block_list[next_i_inblock-DIRECT_BLOCK];//get real block no
-		}
-		else
-		{
-			//real block no is dir_inode.blocks[next_i_inblock]
-			next_i_inblock=dir_inode.blocks[next_i_inblock];
-		}
-
-		dblock_read(next_i_inblock,block_scratch);
-
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		entry_list[next_i%DIR_ENTRY_PER_BLOCK]=new_entry;
-		
-		dblock_write(next_i_inblock,block_scratch);
+		jbuf_entry *e=&fs->jbuf[i];
+		if(!e->pending || e->writing)
+			continue;
+		int block=e->block;
+		uint32_t gen=e->ckpt_gen;
+		bcopy((unsigned char *)e->ckpt,(unsigned char *)block_scratch,NEW_BLOCK_SIZE);
+		e->writing=TRUE;
+		FS_UNLOCK(&fs->journal_lock);
+		journal_home(fs,block,block_scratch);
+		FS_LOCK(&fs->journal_lock);
+		e->writing=FALSE;
+		if(e->ckpt_gen==gen)//else a newer commit is left to write
+			e->pending=FALSE;
+		pthread_cond_broadcast(&fs->journal_cond);
 	}
-
-	dir_inode.size+=sizeof(dir_entry);
-	inode_write(dir_index,&dir_inode);//update dir inode
-	return 0;
 }
-//if match return inode id else return -1
-//so we may need to use find before we really insert one file to dir 
-static int dir_entry_find(int dir_index,char *filename)
+//write home everything committed, then start the log over; caller holds journal_lock
+static void journal_reset(fs_t *fs)
 {
-	inode dir_inode;
-	inode_read(dir_index,&dir_inode);
-	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
-	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
-	if(total_entry_num==0)
-		return -1;
-
-	if(total_block_num>DIRECT_BLOCK)
-	{
-		int i,j;
-
-		dblock_read(dir_inode.blocks[DIRECT_BLOCK],block_scratch);
-		uint16_t *block_list=(uint16_t *)block_scratch;
-
-		for(i=0;i<total_block_num-DIRECT_BLOCK-1;i++)
-		{
-			dblock_read(block_list[i],block_scratch_1);
-			dir_entry *entry_list=(dir_entry *)block_scratch_1;
-			for(j=0;j<DIR_ENTRY_PER_BLOCK;j++)
-				if(same_string(entry_list[j].file_name,filename))
-					return entry_list[j].inode_id;
-		}
-		//last block
-		dblock_read(block_list[total_block_num-DIRECT_BLOCK-1],block_scratch_1);
-		int final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
-		dir_entry *entry_list=(dir_entry *)block_scratch_1;
-		for(j=0;j<=final_end;j++)
+	int i;
+	for(i=0;i<JBUF_BLOCKS;i++)
+		while(fs->jbuf[i].writing)
+			pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+	for(i=0;i<JBUF_BLOCKS;i++)
+		if(fs->jbuf[i].pending)
 		{
-			if(same_string(entry_list[j].file_name,filename))
-				return entry_list[j].inode_id;
+			journal_home(fs,fs->jbuf[i].block,fs->jbuf[i].ckpt);
+			fs->jbuf[i].pending=FALSE;
 		}
-
-		//trick to find in direct blocks
-		total_block_num=DIRECT_BLOCK;
-		total_entry_num=DIRECT_BLOCK*DIR_ENTRY_PER_BLOCK;
-	}
-	//direct blocks
-	int i,j,entry_block;
-	for(i=0;i<total_block_num-1;i++)
+	if(fs->writeback)//home before the log that has them goes
 	{
-		entry_block=dir_inode.blocks[i];
-		dblock_read(entry_block,block_scratch);
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		for(j=0;j<DIR_ENTRY_PER_BLOCK;j++)
-			if(same_string(entry_list[j].file_name,filename))
-				return entry_list[j].inode_id;
+		FS_LOCK(&fs->bcache_lock);
+		bcache_sync(fs);
+		FS_UNLOCK(&fs->bcache_lock);
 	}
-	//last block
-	int final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
-	entry_block=dir_inode.blocks[total_block_num-1];
-	dblock_read(entry_block,block_scratch);
-	dir_entry *entry_list=(dir_entry *)block_scratch;
-	for(j=0;j<=final_end;j++)
+	journal_restart(fs,fs->my_sb->journal_start,fs->jseq);
+	bzero((char *)fs->jlogged,sizeof(fs->jlogged));
+	fs->jlog_pos=1;
+}
+//log the dirty blocks as one transaction; caller holds journal_lock
+static void journal_commit_locked(fs_t *fs)
+{
+	if(fs->jdirty==0)
+		return;
+	if(fs->jlog_pos+1+fs->jdirty>JOURNAL_BLOCKS)
+		journal_reset(fs);
+	char desc_scratch[NEW_BLOCK_SIZE];
+	bzero(desc_scratch,NEW_BLOCK_SIZE);
+	journal_desc *d=(journal_desc *)desc_scratch;
+	d->magic=JOURNAL_MAGIC;
+	d->seq=fs->jseq;
+	uint32_t sum=2166136261u;
+	int start=fs->my_sb->journal_start+fs->jlog_pos;
+	int i;
+	for(i=0;i<JBUF_BLOCKS;i++)
 	{
-		if(same_string(entry_list[j].file_name,filename))
-			return entry_list[j].inode_id;
+		jbuf_entry *e=&fs->jbuf[i];
+		if(!e->dirty)
+			continue;
+		bcopy((unsigned char *)e->data,(unsigned char *)e->ckpt,NEW_BLOCK_SIZE);
+		e->ckpt_gen++;
+		e->dirty=FALSE;
+		e->pending=TRUE;
+		raw_block_write(fs,start+1+d->count,e->ckpt);
+		sum=journal_sum(e->ckpt,sum);
+		d->blocks[d->count++]=e->block;
+		fs->jlogged[e->block]=TRUE;
 	}
-	
-
-	return -1;
+	d->checksum=sum;
+	raw_block_write(fs,start,desc_scratch);//the commit point
+	fs->jlog_pos+=1+d->count;
+	fs->jseq++;
+	fs->jdirty=0;
+	bzero((char *)fs->jfreed,sizeof(fs->jfreed));//the frees are durable now
 }
-
-static void swap_in_last_entry(int block_id,int in_block_id,int last_block_id,int in_last_block_id)
+//commit with no operation half done: new handles wait and the running ones
+//finish first; caller holds journal_lock
+static void journal_commit(fs_t *fs)
 {
-	if(block_id==last_block_id)//same block
+	while(fs->jcommitting)
+		pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+	if(fs->jdirty==0)
+		return;
+	fs->jcommitting=TRUE;
+	while(fs->jhandles>0)
+		pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+	journal_commit_locked(fs);
+	fs->jcommitting=FALSE;
+	pthread_cond_broadcast(&fs->journal_cond);
+}
+static void journal_write(fs_t *fs,int block,char *mem)
+{
+	FS_LOCK(&fs->journal_lock);
+	int slot=fs->jbuf_slot[block];
+	//the credits keep file calls inside the log, so this is a namespace call
+	//running alone that has filled the transaction: commit its work so far
+	if((slot<0 || !fs->jbuf[slot].dirty) && fs->jdirty==JOURNAL_TXN_MAX)
+		journal_commit_locked(fs);
+	jbuf_entry *e=jbuf_get(fs,block);
+	bcopy((unsigned char *)mem,(unsigned char *)e->data,NEW_BLOCK_SIZE);
+	if(!e->dirty)
+	{
+		e->dirty=TRUE;
+		fs->jdirty++;
+	}
+	FS_UNLOCK(&fs->journal_lock);
+}
+//TRUE if jbuf had the block
+static bool_t journal_read(fs_t *fs,int block,int off,int len,char *mem)
+{
+	FS_LOCK(&fs->journal_lock);
+	int slot=fs->jbuf_slot[block];
+	if(slot>=0)
+		bcopy((unsigned char *)fs->jbuf[slot].data+off,(unsigned char *)mem,len);
+	FS_UNLOCK(&fs->journal_lock);
+	return slot>=0;
+}
+static void *journal_thread(void *arg)
+{
+	fs_t *fs=(fs_t *)arg;
+	FS_LOCK(&fs->journal_lock);
+	while(!fs->jstop)
+	{
+		struct timespec until;
+		deadline_after(JOURNAL_COMMIT_MS,&until);
+		pthread_cond_timedwait(&fs->journal_kick,&fs->journal_lock,&until);
+		journal_commit(fs);
+		journal_checkpoint(fs);
+		if(fs->jlog_pos>JOURNAL_BLOCKS/2)
+			journal_reset(fs);
+	}
+	FS_UNLOCK(&fs->journal_lock);
+	return NULL;
+}
+#endif
+//TRUE if jbuf or the log has an image of block, or the running transaction
+//freed it, which then can't take file data
+static bool_t journal_holds(fs_t *fs,int block)
+{
+	bool_t held=FALSE;
+#ifdef FAKE
+	if(fs->journal_on)
+	{
+		FS_LOCK(&fs->journal_lock);
+		held=fs->jbuf_slot[block]>=0 || fs->jlogged[block] || fs->jfreed[block];
+		FS_UNLOCK(&fs->journal_lock);
+	}
+#endif
+	return held;
+}
+//block was freed by the running transaction: keep it until the commit
+static void journal_freed(fs_t *fs,int block)
+{
+#ifdef FAKE
+	if(fs->journal_on)
+	{
+		FS_LOCK(&fs->journal_lock);
+		fs->jfreed[block]=TRUE;
+		FS_UNLOCK(&fs->journal_lock);
+	}
+#endif
+}
+//the allocator found only blocks the journal holds: write home what is
+//committed, start the log over and drop the clean jbuf entries
+static void journal_release(fs_t *fs)
+{
+#ifdef FAKE
+	if(!fs->journal_on)
+		return;
+	FS_LOCK(&fs->journal_lock);
+	journal_reset(fs);
+	int i;
+	for(i=0;i<JBUF_BLOCKS;i++)
+	{
+		jbuf_entry *e=&fs->jbuf[i];
+		if(e->block>=0 && !e->dirty && !e->writing)
+		{
+			fs->jbuf_slot[e->block]=-1;
+			e->block=-1;
+		}
+	}
+	FS_UNLOCK(&fs->journal_lock);
+#endif
+}
+//a file call changing the volume runs between these, beside other file calls
+static void txn_begin(fs_t *fs)
+{
+#ifdef FAKE
+	if(!fs->journal_on)
+		return;
+	FS_LOCK(&fs->journal_lock);
+	for(;;)
+	{
+		if(fs->jcommitting || fs->jexclusive)
+			pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+		else if(fs->jdirty+fs->jreserved+JOURNAL_HANDLE_CREDITS<=JOURNAL_TXN_MAX)
+			break;
+		else if(fs->jdirty>0)
+			journal_commit(fs);
+		else//the running handles hold the credits
+			pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+	}
+	fs->jreserved+=JOURNAL_HANDLE_CREDITS;
+	fs->jhandles++;
+	FS_UNLOCK(&fs->journal_lock);
+#endif
+}
+static void txn_end(fs_t *fs)
+{
+#ifdef FAKE
+	if(!fs->journal_on)
+		return;
+	FS_LOCK(&fs->journal_lock);
+	fs->jreserved-=JOURNAL_HANDLE_CREDITS;
+	fs->jhandles--;
+	pthread_cond_broadcast(&fs->journal_cond);
+	FS_UNLOCK(&fs->journal_lock);
+#endif
+}
+//a namespace call, which may change any number of blocks, runs alone
+static void txn_begin_ns(fs_t *fs)
+{
+#ifdef FAKE
+	if(!fs->journal_on)
+		return;
+	FS_LOCK(&fs->journal_lock);
+	while(fs->jexclusive)
+		pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+	fs->jexclusive=TRUE;//no new handles from here on
+	while(fs->jhandles>0 || fs->jcommitting)
+		pthread_cond_wait(&fs->journal_cond,&fs->journal_lock);
+	if(fs->jdirty>JOURNAL_TXN_MAX/2)//leave the call room in the transaction
+		journal_commit(fs);
+	fs->jhandles++;
+	FS_UNLOCK(&fs->journal_lock);
+#endif
+}
+static void txn_end_ns(fs_t *fs)
+{
+#ifdef FAKE
+	if(!fs->journal_on)
+		return;
+	FS_LOCK(&fs->journal_lock);
+	fs->jexclusive=FALSE;
+	fs->jhandles--;
+	pthread_cond_broadcast(&fs->journal_cond);
+	FS_UNLOCK(&fs->journal_lock);
+#endif
+}
+
+//metadata
+static void new_block_write(fs_t *fs, int block, char *mem)
+{
+#ifdef FAKE
+	if(fs->journal_on)
+	{
+		journal_write(fs,block,mem);
+		return;
+	}
+#endif
+	home_block_write(fs,block,mem);
+}
+static void new_block_read(fs_t *fs, int block, char *mem)
+{
+#ifdef FAKE
+	if(fs->journal_on && journal_read(fs,block,0,NEW_BLOCK_SIZE,mem))
+		return;
+#endif
+	home_block_read(fs,block,mem);
+}
+//len bytes at off in block, all of them in one sector
+static void new_block_read_part(fs_t *fs, int block, int off, int len, char *mem)
+{
+#ifdef FAKE
+	if(fs->journal_on && journal_read(fs,block,off,len,mem))
+		return;
+#endif
+	home_block_read_part(fs,block,off,len,mem);
+}
+
+//static helper func
+static void strcpy_safe(char *src,char *dest,int dest_max_len)//dest max len without final '\0' buffer
+{
+	if(strlen(src)>dest_max_len)
+		bcopy((unsigned char *)src,(unsigned char *)dest,dest_max_len);
+	else
+		bcopy((unsigned char *)src,(unsigned char *)dest,strlen(src));
+	dest[dest_max_len]='\0';
+}
+
+//useful var--------------------------------------
+//every call works in its own buffers, the shared state of a volume is guarded by:
+//  ns_lock      path walks, directory contents, dcache, pwd, rm_stack, freeing unlinked files
+//  inode locks  (inode_mem_table[i].lock, rwlocks) a file's data, size, block map, cursors
+//               and the map_twin blocks of its mappings;
+//               shared by calls that only read the file
+//  alloc_lock   bitmaps, superblock, the batch state; taken through batch_begin, so it nests
+//  itable_lock  rwlock per inode table block, exclusive around its read-modify-write
+//  fd_lock      fd_table, open counts, map_table & map_pool, the session table
+//  journal_lock jbuf and the log (the handles of txn_begin come before all of the above)
+//  bcache_lock  the write-back cache, under all of the others
+//they are taken in that order, and fs_init/fs_mkfs must not run beside other calls
+//on the same volume; all of it lives in the volume's fs_t, see struct fs_s
+
+static fs_t fs_pool[FS_MAX_MOUNTS];
+static fs_t *const default_fs=&fs_pool[0];
+static fs_lock_t mount_lock=FS_LOCK_INITIALIZER;//fs_pool slots
+
+//lock helper------------------------------
+static void fs_locks_init(fs_t *fs)
+{
+#ifdef FAKE
+	if(fs->locks_ready)
+		return;
+	fs->locks_ready=TRUE;
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr,PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&fs->alloc_lock,&attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&fs->ns_lock,NULL);
+	pthread_mutex_init(&fs->fd_lock,NULL);
+	pthread_mutex_init(&fs->bcache_lock,NULL);
+	pthread_cond_init(&fs->bcache_flushed,NULL);
+	pthread_cond_init(&fs->bcache_kick,NULL);
+	pthread_mutex_init(&fs->journal_lock,NULL);
+	pthread_cond_init(&fs->journal_cond,NULL);
+	pthread_cond_init(&fs->journal_kick,NULL);
+	int i;
+	for(i=0;i<INODE_BLOCK_NUMBER;i++)
+		pthread_rwlock_init(&fs->itable_lock[i],NULL);
+	//waiting writers go first, or a steady stream of readers keeps them out forever
+	pthread_rwlockattr_t rw_attr;
+	pthread_rwlockattr_init(&rw_attr);
+	pthread_rwlockattr_setkind_np(&rw_attr,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	for(i=0;i<MAX_FILE_COUNT;i++)
+		pthread_rwlock_init(&fs->inode_mem_table[i].lock,&rw_attr);
+	pthread_rwlockattr_destroy(&rw_attr);
+#endif
+}
+//an inode's lock is shared by calls that only read the file's data and the
+//cursors of their own fd, and exclusive for anything that changes the file
+static void inode_lock(fs_t *fs,int inode_id)
+{
+	FS_WRLOCK(&fs->inode_mem_table[inode_id].lock);
+}
+static void inode_rdlock(fs_t *fs,int inode_id)
+{
+	FS_RDLOCK(&fs->inode_mem_table[inode_id].lock);
+}
+static void inode_unlock(fs_t *fs,int inode_id)
+{
+	FS_RWUNLOCK(&fs->inode_mem_table[inode_id].lock);
+}
+//two inodes, lower id first so two callers can't wait on each other
+static void inode_lock_two(fs_t *fs,int a,int b)
+{
+	if(a==b)
+	{
+		inode_lock(fs,a);
+		return;
+	}
+	inode_lock(fs,a<b?a:b);
+	inode_lock(fs,a<b?b:a);
+}
+static void inode_unlock_two(fs_t *fs,int a,int b)
+{
+	inode_unlock(fs,a);
+	if(a!=b)
+		inode_unlock(fs,b);
+}
+//superblock write helper------------------
+static void sb_write(fs_t *fs)
+{
+	if(fs->meta_batch_depth)
+	{
+		fs->sb_dirty=TRUE;
+		return;
+	}
+	new_block_write(fs,SUPER_BLOCK,fs->super_block_scratch);
+#ifdef FAKE
+	if(fs->journal_on)//the backup is written with each checkpoint
+		return;
+#endif
+	new_block_write(fs,SUPER_BLOCK_BACKUP,fs->super_block_scratch);
+}
+//bitmap helper-----------------------------
+//every bitmap access is under alloc_lock, which also covers the first read
+static void bitmap_load(fs_t *fs,int i_d)
+{
+	if(i_d && !fs->dblock_bitmap_loaded)
+	{
+		new_block_read(fs,fs->my_sb->dblock_bitmap_place,fs->dblock_bitmap_block_scratch);
+		fs->dblock_bitmap_loaded=TRUE;
+	}
+	else if(!i_d && !fs->inode_bitmap_loaded)
+	{
+		new_block_read(fs,fs->my_sb->inode_bitmap_place,fs->inode_bitmap_block_scratch);
+		fs->inode_bitmap_loaded=TRUE;
+	}
+}
+
+//set bits among the first n
+static int bitmap_count(char *bitmap,int n)
+{
+	int i;
+	int count=0;
+	for(i=0;i<n;i++)
+		if(bitmap[i/8] & (1<<(i%8)))
+			count++;
+	return count;
+}
+
+static int read_bitmap_block(fs_t *fs,int i_d,int index)// 0 for inode bitmap,1 for data bitmap
+{
+	char *bitmap_block_scratch;
+	bitmap_load(fs,i_d);
+	if(i_d)
+		bitmap_block_scratch=fs->dblock_bitmap_block_scratch;
+	else
+		bitmap_block_scratch=fs->inode_bitmap_block_scratch;
+	int nbyte=index/8;
+	uint8_t the_byte=bitmap_block_scratch[nbyte];
+	int mask_off=index%8;
+	uint8_t mask=1<<mask_off;
+	return (mask & the_byte)? 1:0;
+}
+
+static void write_bitmap_block(fs_t *fs,int i_d,int index,int val) // 0 for inode bitmap,1 for data bitmap
+{
+	char *bitmap_block_scratch;
+	bitmap_load(fs,i_d);
+	if(i_d)
+		bitmap_block_scratch=fs->dblock_bitmap_block_scratch;
+	else
+		bitmap_block_scratch=fs->inode_bitmap_block_scratch;
+
+	int nbyte=index/8;
+	uint8_t the_byte=bitmap_block_scratch[nbyte];
+	int mask_off=index%8;
+	uint8_t mask=1<<mask_off;
+	the_byte = the_byte &(~mask);
+	if(val)
+		the_byte = the_byte | mask;
+
+	bitmap_block_scratch[nbyte]=the_byte;
+	
+	if(fs->meta_batch_depth)
+	{
+		if(i_d)
+			fs->dblock_bitmap_dirty=TRUE;
+		else
+			fs->inode_bitmap_dirty=TRUE;
+		return;
+	}
+	if(i_d)
+		new_block_write(fs,fs->my_sb->dblock_bitmap_place,bitmap_block_scratch);
+	else
+		new_block_write(fs,fs->my_sb->inode_bitmap_place,bitmap_block_scratch);
+}
+//between batch_begin and batch_end bitmaps and superblock change only in memory,
+//batch_end writes each of them once
+//a batch also holds alloc_lock, so everything touching the bitmaps runs inside one
+static void batch_begin(fs_t *fs)
+{
+	FS_LOCK(&fs->alloc_lock);
+	fs->meta_batch_depth++;
+}
+static void batch_end(fs_t *fs)
+{
+	if(--fs->meta_batch_depth>0)
+	{
+		FS_UNLOCK(&fs->alloc_lock);
+		return;
+	}
+	if(fs->inode_bitmap_dirty)
+		new_block_write(fs,fs->my_sb->inode_bitmap_place,fs->inode_bitmap_block_scratch);
+	if(fs->dblock_bitmap_dirty)
+		new_block_write(fs,fs->my_sb->dblock_bitmap_place,fs->dblock_bitmap_block_scratch);
+	if(fs->sb_dirty)
+		sb_write(fs);
+	fs->inode_bitmap_dirty=FALSE;
+	fs->dblock_bitmap_dirty=FALSE;
+	fs->sb_dirty=FALSE;
+	FS_UNLOCK(&fs->alloc_lock);
+}
+static int find_next_free(fs_t *fs,int i_d)//must alloc(write 1) after this function find the result
+{
+	int i;
+	int res;
+	int n;
+	if(i_d){
+		i=fs->dblock_bitmap_last;
+		for(n=0;n<DATA_BLOCK_NUMBER;n++){//the cursor's own block comes last
+			i++;
+			if(i==DATA_BLOCK_NUMBER)
+				i=0;
+			res=read_bitmap_block(fs,DBLOCK_BITMAP,i);
+			if(res==0 && !journal_holds(fs,fs->my_sb->dblock_start+i))
+			{
+				fs->dblock_bitmap_last=i;
+				return i;
+			}
+		}
+	}
+	else{
+		i=fs->inode_bitmap_last;
+		for(n=0;n<MAX_FILE_COUNT;n++){
+			i++;
+			if(i==MAX_FILE_COUNT)
+				i=0;
+			res=read_bitmap_block(fs,INODE_BITMAP,i);
+			if(res==0)
+			{
+				fs->inode_bitmap_last=i;
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+//directory lookup cache helper-----------------------------
+//FNV-1a over at most MAX_FILE_NAME chars, the same part of the name dir_entry keeps
+static uint32_t name_hash(char *name)
+{
+	uint32_t h=2166136261u;
+	int i;
+	for(i=0;i<MAX_FILE_NAME && name[i];i++)
+	{
+		h^=(uint8_t)name[i];
+		h*=16777619u;
+	}
+	return h;
+}
+static void bloom_add(uint8_t *bloom,uint32_t h)
+{
+	uint32_t h2=(h>>17)|(h<<15);
+	int k;
+	for(k=0;k<DCACHE_BLOOM_HASHES;k++)
+	{
+		uint32_t bit=(h+k*h2)%DCACHE_BLOOM_BITS;
+		bloom[bit/8]|=1<<(bit%8);
+	}
+}
+static int bloom_test(uint8_t *bloom,uint32_t h)
+{
+	uint32_t h2=(h>>17)|(h<<15);
+	int k;
+	for(k=0;k<DCACHE_BLOOM_HASHES;k++)
+	{
+		uint32_t bit=(h+k*h2)%DCACHE_BLOOM_BITS;
+		if(!(bloom[bit/8]&(1<<(bit%8))))
+			return 0;
+	}
+	return 1;
+}
+static void dcache_reset(fs_t *fs)
+{
+	bzero((char *)fs->dcache,sizeof(fs->dcache));
+	fs->dcache_clock=0;
+}
+static dir_cache *dcache_get(fs_t *fs,int dir_id)
+{
+	int i;
+	for(i=0;i<DCACHE_SLOTS;i++)
+		if(fs->dcache[i].is_using && fs->dcache[i].dir_id==dir_id)
+		{
+			fs->dcache[i].last_use=++fs->dcache_clock;
+			return &fs->dcache[i];
+		}
+	return NULL;
+}
+//install a complete bloom filter and hole counts for dir_id,
+//evict the least recently used slot if full
+static void dcache_put(fs_t *fs,int dir_id,uint8_t *bloom,uint8_t *block_free,int holes)
+{
+	dir_cache *slot=dcache_get(fs,dir_id);
+	int i;
+	if(slot==NULL)
+	{
+		slot=&fs->dcache[0];
+		for(i=0;i<DCACHE_SLOTS;i++)
+		{
+			if(!fs->dcache[i].is_using)
+			{
+				slot=&fs->dcache[i];
+				break;
+			}
+			if(fs->dcache[i].last_use<slot->last_use)
+				slot=&fs->dcache[i];
+		}
+	}
+	slot->is_using=TRUE;
+	slot->dir_id=dir_id;
+	slot->last_use=++fs->dcache_clock;
+	bcopy(bloom,slot->bloom,DCACHE_BLOOM_BYTES);
+	bcopy(block_free,slot->block_free,DATA_BLOCK_NUMBER);
+	slot->holes=holes;
+}
+//the directory is gone (or its inode id is about to be reused)
+static void dcache_forget(fs_t *fs,int dir_id)
+{
+	dir_cache *slot=dcache_get(fs,dir_id);
+	if(slot)
+		slot->is_using=FALSE;
+}
+//dblock alloc & free & read & write --------------------------
+//caller writes the whole block before anyone reads it
+static int dblock_alloc_raw(fs_t *fs)
+{
+	int search_res=-1;
+	batch_begin(fs);
+	search_res=find_next_free(fs,DBLOCK_BITMAP);
+	if(search_res<0 && fs->my_sb->dblock_count<DATA_BLOCK_NUMBER)//free ones the journal holds
+	{
+		journal_release(fs);
+		search_res=find_next_free(fs,DBLOCK_BITMAP);
+	}
+	if(search_res>=0)
+	{
+		write_bitmap_block(fs,DBLOCK_BITMAP,search_res,1);
+		fs->my_sb->dblock_count++;
+		sb_write(fs);
+		batch_end(fs);
+		return search_res;
+	}
+	batch_end(fs);
+	ERROR_MSG(("alloc data block fail"))
+	return -1;
+}
+static int dblock_alloc(fs_t *fs)
+{
+	int search_res=dblock_alloc_raw(fs);
+	if(search_res>=0)
+		home_block_write(fs,fs->my_sb->dblock_start+search_res,zero_block);
+	return search_res;
+}
+//a block shared by a reflink clone only loses one owner
+static void dblock_free(fs_t *fs,int index)
+{
+	batch_begin(fs);
+	if(fs->my_sb->dblock_share[index])
+	{
+		fs->my_sb->dblock_share[index]--;
+		sb_write(fs);
+		batch_end(fs);
+		return;
+	}
+	int temp=read_bitmap_block(fs,DBLOCK_BITMAP,index);
+	if (temp)
+	{
+		journal_freed(fs,fs->my_sb->dblock_start+index);
+		fs->my_sb->dblock_count--;
+		sb_write(fs);
+	}
+	write_bitmap_block(fs,DBLOCK_BITMAP,index,0);
+	batch_end(fs);
+}
+//caller prepare space for whole data block
+static void dblock_read(fs_t *fs,int index,char* block_buff)
+{
+	new_block_read(fs,fs->my_sb->dblock_start+index,block_buff);
+}
+//caller prepare space for whole data block
+static void dblock_write(fs_t *fs,int index,char* block_buff)
+{
+	new_block_write(fs,fs->my_sb->dblock_start+index,block_buff);
+}
+//the same for a block of file contents, which the journal leaves out
+static void dblock_write_data(fs_t *fs,int index,char* block_buff)
+{
+	home_block_write(fs,fs->my_sb->dblock_start+index,block_buff);
+}
+//data block index of the n-th block of an inode, index_buff gets the indirect index block
+static int inode_block_id(fs_t *fs,inode *p,int n,char *index_buff)
+{
+	if(n<DIRECT_BLOCK)
+		return p->blocks[n];
+	dblock_read(fs,p->blocks[DIRECT_BLOCK],index_buff);
+	return ((uint16_t *)index_buff)[n-DIRECT_BLOCK];
+}
+//same as above when the caller has read the indirect index block already
+static int block_map(inode *p,int n,char *index_buff)
+{
+	if(n<DIRECT_BLOCK)
+		return p->blocks[n];
+	return ((uint16_t *)index_buff)[n-DIRECT_BLOCK];
+}
+//inode alloc & free & read & write & init helper ----------------------------------
+static int inode_alloc(fs_t *fs)
+{
+	int search_res=-1;
+	batch_begin(fs);
+	search_res=find_next_free(fs,INODE_BITMAP);
+	if(search_res>=0)
+	{
+		write_bitmap_block(fs,INODE_BITMAP,search_res,1);
+		fs->my_sb->inode_count++;
+		sb_write(fs);
+	}
+	batch_end(fs);
+	return search_res;
+}
+
+//caller prepare space for inode and check valid
+//only the sector holding the inode is read, readers of one table block share its lock
+static void inode_read(fs_t *fs,int index,inode* inode_buff)
+{
+	FS_RDLOCK(&fs->itable_lock[index/INODE_PER_BLOCK]);
+	new_block_read_part(fs,fs->my_sb->inode_start+index/INODE_PER_BLOCK,index%INODE_PER_BLOCK*sizeof(inode),sizeof(inode),(char *)inode_buff);
+	FS_RWUNLOCK(&fs->itable_lock[index/INODE_PER_BLOCK]);
+}
+//caller prepare space for inode and check valid
+//data_only replaces just the size and block map, the part the inode lock owns
+static void inode_store(fs_t *fs,int index,inode* inode_buff,bool_t data_only)
+{
+	char temp_block_scratch[NEW_BLOCK_SIZE];
+	FS_WRLOCK(&fs->itable_lock[index/INODE_PER_BLOCK]);
+	new_block_read(fs,fs->my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
+	inode *p=(inode *)temp_block_scratch+index%INODE_PER_BLOCK;
+	if(data_only)
+	{
+		p->size=inode_buff->size;
+		bcopy((unsigned char *)inode_buff->blocks,(unsigned char *)p->blocks,sizeof(p->blocks));
+	}
+	else
+		bcopy((unsigned char *)inode_buff,(unsigned char *)p,sizeof(inode));
+	new_block_write(fs,fs->my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
+	FS_RWUNLOCK(&fs->itable_lock[index/INODE_PER_BLOCK]);
+}
+//whole inode: new inodes, and directories, which change only under ns_lock
+static void inode_write(fs_t *fs,int index,inode* inode_buff)
+{
+	inode_store(fs,index,inode_buff,FALSE);
+}
+//size & block map of a file, by a caller holding its inode lock
+static void inode_write_data(fs_t *fs,int index,inode* inode_buff)
+{
+	inode_store(fs,index,inode_buff,TRUE);
+}
+//add delta to a file's link count and return the new count; namespace calls
+//change link counts only this way, so a writer's size update can't undo them
+static int inode_links_add(fs_t *fs,int index,int delta)
+{
+	char temp_block_scratch[NEW_BLOCK_SIZE];
+	FS_WRLOCK(&fs->itable_lock[index/INODE_PER_BLOCK]);
+	new_block_read(fs,fs->my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
+	inode *p=(inode *)temp_block_scratch+index%INODE_PER_BLOCK;
+	p->link_count+=delta;
+	int links=p->link_count;
+	new_block_write(fs,fs->my_sb->inode_start+(index/INODE_PER_BLOCK),temp_block_scratch);
+	FS_RWUNLOCK(&fs->itable_lock[index/INODE_PER_BLOCK]);
+	return links;
+}
+static void inode_init(inode *p,int type) // 0 for dir , 1 for file
+{
+	p->size=0;
+	p->type=type;
+	p->link_count=1;
+	bzero((char *)p->blocks,sizeof(uint16_t)*(DIRECT_BLOCK+1));
+}
+static int inode_create(fs_t *fs,int type)// 0 for dir 1 for file , create and init ! 
+{
+	inode temp_inode;
+	int alloc_index;
+	alloc_index=inode_alloc(fs);
+	if(alloc_index<0){
+		ERROR_MSG(("no enough inode space for new inode!\n"))
+		return -1;
+	}
+	inode_init(&temp_inode,type);
+	inode_write(fs,alloc_index,&temp_inode);
+	return alloc_index;
+}
+//free the data blocks an inode points to, the inode itself is untouched
+static void inode_free_blocks(fs_t *fs,inode *p)
+{
+	int used_data_blocks;//total blocks used , not included indirect index block
+	used_data_blocks=(p->size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	if(used_data_blocks>DIRECT_BLOCK)//use indirect block
+	{
+		char index_scratch[NEW_BLOCK_SIZE];
+		dblock_read(fs,p->blocks[DIRECT_BLOCK],index_scratch);
+		int i;
+		for(i=0;i<=DIRECT_BLOCK;i++)
+			dblock_free(fs,p->blocks[i]);
+		uint16_t *block_list=(uint16_t *)index_scratch;
+		for(i=0;i<used_data_blocks-DIRECT_BLOCK;i++)
+			dblock_free(fs,block_list[i]);
+	}
+	else{
+		int i;
+		for(i=0;i<used_data_blocks;i++)
+			dblock_free(fs,p->blocks[i]);
+	}
+}
+//free inode index whose content the caller already has in *p, also free its data
+static void inode_release(fs_t *fs,int index,inode *p)
+{
+	batch_begin(fs);
+	inode_free_blocks(fs,p);
+	if(p->type==MY_DIRECTORY)
+		dcache_forget(fs,index);
+	write_bitmap_block(fs,INODE_BITMAP,index,0);
+	fs->my_sb->inode_count--;
+	sb_write(fs);
+	batch_end(fs);
+}
+static void inode_free(fs_t *fs,int index)//free the inode, also free its data
+{
+	inode inode_temp;
+	batch_begin(fs);
+	if (read_bitmap_block(fs,INODE_BITMAP,index))
+	{
+		inode_read(fs,index,&inode_temp);
+		inode_release(fs,index,&inode_temp);
+	}
+	batch_end(fs);
+}
+//this doesn't change inode.size
+static int alloc_dblock_mount_to_inode(fs_t *fs,int inode_id)
+{
+	int alloc_res;
+	inode temp;
+	inode_read(fs,inode_id,&temp);
+	int next_block=(temp.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;//start from 0 , mean the next in-inode blocks id
+	if(next_block>MAX_BLOCKS_INDEX_IN_INODE)
+	{
+		ERROR_MSG(("beyond one inode can handle!\n"))
+		return -1;
+	}
+	if(next_block>=DIRECT_BLOCK)//need indirect block
+	{
+		if(next_block==DIRECT_BLOCK)//need indirect block ,but the indirect index block has not been alloced
+		{
+			alloc_res=dblock_alloc(fs);
+			if(alloc_res<0)
+				return -1;
+			temp.blocks[DIRECT_BLOCK]=alloc_res;
+		}
+		char index_scratch[NEW_BLOCK_SIZE];
+		dblock_read(fs,temp.blocks[DIRECT_BLOCK],index_scratch);
+		uint16_t *block_list=(uint16_t *)index_scratch;
+		
+		alloc_res=dblock_alloc(fs);
+		if(alloc_res<0){
+			if(next_block==DIRECT_BLOCK)
+				dblock_free(fs,temp.blocks[DIRECT_BLOCK]);
+			return -1;
+		}
+		block_list[next_block-DIRECT_BLOCK]=alloc_res;
+		dblock_write(fs,temp.blocks[DIRECT_BLOCK],index_scratch);
+	}
+	else
+	{
+		alloc_res=dblock_alloc(fs);
+		if(alloc_res<0)
+			return -1;
+		temp.blocks[next_block]=alloc_res;
+	}
+	// ERROR_MSG(("inode %d need a block in-inode id %d, alloc_res %d\n",inode_id,next_block,alloc_res))
+	inode_write(fs,inode_id,&temp);
+	return alloc_res;
+}
+
+//directories ---------------------------------------------------
+
+//scan the first n entries of a directory block for filename, return its slot or -1
+//with name hashes on disk only the hash words are touched until one matches,
+//older images fall back to comparing every name
+static int dir_block_scan(fs_t *fs,dir_entry *entry_list,int n,char *filename,uint32_t h)
+{
+	int j;
+	if(fs->my_sb->features & SB_FEATURE_NAME_HASH)
+	{
+		for(j=0;j<n;j++)
+			if(entry_list[j].name_hash==h && same_string(entry_list[j].file_name,filename))
+				return j;
+		return -1;
+	}
+	for(j=0;j<n;j++)
+		if(same_string(entry_list[j].file_name,filename))
+			return j;
+	return -1;
+}
+
+//this func doesn't check same filename,so we may need to use find before we really insert one file to dir 
+static int dir_entry_add(fs_t *fs,int dir_index,int son_index,char *filename)
+{
+	//ERROR_MSG(("create new_file %s ,in dir %d,new_inode %d,\n",filename,dir_index,son_index))
+	//read_bitmap_block(INODE_BITMAP,dir_index)
+	inode dir_inode;
+	inode_read(fs,dir_index,&dir_inode);
+	int next_i;
+	next_i=dir_inode.size/(sizeof(dir_entry));
+	int next_i_inblock;
+	next_i_inblock=next_i/DIR_ENTRY_PER_BLOCK;
+
+	char index_scratch[NEW_BLOCK_SIZE];
+	char entry_scratch[NEW_BLOCK_SIZE];
+	dir_entry new_entry;
+	bzero((char *)&new_entry,sizeof(dir_entry));
+	new_entry.inode_id=son_index;
+	strcpy_safe(filename,new_entry.file_name,MAX_FILE_NAME);
+	new_entry.name_hash=name_hash(new_entry.file_name);
+	new_entry.name_len=strlen(new_entry.file_name);
+
+	dir_cache *cached=dcache_get(fs,dir_index);
+	int total_block_num=(next_i-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	if(cached && cached->holes>0)//reuse an empty slot, one block read and one write
+	{
+		int i,j;
+		for(i=0;i<total_block_num && cached->block_free[i]==0;i++)
+			;
+		int entry_block=-1;
+		if(i<total_block_num)
+		{
+			entry_block=inode_block_id(fs,&dir_inode,i,index_scratch);
+			dblock_read(fs,entry_block,entry_scratch);
+		}
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		for(j=0;i<total_block_num && j<DIR_ENTRY_PER_BLOCK && i*DIR_ENTRY_PER_BLOCK+j<next_i;j++)
+			if(entry_list[j].file_name[0]=='\0')
+			{
+				entry_list[j]=new_entry;
+				dblock_write(fs,entry_block,entry_scratch);
+				cached->block_free[i]--;
+				cached->holes--;
+				bloom_add(cached->bloom,new_entry.name_hash);
+				return 0;
+			}
+		cached->holes=0;//counts were off, stop trusting them
+	}
+
+	if(next_i%DIR_ENTRY_PER_BLOCK==0)//need new block
+	{	
+		int alloc_res=alloc_dblock_mount_to_inode(fs,dir_index);
+		if(alloc_res<0)
+		{
+			ERROR_MSG(("can't alloc dblock when insert dir_entry into dir\n"))
+			return -1;
+		}
+		//update inode 
+		inode_read(fs,dir_index,&dir_inode);
+
+		dblock_read(fs,alloc_res,entry_scratch);
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		entry_list[0]=new_entry;
+		dblock_write(fs,alloc_res,entry_scratch);
+	}
+	else
+	{
+		if(next_i_inblock>=DIRECT_BLOCK){//indirect block
+			dblock_read(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+			uint16_t *block_list=(uint16_t *)index_scratch;
+			next_i_inblock=block_list[next_i_inblock-DIRECT_BLOCK];//get real block no
+		}
+		else
+		{
+			//real block no is dir_inode.blocks[next_i_inblock]
+			next_i_inblock=dir_inode.blocks[next_i_inblock];
+		}
+
+		dblock_read(fs,next_i_inblock,entry_scratch);
+
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		entry_list[next_i%DIR_ENTRY_PER_BLOCK]=new_entry;
+		
+		dblock_write(fs,next_i_inblock,entry_scratch);
+	}
+
+	dir_inode.size+=sizeof(dir_entry);
+	inode_write(fs,dir_index,&dir_inode);//update dir inode
+
+	if(cached)
+		bloom_add(cached->bloom,new_entry.name_hash);
+	return 0;
+}
+//if match return inode id else return -1
+//so we may need to use find before we really insert one file to dir 
+//a miss that scanned the whole directory leaves a bloom filter in dcache,
+//so the next lookup of an absent name needs no block read
+static int dir_entry_find(fs_t *fs,int dir_index,char *filename)
+{
+	uint32_t h=name_hash(filename);
+	dir_cache *cached=dcache_get(fs,dir_index);
+	if(cached!=NULL && !bloom_test(cached->bloom,h))
+		return -1;
+
+	inode dir_inode;
+	inode_read(fs,dir_index,&dir_inode);
+	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
+	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	uint8_t bloom[DCACHE_BLOOM_BYTES];
+	uint8_t block_free[DATA_BLOCK_NUMBER];
+	int holes=0;
+	char index_scratch[NEW_BLOCK_SIZE];
+	char entry_scratch[NEW_BLOCK_SIZE];
+	bzero((char *)bloom,DCACHE_BLOOM_BYTES);
+	bzero((char *)block_free,DATA_BLOCK_NUMBER);
+
+	if(total_block_num>DIRECT_BLOCK)
+		dblock_read(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+	uint16_t *block_list=(uint16_t *)index_scratch;
+
+	int i,j,entry_block,final_end;
+	for(i=0;i<total_block_num;i++)
+	{
+		if(i<DIRECT_BLOCK)
+			entry_block=dir_inode.blocks[i];
+		else
+			entry_block=block_list[i-DIRECT_BLOCK];
+		dblock_read(fs,entry_block,entry_scratch);
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		if(i==total_block_num-1)//last block
+			final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
+		else
+			final_end=DIR_ENTRY_PER_BLOCK-1;
+		j=dir_block_scan(fs,entry_list,final_end+1,filename,h);
+		if(j>=0)
+			return entry_list[j].inode_id;
+		for(j=0;j<=final_end;j++)
+		{
+			if(entry_list[j].file_name[0]=='\0')
+			{
+				block_free[i]++;
+				holes++;
+			}
+			else if(fs->my_sb->features & SB_FEATURE_NAME_HASH)
+				bloom_add(bloom,entry_list[j].name_hash);
+			else
+				bloom_add(bloom,name_hash(entry_list[j].file_name));
+		}
+	}
+	//every entry has been seen, so the filter is complete
+	dcache_put(fs,dir_index,bloom,block_free,holes);
+	return -1;
+}
+
+static void swap_in_last_entry(fs_t *fs,int block_id,int in_block_id,int last_block_id,int in_last_block_id)
+{
+	char entry_scratch[NEW_BLOCK_SIZE];
+	char last_scratch[NEW_BLOCK_SIZE];
+	if(block_id==last_block_id)//same block
+	{
+		if(in_block_id==in_last_block_id)//same
+			return ;
+		dblock_read(fs,block_id,entry_scratch);
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		entry_list[in_block_id]=entry_list[in_last_block_id];
+		dblock_write(fs,block_id,entry_scratch);
+	}
+	else
+	{
+		dblock_read(fs,block_id,entry_scratch);
+		dblock_read(fs,last_block_id,last_scratch);
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		dir_entry *entry_list_last=(dir_entry *)last_scratch;
+		entry_list[in_block_id]=entry_list_last[in_last_block_id];
+		dblock_write(fs,block_id,entry_scratch);
+	}
+}
+
+//free the directory blocks from the n-th on, and the indirect index block if it's no longer needed
+static void dir_blocks_truncate(fs_t *fs,inode *dir_inode,int n,int total_block_num)
+{
+	char index_scratch[NEW_BLOCK_SIZE];
+	int i;
+	if(total_block_num>DIRECT_BLOCK)
+		dblock_read(fs,dir_inode->blocks[DIRECT_BLOCK],index_scratch);
+	batch_begin(fs);
+	for(i=n;i<total_block_num;i++)
+		dblock_free(fs,block_map(dir_inode,i,index_scratch));
+	if(n<=DIRECT_BLOCK && total_block_num>DIRECT_BLOCK)
+		dblock_free(fs,dir_inode->blocks[DIRECT_BLOCK]);
+	batch_end(fs);
+}
+
+//squeeze the empty slots out of a directory, entries keep their order
+//every block is read once and only the blocks that stay are written
+static void dir_compact(fs_t *fs,int dir_index,inode *dir_inode,dir_cache *cached)
+{
+	char index_scratch[NEW_BLOCK_SIZE];
+	char src_scratch[NEW_BLOCK_SIZE];
+	char dest_scratch[NEW_BLOCK_SIZE];
+	dir_entry *src=(dir_entry *)src_scratch;
+	dir_entry *dest=(dir_entry *)dest_scratch;
+	int total_entry_num=dir_inode->size/(sizeof(dir_entry));
+	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	int i,j,live=0;
+	bzero(dest_scratch,NEW_BLOCK_SIZE);
+	if(total_block_num>DIRECT_BLOCK)
+		dblock_read(fs,dir_inode->blocks[DIRECT_BLOCK],index_scratch);
+	for(i=0;i<total_block_num;i++)
+	{
+		//a destination block is never behind its source, so it has been read already
+		dblock_read(fs,block_map(dir_inode,i,index_scratch),src_scratch);
+		for(j=0;j<DIR_ENTRY_PER_BLOCK && i*DIR_ENTRY_PER_BLOCK+j<total_entry_num;j++)
+		{
+			if(src[j].file_name[0]=='\0')
+				continue;
+			dest[live%DIR_ENTRY_PER_BLOCK]=src[j];
+			live++;
+			if(live%DIR_ENTRY_PER_BLOCK==0)
+			{
+				dblock_write(fs,block_map(dir_inode,live/DIR_ENTRY_PER_BLOCK-1,index_scratch),dest_scratch);
+				bzero(dest_scratch,NEW_BLOCK_SIZE);
+			}
+		}
+	}
+	if(live%DIR_ENTRY_PER_BLOCK)
+		dblock_write(fs,block_map(dir_inode,live/DIR_ENTRY_PER_BLOCK,index_scratch),dest_scratch);
+	dir_blocks_truncate(fs,dir_inode,(live-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK,total_block_num);
+	dir_inode->size=live*sizeof(dir_entry);
+	inode_write(fs,dir_index,dir_inode);
+	bzero((char *)cached->block_free,DATA_BLOCK_NUMBER);
+	cached->holes=0;
+}
+
+//empty slot j of the dir's i-th block, whose content is in entry_scratch, in one block write
+//empty slots at the end of the directory are cut off instead, and a directory
+//that has become mostly holes is compacted
+static int dir_entry_punch(fs_t *fs,int dir_index,inode *dir_inode,int i,int entry_block,char *entry_scratch,int j)
+{
+	dir_entry *entry_list=(dir_entry *)entry_scratch;
+	dir_cache *cached=dcache_get(fs,dir_index);
+	int total_entry_num=dir_inode->size/(sizeof(dir_entry));
+	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	bzero((char *)&entry_list[j],sizeof(dir_entry));
+	if(i*DIR_ENTRY_PER_BLOCK+j==total_entry_num-1)//last entry
+	{
+		int k=j;
+		while(k>=0 && entry_list[k].file_name[0]=='\0')
+			k--;
+		if(cached)
+		{
+			cached->holes-=j-k-1;
+			cached->block_free[i]-=j-k-1;
+		}
+		total_entry_num-=j-k;
+		if(k<0)//the block is empty now
+			dir_blocks_truncate(fs,dir_inode,i,total_block_num);
+		else
+			dblock_write(fs,entry_block,entry_scratch);
+		dir_inode->size=total_entry_num*sizeof(dir_entry);
+		inode_write(fs,dir_index,dir_inode);
+		return 0;
+	}
+	dblock_write(fs,entry_block,entry_scratch);
+	if(cached)
+	{
+		cached->holes++;
+		cached->block_free[i]++;
+		if(cached->holes*DIR_COMPACT_RATIO>total_entry_num && total_block_num>1)
+			dir_compact(fs,dir_index,dir_inode,cached);
+	}
+	return 0;
+}
+
+static int dir_entry_delete(fs_t *fs,int dir_index,char *filename)//unlink call in this func , and this only affect one node
+{
+	inode dir_inode;
+	inode_read(fs,dir_index,&dir_inode);
+	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
+	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	if(total_entry_num==0)
+		return -1;
+	
+	int last_block_id;
+	int in_last_block_id=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)%DIR_ENTRY_PER_BLOCK;
+
+	char index_scratch[NEW_BLOCK_SIZE];
+	char entry_scratch[NEW_BLOCK_SIZE];
+	int free_indirect_index_block_flag=0;
+	if(total_block_num<=DIRECT_BLOCK){
+		last_block_id=dir_inode.blocks[total_block_num-1];
+	}
+	else{
+		dblock_read(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+		uint16_t *block_list=(uint16_t *)index_scratch;
+		last_block_id=block_list[total_block_num-1-DIRECT_BLOCK];
+		if(total_block_num==DIRECT_BLOCK+1)
+			free_indirect_index_block_flag=1;
+	}
+	
+
+	//index_scratch holds the indirect index block if there is one
+	uint16_t *block_list=(uint16_t *)index_scratch;
+	uint32_t h=name_hash(filename);
+	int i,j,entry_block,final_end;
+	for(i=0;i<total_block_num;i++)
+	{
+		if(i<DIRECT_BLOCK)
+			entry_block=dir_inode.blocks[i];
+		else
+			entry_block=block_list[i-DIRECT_BLOCK];
+		dblock_read(fs,entry_block,entry_scratch);
+		dir_entry *entry_list=(dir_entry *)entry_scratch;
+		if(i==total_block_num-1)//last block
+			final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
+		else
+			final_end=DIR_ENTRY_PER_BLOCK-1;
+		j=dir_block_scan(fs,entry_list,final_end+1,filename,h);
+		if(j<0)
+			continue;
+		if(fs->my_sb->features & SB_FEATURE_DIR_HOLES)
+			return dir_entry_punch(fs,dir_index,&dir_inode,i,entry_block,entry_scratch,j);
+		swap_in_last_entry(fs,entry_block,j,last_block_id,in_last_block_id);
+		if(in_last_block_id==0)//need to free dblock
+		{
+			dblock_free(fs,last_block_id);
+			if(free_indirect_index_block_flag)//also need to free indirect dblock
+				dblock_free(fs,dir_inode.blocks[DIRECT_BLOCK]);	
+		}
+		dir_inode.size-=sizeof(dir_entry);
+		inode_write(fs,dir_index,&dir_inode);
+		return 0;
+	}
+	return -1;
+}
+//point filename in dir_index at new_inode (if >=0) and rename it to new_name (if not NULL)
+//the entry stays in its slot, so this is a single block write
+static int dir_entry_update(fs_t *fs,int dir_index,char *filename,int new_inode,char *new_name)
+{
+	uint32_t h=name_hash(filename);
+	dir_cache *cached=dcache_get(fs,dir_index);
+	if(cached!=NULL && !bloom_test(cached->bloom,h))
+		return -1;
+	inode dir_inode;
+	inode_read(fs,dir_index,&dir_inode);
+	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
+	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	char index_scratch[NEW_BLOCK_SIZE];
+	char entry_scratch[NEW_BLOCK_SIZE];
+	dir_entry *entry_list=(dir_entry *)entry_scratch;
+	if(total_block_num>DIRECT_BLOCK)
+		dblock_read(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+	int i,j,entry_block,final_end;
+	for(i=0;i<total_block_num;i++)
+	{
+		entry_block=block_map(&dir_inode,i,index_scratch);
+		dblock_read(fs,entry_block,entry_scratch);
+		if(i==total_block_num-1)//last block
+			final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
+		else
+			final_end=DIR_ENTRY_PER_BLOCK-1;
+		j=dir_block_scan(fs,entry_list,final_end+1,filename,h);
+		if(j<0)
+			continue;
+		if(new_inode>=0)
+			entry_list[j].inode_id=new_inode;
+		if(new_name!=NULL)
+		{
+			bzero(entry_list[j].file_name,MAX_FILE_NAME+1);
+			strcpy_safe(new_name,entry_list[j].file_name,MAX_FILE_NAME);
+			entry_list[j].name_hash=name_hash(entry_list[j].file_name);
+			entry_list[j].name_len=strlen(entry_list[j].file_name);
+			if(cached)
+				bloom_add(cached->bloom,entry_list[j].name_hash);
+		}
+		dblock_write(fs,entry_block,entry_scratch);
+		return 0;
+	}
+	return -1;
+}
+//--- file descriptor helper---------------------------------------------
+//these func just handle fd_table , won't delete inode & data
+//all of them take fd_lock themselves
+static void fd_table_reset(fs_t *fs)
+{
+	int i;
+	bzero((char *)fs->fd_table,sizeof(fs->fd_table));
+	bzero((char *)fs->fd_used,sizeof(fs->fd_used));
+	bzero((char *)fs->fd_full,sizeof(fs->fd_full));
+	for(i=0;i<MAX_FILE_COUNT;i++)//the locks stay as they are
+		fs->inode_mem_table[i].open_count=0;
+	bzero((char *)fs->map_table,sizeof(fs->map_table));
+	bzero((char *)fs->sessions,sizeof(fs->sessions));
+	bzero((char *)fs->map_pool_used,sizeof(fs->map_pool_used));
+}
+//lowest free fd, found through the two bitmap levels, -1 if the table is full
+//caller holds fd_lock
+static int fd_lowest_free(fs_t *fs)
+{
+	int i;
+	for(i=0;i<FD_FULL_WORDS;i++)
+		if(~fs->fd_full[i])
+		{
+			int word=i*32+__builtin_ctz(~fs->fd_full[i]);
+			if(word>=FD_WORDS)
+				break;
+			return word*32+__builtin_ctz(~fs->fd_used[word]);
+		}
+	return -1;
+}
+//take the lowest free fd for inode_id
+static int fd_open(fs_t *fs,int inode_id, int mode)
+{
+	FS_LOCK(&fs->fd_lock);
+	int fd=fd_lowest_free(fs);
+	if(fd<0)
+	{
+		FS_UNLOCK(&fs->fd_lock);
+		ERROR_MSG(("Not enough file descriptor!\n"))
+		return -1;
+	}
+	fs->fd_used[fd/32]|=1u<<(fd%32);
+	if(fs->fd_used[fd/32]==0xffffffffu)
+		fs->fd_full[fd/1024]|=1u<<(fd/32%32);
+	fs->fd_table[fd].is_using = TRUE;
+	fs->fd_table[fd].cursor = 0;
+	fs->fd_table[fd].inode_id = inode_id;
+	fs->fd_table[fd].mode = mode&FS_O_ACCMODE;
+	fs->fd_table[fd].append = (mode&FS_O_APPEND)!=0;
+	fs->inode_mem_table[inode_id].open_count++;
+	FS_UNLOCK(&fs->fd_lock);
+	return fd;
+}
+static void fd_close(fs_t *fs,int fd)
+{
+	FS_LOCK(&fs->fd_lock);
+	fs->fd_table[fd].is_using = FALSE;
+	fs->fd_used[fd/32]&=~(1u<<(fd%32));
+	fs->fd_full[fd/1024]&=~(1u<<(fd/32%32));
+	FS_UNLOCK(&fs->fd_lock);
+}
+//how many fds and mappings hold inode_id open
+static int fd_find_same_num(fs_t *fs,int inode_id)
+{
+	FS_LOCK(&fs->fd_lock);
+	int count=fs->inode_mem_table[inode_id].open_count;
+	FS_UNLOCK(&fs->fd_lock);
+	return count;
+}
+//drop a reference taken by fd_open or fs_mmap, an unlinked file goes with the last one
+//caller holds ns_lock, so the file can't be unlinked or opened again meanwhile
+static void inode_put(fs_t *fs,int inode_id)
+{
+	FS_LOCK(&fs->fd_lock);
+	int left=--fs->inode_mem_table[inode_id].open_count;
+	FS_UNLOCK(&fs->fd_lock);
+	if(left>0)
+		return;
+	inode temp;
+	inode_read(fs,inode_id,&temp);
+	if(temp.link_count==0)//need to free the file
+		inode_free(fs,inode_id);
+}
+//--- path resolve------------------------------------
+
+//create an empty directory called filename in parent, caller checks the name is free
+static int dir_create(fs_t *fs,int parent,char *filename)
+{
+	if(strlen(filename)>MAX_FILE_NAME)
+	{
+		ERROR_MSG(("Too long file name!\n"))
+		return -1;
+	}
+	int new_inode=inode_create(fs,MY_DIRECTORY);
+	if(new_inode<0)
+		return -1;
+	if(dir_entry_add(fs,new_inode,new_inode,".")<0){
+		inode_free(fs,new_inode);
+		return -1;
+	}
+	if(dir_entry_add(fs,new_inode,parent,"..")<0){
+		inode_free(fs,new_inode);
+		return -1;
+	}
+	if(dir_entry_add(fs,parent,new_inode,filename)<0){
+		inode_free(fs,new_inode);
+		return -1;
+	}
+	return new_inode;
+}
+
+//walk file_path from temp_pwd in one pass, without copying the path
+//fills res with the leaf's parent, name and inode, and returns the leaf's inode id or -1
+//with mkdirs set, missing directories before the leaf are created on the way
+static int path_walk(fs_t *fs,char *file_path,int temp_pwd,path_walk_res *res,int mkdirs)
+{
+	res->parent=-1;
+	res->leaf_id=-1;
+	res->dir_only=FALSE;
+	res->leaf[0]='\0';
+	if(file_path==NULL){
+		ERROR_MSG(("No path input!\n"))
+		return -1;
+	}
+	int path_len=strlen(file_path);
+	if(path_len>MAX_PATH_NAME){
+		ERROR_MSG(("too long path!\n"))
+		return -1;
+	}
+	if(path_len==0)
+	{
+		ERROR_MSG(("no path input!\n"))
+		return -1;
+	}
+
+	char *p=file_path;
+	if(*p=='/')//absolute path
+	{
+		temp_pwd=ROOT_DIR_ID;
+		while(*p=='/')
+			p++;
+	}
+	if(*p=='\0')//root itself
+	{
+		res->dir_only=TRUE;
+		res->leaf_id=temp_pwd;
+		return temp_pwd;
+	}
+	while(1)
 	{
-		if(in_block_id==in_last_block_id)//same
-			return ;
-		dblock_read(block_id,block_scratch);
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		entry_list[in_block_id]=entry_list[in_last_block_id];
-		dblock_write(block_id,block_scratch);
+		//cut one component, names longer than MAX_FILE_NAME+1 can't match anyway
+		int n=0;
+		while(*p!='/' && *p!='\0')
+		{
+			if(n<=MAX_FILE_NAME)
+				res->leaf[n++]=*p;
+			p++;
+		}
+		res->leaf[n]='\0';
+		while(*p=='/')//a//b is a/b
+			p++;
+		if(*p=='\0')//we reach the last item
+		{
+			res->dir_only=(p[-1]=='/');
+			res->parent=temp_pwd;
+			res->leaf_id=dir_entry_find(fs,temp_pwd,res->leaf);
+			return res->leaf_id;
+		}
+		int next=dir_entry_find(fs,temp_pwd,res->leaf);
+		if(next<0)
+		{
+			if(!mkdirs)
+				return -1;
+			next=dir_create(fs,temp_pwd,res->leaf);
+			if(next<0)
+				return -1;
+		}
+		else
+		{
+			inode temp;
+			inode_read(fs,next,&temp);
+			if(temp.type!=MY_DIRECTORY)
+			{
+				ERROR_MSG(("%s is a data file not a path!\n",res->leaf))
+				return -1;
+			}
+		}
+		temp_pwd=next;
+	}
+}
+//mode MY_DIRECTORY 0, REAL_FILE 1
+//mode 0 allow input d/ or d , 1 find file's inode
+static int path_resolve(fs_t *fs,char * file_path , int temp_pwd ,int mode)
+{
+	path_walk_res res;
+	//real file mode need to check last char
+	if(mode!=MY_DIRECTORY && file_path!=NULL)
+	{
+		int path_len=strlen(file_path);
+		if(path_len>0 && path_len<=MAX_PATH_NAME && file_path[path_len-1]=='/')//root or end up with /
+		{
+			ERROR_MSG(("try to find a file but input a path!\n"))
+			return -1;
+		}
+	}
+	return path_walk(fs,file_path,temp_pwd,&res,0);
+}
+
+//iovec stream helpers-------------------------------
+//total bytes of iov[0..iovcnt-1], -1 if a length is negative or the sum overflows
+static int iov_total(fs_iovec *iov,int iovcnt)
+{
+	int i;
+	int total=0;
+	if(iovcnt<0||iovcnt>FS_IOV_MAX)
+		return -1;
+	for(i=0;i<iovcnt;i++)
+	{
+		if(iov[i].len<0||iov[i].len>MAX_FILE_SIZE-total)
+			return -1;
+		total+=iov[i].len;
+	}
+	return total;
+}
+static void iov_cursor_init(iov_cursor *c,fs_iovec *iov,int iovcnt)
+{
+	c->iov=iov;
+	c->iovcnt=iovcnt;
+	c->i=0;
+	c->off=0;
+}
+//the next n bytes if they lie in one buffer, else NULL
+static char *iov_contig(iov_cursor *c,int n)
+{
+	while(c->i<c->iovcnt && c->off==c->iov[c->i].len)
+	{
+		c->i++;
+		c->off=0;
+	}
+	if(c->i<c->iovcnt && c->iov[c->i].len-c->off>=n)
+		return c->iov[c->i].base+c->off;
+	return NULL;
+}
+//copy n bytes between mem and the stream, then advance past them
+static void iov_copy(iov_cursor *c,char *mem,int n,bool_t to_iov)
+{
+	while(n>0)
+	{
+		int left=c->iov[c->i].len-c->off;
+		if(left==0)
+		{
+			c->i++;
+			c->off=0;
+			continue;
+		}
+		int step=left<n?left:n;
+		if(to_iov)
+			bcopy((unsigned char *)mem,(unsigned char *)(c->iov[c->i].base+c->off),step);
+		else
+			bcopy((unsigned char *)(c->iov[c->i].base+c->off),(unsigned char *)mem,step);
+		mem+=step;
+		c->off+=step;
+		n-=step;
+	}
+}
+static void iov_skip(iov_cursor *c,int n)
+{
+	while(n>0)
+	{
+		int left=c->iov[c->i].len-c->off;
+		int step=left<n?left:n;
+		c->off+=step;
+		n-=step;
+		if(c->off==c->iov[c->i].len)
+		{
+			c->i++;
+			c->off=0;
+		}
+	}
+}
+
+//file data read & write------------------------------
+//read the iov stream's worth of inode_id starting at byte offset, return bytes read
+//the inode and index block are read once, each data block at most once,
+//whole blocks landing in one buffer go there without a copy
+static int file_readv(fs_t *fs,int inode_id, fs_iovec *iov, int iovcnt, uint32_t offset)
+{
+	int count=iov_total(iov,iovcnt);
+	if (count<=0)
+	{
+		return 0;
+	}
+	inode temp_file;
+	inode_read(fs,inode_id,&temp_file);
+	char index_scratch[NEW_BLOCK_SIZE];
+	char data_scratch[NEW_BLOCK_SIZE];
+	
+	if(offset>=temp_file.size)
+		return 0;
+	if(offset+count>temp_file.size)
+		count=temp_file.size-offset;
+
+	int first_block=offset/NEW_BLOCK_SIZE;
+	int end_block=(offset+count-1)/NEW_BLOCK_SIZE;
+	if(end_block>=DIRECT_BLOCK)
+		dblock_read(fs,temp_file.blocks[DIRECT_BLOCK],index_scratch);
+
+	iov_cursor c;
+	iov_cursor_init(&c,iov,iovcnt);
+	int real_count=0;
+	int n;
+	for(n=first_block;n<=end_block;n++)
+	{
+		int now_block_id=block_map(&temp_file,n,index_scratch);
+		int in_block=(offset+real_count)%NEW_BLOCK_SIZE;
+		int rdy_count=NEW_BLOCK_SIZE-in_block;
+		if(rdy_count>count-real_count)
+			rdy_count=count-real_count;
+		char *direct=rdy_count==NEW_BLOCK_SIZE?iov_contig(&c,NEW_BLOCK_SIZE):NULL;
+		if(direct)
+		{
+			dblock_read(fs,now_block_id,direct);
+			iov_skip(&c,NEW_BLOCK_SIZE);
+		}
+		else
+		{
+			dblock_read(fs,now_block_id,data_scratch);
+			iov_copy(&c,data_scratch+in_block,rdy_count,TRUE);
+		}
+		real_count+=rdy_count;
+	}
+	return real_count;
+}
+
+//write the iov stream to inode_id at byte *offset_p (OFFSET_APPEND for the end),
+//growing the file as needed, and leave *offset_p just past the written bytes
+//return bytes written, less than asked when the disk or the inode fills up
+//new blocks are allocated in one bitmap batch and never read, each touched
+//block is written once, the index block and the inode at most once
+//with log_writes every overwritten block is remapped like a shared one, so
+//scattered small overwrites land one after another at the allocation cursor;
+//the old block is freed in the same batch, which the journal that log_writes
+//requires commits together with the inode pointing away from it
+static int file_writev(fs_t *fs,int inode_id, fs_iovec *iov, int iovcnt, uint32_t *offset_p)
+{
+	int count=iov_total(iov,iovcnt);
+	if (count<=0)
+	{
+		return 0;
+	}
+	inode temp_file;
+	inode_read(fs,inode_id,&temp_file);
+	int temp_size=temp_file.size;
+	uint32_t offset=*offset_p==OFFSET_APPEND?temp_file.size:*offset_p;
+
+	int total_block_num=(temp_size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	int end_block_num=(offset+count-1)/NEW_BLOCK_SIZE+1;
+	if(end_block_num>MAX_BLOCKS_INDEX_IN_INODE)
+	{
+		ERROR_MSG(("beyond one inode can handle!\n"))
+		end_block_num=MAX_BLOCKS_INDEX_IN_INODE;
+	}
+	char index_scratch[NEW_BLOCK_SIZE];
+	char data_scratch[NEW_BLOCK_SIZE];
+	char last_scratch[NEW_BLOCK_SIZE];
+	bool_t index_dirty=FALSE;
+	if(total_block_num>DIRECT_BLOCK && end_block_num>DIRECT_BLOCK)
+		dblock_read(fs,temp_file.blocks[DIRECT_BLOCK],index_scratch);
+	uint16_t *block_list=(uint16_t *)index_scratch;
+
+	int first_block=offset/NEW_BLOCK_SIZE;
+	int n;
+	//a partially written block that gets remapped keeps its old bytes here,
+	//read before the old block is freed: data_scratch for first_block,
+	//last_scratch for the last block when it is another one
+	bool_t cow_first=FALSE;
+	bool_t cow_last=FALSE;
+	bool_t remapped=FALSE;
+	bool_t relocate=fs->log_writes;
+	batch_begin(fs);
+	//blocks shared with a clone are moved to a private copy before the write
+	for(n=first_block;n<end_block_num && n<total_block_num;n++)
+	{
+		int old_id=block_map(&temp_file,n,index_scratch);
+		if(fs->my_sb->dblock_share[old_id]==0 && !relocate)
+			continue;
+		int copy_id=dblock_alloc_raw(fs);
+		if(copy_id<0 && fs->my_sb->dblock_share[old_id]==0)//disk full: the rest is written in place
+		{
+			relocate=FALSE;
+			continue;
+		}
+		if(copy_id<0)
+		{
+			end_block_num=n;
+			break;
+		}
+		if(n<DIRECT_BLOCK)
+			temp_file.blocks[n]=copy_id;
+		else
+		{
+			block_list[n-DIRECT_BLOCK]=copy_id;
+			index_dirty=TRUE;
+		}
+		remapped=TRUE;
+		bool_t partial=n==first_block?offset%NEW_BLOCK_SIZE || offset+count<(uint32_t)(n+1)*NEW_BLOCK_SIZE
+			:offset+count<(uint32_t)(n+1)*NEW_BLOCK_SIZE;
+		if(partial && n==first_block)
+		{
+			dblock_read(fs,old_id,data_scratch);
+			cow_first=TRUE;
+		}
+		else if(partial)//only the last block can be partial besides the first
+		{
+			dblock_read(fs,old_id,last_scratch);
+			cow_last=TRUE;
+		}
+		dblock_free(fs,old_id);//a shared one only loses our share
+	}
+
+	int got=total_block_num;
+	while(got<end_block_num)
+	{
+		if(got==DIRECT_BLOCK)//first indirect block, the index block comes with it
+		{
+			int index_id=dblock_alloc_raw(fs);
+			if(index_id<0)
+				break;
+			temp_file.blocks[DIRECT_BLOCK]=index_id;
+			bzero(index_scratch,NEW_BLOCK_SIZE);
+			index_dirty=TRUE;
+		}
+		int alloc_res=dblock_alloc_raw(fs);
+		if(alloc_res<0)
+		{
+			if(got==DIRECT_BLOCK)
+			{
+				dblock_free(fs,temp_file.blocks[DIRECT_BLOCK]);
+				index_dirty=FALSE;
+			}
+			break;
+		}
+		if(got<DIRECT_BLOCK)
+			temp_file.blocks[got]=alloc_res;
+		else
+		{
+			block_list[got-DIRECT_BLOCK]=alloc_res;
+			index_dirty=TRUE;
+		}
+		got++;
+	}
+	batch_end(fs);
+
+	int usable=got<end_block_num?got:end_block_num;
+	if((uint32_t)usable*NEW_BLOCK_SIZE<offset+count)//ran out of space, write what fits
+		count=(uint32_t)usable*NEW_BLOCK_SIZE>offset?usable*NEW_BLOCK_SIZE-offset:0;
+	if(offset+count>temp_size)
+		temp_file.size=offset+count;
+	if(count==0 && got>total_block_num)//only gap blocks fit, keep them inside the size
+		temp_file.size=got*NEW_BLOCK_SIZE;
+
+	//blocks between the old end and offset, allocated but never written
+	if(total_block_num<first_block && total_block_num<got)
+	{
+		bzero(data_scratch,NEW_BLOCK_SIZE);
+		for(n=total_block_num;n<first_block && n<got;n++)
+			dblock_write_data(fs,block_map(&temp_file,n,index_scratch),data_scratch);
+	}
+
+	iov_cursor c;
+	iov_cursor_init(&c,iov,iovcnt);
+	int real_count=0;
+	for(n=first_block;real_count<count;n++)
+	{
+		int now_block_id=block_map(&temp_file,n,index_scratch);
+		int in_block=(offset+real_count)%NEW_BLOCK_SIZE;
+		int rdy_count=NEW_BLOCK_SIZE-in_block;
+		if(rdy_count>count-real_count)
+			rdy_count=count-real_count;
+		char *direct=rdy_count==NEW_BLOCK_SIZE?iov_contig(&c,NEW_BLOCK_SIZE):NULL;
+		if(direct)
+		{
+			dblock_write_data(fs,now_block_id,direct);
+			iov_skip(&c,NEW_BLOCK_SIZE);
+		}
+		else
+		{
+			char *block_scratch=data_scratch;
+			if(rdy_count==NEW_BLOCK_SIZE)
+				;//overwritten completely
+			else if(n==first_block && cow_first)
+				;//data_scratch has the old bytes
+			else if(n>first_block && cow_last)//a partial block past the first is the last one
+				block_scratch=last_scratch;
+			else if(n<total_block_num)
+				dblock_read(fs,now_block_id,data_scratch);
+			else
+				bzero(data_scratch,NEW_BLOCK_SIZE);
+			iov_copy(&c,block_scratch+in_block,rdy_count,FALSE);
+			dblock_write_data(fs,now_block_id,block_scratch);
+		}
+		real_count+=rdy_count;
+	}
+	if(index_dirty)
+		dblock_write(fs,temp_file.blocks[DIRECT_BLOCK],index_scratch);
+	if(temp_file.size!=temp_size || got>total_block_num || remapped)
+		inode_write_data(fs,inode_id,&temp_file);
+	*offset_p=offset+real_count;
+	return real_count;
+}
+
+//set the size of file inode_id to len, freeing whole blocks past it in one
+//bitmap batch or zero-filling up to it; bytes past the size are kept zero
+//in the last block, so a later extension never shows old data
+static int file_truncate(fs_t *fs,int inode_id, uint32_t len)
+{
+	inode temp_file;
+	inode_read(fs,inode_id,&temp_file);
+	if(len>temp_file.size)//grow: writing the last byte zero-fills the gap
+	{
+		fs_iovec one={zero_block,1};
+		uint32_t pos=len-1;
+		return file_writev(fs,inode_id,&one,1,&pos)==1?0:-1;
+	}
+	if(len==temp_file.size)
+		return 0;
+	int keep_block_num=((int)len-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	int total_block_num=((int)temp_file.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	if(len%NEW_BLOCK_SIZE)//zero the rest of the new last block
+	{
+		uint32_t end=(uint32_t)keep_block_num*NEW_BLOCK_SIZE;
+		if(end>temp_file.size)
+			end=temp_file.size;
+		fs_iovec tail={zero_block,end-len};
+		uint32_t pos=len;
+		file_writev(fs,inode_id,&tail,1,&pos);//in place, or a private copy of a shared block
+		inode_read(fs,inode_id,&temp_file);
+	}
+	char index_scratch[NEW_BLOCK_SIZE];
+	batch_begin(fs);
+	if(total_block_num>DIRECT_BLOCK)
+		dblock_read(fs,temp_file.blocks[DIRECT_BLOCK],index_scratch);
+	int n;
+	for(n=keep_block_num;n<total_block_num;n++)
+		dblock_free(fs,block_map(&temp_file,n,index_scratch));
+	if(total_block_num>DIRECT_BLOCK && keep_block_num<=DIRECT_BLOCK)
+		dblock_free(fs,temp_file.blocks[DIRECT_BLOCK]);
+	temp_file.size=len;
+	inode_write_data(fs,inode_id,&temp_file);
+	batch_end(fs);
+	return 0;
+}
+
+//fs init ------------------------------------------------------
+//start the journal of a volume whose log is empty, seq for its next transaction
+static void journal_start(fs_t *fs,uint32_t seq)
+{
+#ifdef FAKE
+	int i;
+	for(i=0;i<JBUF_BLOCKS;i++)
+	{
+		fs->jbuf[i].block=-1;
+		fs->jbuf[i].dirty=FALSE;
+		fs->jbuf[i].pending=FALSE;
+		fs->jbuf[i].writing=FALSE;
+	}
+	for(i=0;i<FS_SIZE/8;i++)
+		fs->jbuf_slot[i]=-1;
+	bzero((char *)fs->jlogged,sizeof(fs->jlogged));
+	bzero((char *)fs->jfreed,sizeof(fs->jfreed));
+	fs->jdirty=0;
+	fs->jlog_pos=1;
+	fs->jseq=seq;
+	fs->jhandles=0;
+	fs->jreserved=0;
+	fs->jcommitting=FALSE;
+	fs->jexclusive=FALSE;
+	fs->jstop=FALSE;
+	fs->journal_on=TRUE;
+	if(pthread_create(&fs->journal_thread,NULL,journal_thread,fs)!=0)
+	{
+		fs->journal_on=FALSE;//write-through then, which an empty log allows
+		ERROR_MSG(("can't start the journal thread\n"))
+	}
+#endif
+}
+//commit, write everything home and empty the log; a no-op without a journal
+static void journal_stop(fs_t *fs)
+{
+#ifdef FAKE
+	if(!fs->journal_on)
+		return;
+	FS_LOCK(&fs->journal_lock);
+	fs->jstop=TRUE;
+	pthread_cond_signal(&fs->journal_kick);
+	FS_UNLOCK(&fs->journal_lock);
+	pthread_join(fs->journal_thread,NULL);
+	FS_LOCK(&fs->journal_lock);
+	journal_commit(fs);
+	journal_reset(fs);
+	fs->journal_on=FALSE;
+	FS_UNLOCK(&fs->journal_lock);
+#endif
+}
+
+//fresh in-memory state for the image on fs->dev
+//an image without a file system is formatted if may_format, else it's an error
+static int fs_load(fs_t *fs,bool_t may_format) {
+	fs_locks_init(fs);
+	fs->meta_batch_depth=0;
+	fs->inode_bitmap_dirty=FALSE;
+	fs->dblock_bitmap_dirty=FALSE;
+	fs->sb_dirty=FALSE;
+	//load super block
+	fs->my_sb = (super_b *)fs->super_block_scratch;
+	new_block_read(fs,SUPER_BLOCK,fs->super_block_scratch);
+	if(fs->my_sb->magic_num != MY_MAGIC) //main sb crash or not formatted
+	{
+		new_block_read(fs,SUPER_BLOCK_BACKUP,fs->super_block_scratch);
+		if(fs->my_sb->magic_num != MY_MAGIC)//need formatted
+		{
+			if(!may_format)
+			{
+				ERROR_MSG(("no file system on the image\n"))
+				return -1;
+			}
+			return fsh_mkfs(fs);
+		}
+		else
+			new_block_write(fs,SUPER_BLOCK,fs->super_block_scratch);
+	}
+	//what the journal committed goes home before anything else is read
+	if(fs->my_sb->features & SB_FEATURE_JOURNAL)
+	{
+		uint32_t seq=journal_replay(fs,fs->my_sb);
+		home_block_read(fs,SUPER_BLOCK,fs->super_block_scratch);
+		journal_start(fs,seq);
+	}
+	//mount to root
+	fs->pwd=(uint16_t)ROOT_DIR_ID;
+	//clear fd_table
+	fd_table_reset(fs);
+	dcache_reset(fs);
+
+	//a clean image is trusted as it is and its bitmaps wait for first use,
+	//otherwise the counts are redone from the bitmaps
+	fs->inode_bitmap_loaded=FALSE;
+	fs->dblock_bitmap_loaded=FALSE;
+	if(!(fs->my_sb->state & SB_STATE_CLEAN))
+	{
+		bitmap_load(fs,INODE_BITMAP);
+		bitmap_load(fs,DBLOCK_BITMAP);
+		fs->my_sb->inode_count=bitmap_count(fs->inode_bitmap_block_scratch,MAX_FILE_COUNT);
+		fs->my_sb->dblock_count=bitmap_count(fs->dblock_bitmap_block_scratch,DATA_BLOCK_NUMBER);
+	}
+	//marked in use before anything else changes
+	fs->my_sb->state&=~SB_STATE_CLEAN;
+	fs->my_sb->mount_count++;
+	sb_write(fs);
+	return 0;
+}
+
+//everything is home: record that the image needs no checking at its next load
+static void sb_mark_clean(fs_t *fs)
+{
+	fs->my_sb->state|=SB_STATE_CLEAN;
+	sb_write(fs);
+}
+//the fds and mappings go with the volume: free the unlinked files only they
+//kept, or a clean image would hold them for good
+static void orphans_release(fs_t *fs)
+{
+	int i;
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	for(i=0;i<MAX_FILE_COUNT;i++)
+		if(fd_find_same_num(fs,i)>0)
+		{
+			FS_LOCK(&fs->fd_lock);
+			fs->inode_mem_table[i].open_count=1;
+			FS_UNLOCK(&fs->fd_lock);
+			inode_put(fs,i);
+		}
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+}
+
+//write everything back and stop the flusher; a no-op when write-through
+static void writeback_stop(fs_t *fs)
+{
+#ifdef FAKE
+	FS_LOCK(&fs->bcache_lock);
+	if(!fs->writeback)
+	{
+		FS_UNLOCK(&fs->bcache_lock);
+		return;
+	}
+	bcache_sync(fs);
+	fs->writeback=FALSE;
+	pthread_cond_signal(&fs->bcache_kick);
+	pthread_cond_broadcast(&fs->bcache_flushed);//throttled writers
+	FS_UNLOCK(&fs->bcache_lock);
+	pthread_join(fs->flusher,NULL);
+	//writers that were throttled may have dirtied blocks since
+	FS_LOCK(&fs->bcache_lock);
+	bcache_sync(fs);
+	FS_UNLOCK(&fs->bcache_lock);
+#endif
+}
+
+void fs_init( void) {
+	if(default_fs->is_using)//the blocks are written raw before fs_init runs again
+	{
+		journal_stop(default_fs);
+		writeback_stop(default_fs);
+	}
+	block_init();
+	default_fs->dev=0;
+	default_fs->is_using=TRUE;
+	fs_load(default_fs,TRUE);
+}
+
+//fs_unmount for the default volume, fs_init brings it back
+int fs_shutdown( void) {
+	if(!default_fs->is_using)
+	{
+		ERROR_MSG(("the default volume isn't mounted\n"))
+		return -1;
+	}
+	orphans_release(default_fs);
+	journal_stop(default_fs);
+	writeback_stop(default_fs);
+	sb_mark_clean(default_fs);
+	default_fs->is_using=FALSE;
+	return 0;
+}
+
+fs_t *fs_mount( const char *image, fs_mount_opts *opts) {
+#ifdef FAKE
+	fs_mount_opts none={FALSE,FALSE,FALSE,FALSE};
+	if(opts==NULL)
+		opts=&none;
+	//slot 0 stays for the default volume
+	FS_LOCK(&mount_lock);
+	int i;
+	for(i=1;i<FS_MAX_MOUNTS;i++)
+		if(!fs_pool[i].is_using)
+			break;
+	if(i==FS_MAX_MOUNTS)
+	{
+		FS_UNLOCK(&mount_lock);
+		ERROR_MSG(("too many mounted volumes\n"))
+		return NULL;
+	}
+	fs_t *fs=&fs_pool[i];
+	fs->is_using=TRUE;
+	FS_UNLOCK(&mount_lock);
+
+	fs->dev=block_open(image);
+	if(fs->dev<0)
+	{
+		ERROR_MSG(("can't open image %s\n",image))
+		fs->is_using=FALSE;
+		return NULL;
+	}
+	fs->journal_fmt=opts->journal;
+	fs->log_writes=opts->log_writes;
+	int res=opts->mkfs?fsh_mkfs(fs):fs_load(fs,!opts->no_format);
+	if(res<0)
+	{
+		block_close(fs->dev);
+		fs->is_using=FALSE;
+		return NULL;
+	}
+	//without the journal each remap costs a bitmap and a superblock write of its own
+	if(fs->log_writes && !(fs->my_sb->features&SB_FEATURE_JOURNAL))
+	{
+		ERROR_MSG(("log_writes needs a journaled volume\n"))
+		fs_unmount(fs);
+		return NULL;
+	}
+	return fs;
+#else
+	ERROR_MSG(("only the default volume can be mounted here\n"))
+	return NULL;
+#endif
+}
+
+int fs_unmount( fs_t *fs) {
+	if(fs==NULL || fs==default_fs || !fs->is_using)
+	{
+		ERROR_MSG(("not a volume from fs_mount\n"))
+		return -1;
+	}
+	orphans_release(fs);
+	journal_stop(fs);
+	writeback_stop(fs);
+	sb_mark_clean(fs);
+#ifdef FAKE
+	block_close(fs->dev);
+#endif
+	FS_LOCK(&mount_lock);
+	fs->is_using=FALSE;
+	FS_UNLOCK(&mount_lock);
+	return 0;
+}
+
+int fsh_writeback( fs_t *fs, fs_writeback_opts *wb) {
+#ifdef FAKE
+	if(wb==NULL)
+	{
+		writeback_stop(fs);
+		return 0;
+	}
+	if(wb->expire_ms<0 || wb->interval_ms<=0 || wb->background_ratio<0
+		|| wb->background_ratio>wb->dirty_ratio || wb->dirty_ratio<=0 || wb->dirty_ratio>100)
+	{
+		ERROR_MSG(("bad write-back options\n"))
+		return -1;
+	}
+	FS_LOCK(&fs->bcache_lock);
+	fs->wb=*wb;
+	if(fs->writeback)//new limits for the running flusher
+	{
+		pthread_cond_signal(&fs->bcache_kick);
+		FS_UNLOCK(&fs->bcache_lock);
+		return 0;
+	}
+	int i;
+	for(i=0;i<BCACHE_BLOCKS;i++)
+	{
+		fs->bcache[i].block=-1;
+		fs->bcache[i].dirty=FALSE;
+		fs->bcache[i].writing=FALSE;
+	}
+	for(i=0;i<FS_SIZE/8;i++)
+		fs->bcache_slot[i]=-1;
+	fs->bcache_dirty=0;
+	fs->bcache_clock=0;
+	fs->writeback=TRUE;
+	if(pthread_create(&fs->flusher,NULL,bcache_flusher,fs)!=0)
+	{
+		fs->writeback=FALSE;
+		FS_UNLOCK(&fs->bcache_lock);
+		ERROR_MSG(("can't start the flusher\n"))
+		return -1;
+	}
+	FS_UNLOCK(&fs->bcache_lock);
+	return 0;
+#else
+	ERROR_MSG(("no write-back cache here\n"))
+	return -1;
+#endif
+}
+
+int fsh_sync( fs_t *fs) {
+#ifdef FAKE
+	if(fs->journal_on)
+	{
+		FS_LOCK(&fs->journal_lock);
+		journal_commit(fs);
+		journal_checkpoint(fs);
+		FS_UNLOCK(&fs->journal_lock);
 	}
-	else
+	FS_LOCK(&fs->bcache_lock);
+	if(fs->writeback)
+		bcache_sync(fs);
+	FS_UNLOCK(&fs->bcache_lock);
+#endif
+	return 0;
+}
+
+int fsh_mkfs( fs_t *fs) {
+	fs_locks_init(fs);
+	journal_stop(fs);
+	fs->my_sb = (super_b *)fs->super_block_scratch;
+	fs->my_sb->file_sys_size = FS_SIZE;
+	fs->my_sb->inode_bitmap_place = SUPER_BLOCK+1;
+	fs->my_sb->dblock_bitmap_place = SUPER_BLOCK+2;
+	fs->my_sb->inode_start = SUPER_BLOCK+3;
+	fs->my_sb->inode_count = 1;
+	fs->my_sb->dblock_count = 0;
+	fs->my_sb->dblock_start= SUPER_BLOCK+3+INODE_BLOCK_NUMBER;
+	fs->my_sb->magic_num=MY_MAGIC;
+	fs->my_sb->features=SB_FEATURE_NAME_HASH|SB_FEATURE_DIR_HOLES|SB_FEATURE_REFLINK;
+	bzero((char *)fs->my_sb->dblock_share,sizeof(fs->my_sb->dblock_share));
+	fs->my_sb->journal_start=0;
+	fs->my_sb->journal_blocks=0;
+	fs->my_sb->state=0;
+	fs->my_sb->mount_count=1;
+	sb_write(fs);
+	//zero bitmaps
+	new_block_write(fs,fs->my_sb->inode_bitmap_place,zero_block);
+	new_block_write(fs,fs->my_sb->dblock_bitmap_place,zero_block);
+	bzero(fs->inode_bitmap_block_scratch,NEW_BLOCK_SIZE);
+	bzero(fs->dblock_bitmap_block_scratch,NEW_BLOCK_SIZE);
+	fs->inode_bitmap_loaded=TRUE;
+	fs->dblock_bitmap_loaded=TRUE;
+#ifdef FAKE
+	if(fs->journal_fmt)//the journal takes the last data blocks
 	{
-		dblock_read(block_id,block_scratch);
-		dblock_read(last_block_id,block_scratch_1);
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		dir_entry *entry_list_last=(dir_entry *)block_scratch_1;
-		entry_list[in_block_id]=entry_list_last[in_last_block_id];
-		dblock_write(block_id,block_scratch);
+		int i;
+		for(i=DATA_BLOCK_NUMBER-JOURNAL_BLOCKS;i<DATA_BLOCK_NUMBER;i++)
+			write_bitmap_block(fs,DBLOCK_BITMAP,i,1);
+		fs->my_sb->dblock_count+=JOURNAL_BLOCKS;
+		fs->my_sb->features|=SB_FEATURE_JOURNAL;
+		fs->my_sb->journal_start=fs->my_sb->dblock_start+DATA_BLOCK_NUMBER-JOURNAL_BLOCKS;
+		fs->my_sb->journal_blocks=JOURNAL_BLOCKS;
+		sb_write(fs);
+		//a log left by an earlier format may hold descriptors numbered like
+		//the new ones, so none of it survives
+		for(i=0;i<JOURNAL_BLOCKS;i++)
+			raw_block_write(fs,fs->my_sb->journal_start+i,zero_block);
+		journal_restart(fs,fs->my_sb->journal_start,0);
+	}
+#endif
+	//reset pointers
+	fs->inode_bitmap_last=0;
+	fs->dblock_bitmap_last=0;
+	dcache_reset(fs);
+	
+	inode temp_root;
+	inode_init(&temp_root,MY_DIRECTORY);
+	inode_write(fs,ROOT_DIR_ID,&temp_root);
+	write_bitmap_block(fs,INODE_BITMAP,ROOT_DIR_ID,1);
+
+	int res;
+	res=dir_entry_add(fs,ROOT_DIR_ID,ROOT_DIR_ID,".");
+	if(res<0){
+		bzero(fs->super_block_scratch,NEW_BLOCK_SIZE);
+		sb_write(fs);
+		return -1;
 	}
+	res=dir_entry_add(fs,ROOT_DIR_ID,ROOT_DIR_ID,"..");
+	if(res<0){
+		bzero(fs->super_block_scratch,NEW_BLOCK_SIZE);
+		sb_write(fs);
+		return -1;
+	}
+
+	//mount to root
+	fs->pwd = ROOT_DIR_ID;
+	//clear fd_table
+	fd_table_reset(fs);
+	if(fs->my_sb->features & SB_FEATURE_JOURNAL)
+		journal_start(fs,0);
+
+	return 0;
 }
 
-static int dir_entry_delete(int dir_index,char *filename)//unlink call in this func , and this only affect one node
+//namespace calls do their work in fs_*_locked, and the public call holds ns_lock around it
+//an open that creates or truncates changes the tree and runs under
+//txn_begin_ns, one of an existing file only takes an fd; without may_change
+//the first kind returns OPEN_NEEDS_NS and is retried under that handle
+#define OPEN_NEEDS_NS (-2)
+static int fs_open_locked(fs_t *fs,int cwd,char *fileName, int flags, bool_t may_change) {
+	path_walk_res walk;
+	int path_res=path_walk(fs,fileName,cwd,&walk,0);
+	int access=flags&FS_O_ACCMODE;
+	if(access!=FS_O_RDONLY && access!= FS_O_WRONLY && access!= FS_O_RDWR)
+		return -1;
+	if(flags&~(FS_O_ACCMODE|FS_O_TRUNC|FS_O_APPEND))
+		return -1;
+	if((flags&FS_O_TRUNC) && access==FS_O_RDONLY)
+	{
+		ERROR_MSG(("can't truncate %s opened as read-only\n",fileName))
+		return -1;
+	}
+	FS_LOCK(&fs->fd_lock);
+	int fd_left=fd_lowest_free(fs);
+	FS_UNLOCK(&fs->fd_lock);
+	if(fd_left<0)//check before creating anything
+	{
+		ERROR_MSG(("Not enough file descriptor!\n"))
+		return -1;
+	}
+	if(path_res<0)
+	{
+		if(access==FS_O_RDONLY)//read only can not create file
+		{
+			ERROR_MSG(("%s doesn't exist,and try to open as read-only\n",fileName))
+			return -1;
+		}
+		else
+		{
+			if(walk.parent<0 || walk.dir_only)//the walk stopped before the leaf's parent
+			{
+				ERROR_MSG(("%s doesn't exist,and its parent dir doesn't exist either\n",fileName));
+				return -1;
+			}
+			if(!may_change)
+				return OPEN_NEEDS_NS;
+			int new_inode=inode_create(fs,REAL_FILE);
+			if(new_inode<0)
+			{
+				ERROR_MSG(("can't create inode when try to open a new file\n"));
+				return -1;
+			}
+			dir_entry_add(fs,walk.parent,new_inode,walk.leaf);
+			path_res=new_inode;
+		}
+	}
+	else{
+		inode temp;
+		inode_read(fs,path_res,&temp);
+		if(access!=FS_O_RDONLY && temp.type == MY_DIRECTORY)
+		{
+			ERROR_MSG(("%s is a directory,but try to open as writable\n",fileName))
+			return -1;
+		}
+		if((flags&FS_O_TRUNC) && temp.size>0)
+		{
+			if(!may_change)
+				return OPEN_NEEDS_NS;
+			inode_lock(fs,path_res);
+			file_truncate(fs,path_res,0);
+			inode_unlock(fs,path_res);
+		}
+	}
+	return fd_open(fs,path_res,flags);
+}
+int fsh_open( fs_t *fs, char *fileName, int flags)
 {
-	inode dir_inode;
-	inode_read(dir_index,&dir_inode);
-	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
-	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
-	if(total_entry_num==0)
+	txn_begin(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_open_locked(fs,fs->pwd,fileName,flags,FALSE);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end(fs);
+	if(res!=OPEN_NEEDS_NS)
+		return res;
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	res=fs_open_locked(fs,fs->pwd,fileName,flags,TRUE);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
+
+static int fs_close_locked(fs_t *fs,int fd) {
+	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+	{
+		ERROR_MSG(("Wrong fd input!\n"))
 		return -1;
-	
-	int last_block_id;
-	int in_last_block_id=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)%DIR_ENTRY_PER_BLOCK;
+	}
+	if(fs->fd_table[fd].is_using==FALSE)
+	{
+		ERROR_MSG(("fd %d is not using!",fd))
+		return -1;
+	}
+	fd_close(fs,fd);
+	inode_put(fs,fs->fd_table[fd].inode_id);
+	return fd;
+}
+int fsh_close( fs_t *fs, int fd)
+{
+	txn_begin(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_close_locked(fs,fd);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end(fs);
+	return res;
+}
 
-	int free_indirect_index_block_flag=0;
-	if(total_block_num<=DIRECT_BLOCK){
-		last_block_id=dir_inode.blocks[total_block_num-1];
+//argument checks shared by fs_read/fs_write and the positional calls
+static int rw_check(fs_t *fs,int fd,int count,bool_t is_write)
+{
+	if(count<0)
+	{
+		ERROR_MSG(("Wrong count input!\n"))
+		return -1;
 	}
-	else{
-		dblock_read(dir_inode.blocks[DIRECT_BLOCK],block_scratch);
-		uint16_t *block_list=(uint16_t *)block_scratch;
-		last_block_id=block_list[total_block_num-1-DIRECT_BLOCK];
-		if(total_block_num==DIRECT_BLOCK+1)
-			free_indirect_index_block_flag=1;
+	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+	{
+		ERROR_MSG(("Wrong fd input!\n"))
+		return -1;
+	}
+	if(fs->fd_table[fd].is_using==FALSE)
+	{
+		ERROR_MSG(("fd %d is not using!",fd))
+		return -1;
+	}
+	if(!is_write && fs->fd_table[fd].mode==FS_O_WRONLY)
+	{
+		ERROR_MSG(("can't read the file open as write-only file"))
+		return -1;
+	}
+	if(is_write && fs->fd_table[fd].mode==FS_O_RDONLY)
+	{
+		ERROR_MSG(("can't write the file open as read-only file"))
+		return -1;
 	}
+	return 0;
+}
+
+int fsh_read( fs_t *fs, int fd, char *buf, int count) {
+	if(rw_check(fs,fd,count,FALSE)<0)
+		return -1;
+	fs_iovec one={buf,count};
+	int inode_id=fs->fd_table[fd].inode_id;
+	inode_rdlock(fs,inode_id);
+	int real_count=file_readv(fs,inode_id,&one,1,fs->fd_table[fd].cursor);
+	fs->fd_table[fd].cursor+=real_count;
+	inode_unlock(fs,inode_id);
+	return real_count;
+}
 	
+int fsh_write( fs_t *fs, int fd, char *buf, int count) {
+	if(rw_check(fs,fd,count,TRUE)<0)
+		return -1;
+	fs_iovec one={buf,count};
+	int inode_id=fs->fd_table[fd].inode_id;
+	txn_begin(fs);
+	inode_lock(fs,inode_id);
+	uint32_t pos=fs->fd_table[fd].append?OFFSET_APPEND:fs->fd_table[fd].cursor;
+	int real_count=file_writev(fs,inode_id,&one,1,&pos);
+	fs->fd_table[fd].cursor=pos;
+	inode_unlock(fs,inode_id);
+	txn_end(fs);
+	return real_count;
+}
 
-	if(total_block_num>DIRECT_BLOCK)
+int fsh_pread( fs_t *fs, int fd, char *buf, int count, int offset) {
+	if(rw_check(fs,fd,count,FALSE)<0)
+		return -1;
+	if(offset<0)
 	{
-		dblock_read(dir_inode.blocks[DIRECT_BLOCK],block_scratch);
-		uint16_t *block_list=(uint16_t *)block_scratch;
-		int i,j,entry_block;
-		for(i=0;i<total_block_num-DIRECT_BLOCK-1;i++)//then we find in indirect block(without the last block)
-		{
-			entry_block=block_list[i];
-			dblock_read(block_list[i],block_scratch_1);
-			dir_entry *entry_list=(dir_entry *)block_scratch_1;
-			for(j=0;j<DIR_ENTRY_PER_BLOCK;j++)
-				if(same_string(entry_list[j].file_name,filename))
-				{
-					swap_in_last_entry(entry_block,j,last_block_id,in_last_block_id);
-					if(in_last_block_id==0)//need to free dblock
-					{
-						dblock_free(last_block_id);
-						if(free_indirect_index_block_flag)//also need to free indirect dblock
-							dblock_free(dir_inode.blocks[DIRECT_BLOCK]);	
-					}
-					dir_inode.size-=sizeof(dir_entry);
-					inode_write(dir_index,&dir_inode);
-					return 0;
-				}
-		}
-		//last block
-		entry_block=block_list[total_block_num-DIRECT_BLOCK-1];
-		dblock_read(block_list[total_block_num-DIRECT_BLOCK-1],block_scratch_1);
-
-		int final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
-		dir_entry *entry_list=(dir_entry *)block_scratch_1;
-		for(j=0;j<=final_end;j++)
-			if(same_string(entry_list[j].file_name,filename))
-			{
-				swap_in_last_entry(entry_block,j,last_block_id,in_last_block_id);
-				if(in_last_block_id==0)//need to free dblock
-				{
-					dblock_free(last_block_id);
-					if(free_indirect_index_block_flag)//also need to free indirect dblock
-						dblock_free(dir_inode.blocks[DIRECT_BLOCK]);	
-				}
-				
-				dir_inode.size-=sizeof(dir_entry);
-				inode_write(dir_index,&dir_inode);
-				return 0;
-			}
+		ERROR_MSG(("offset <0 !\n"))
+		return -1;
+	}
+	fs_iovec one={buf,count};
+	int inode_id=fs->fd_table[fd].inode_id;
+	inode_rdlock(fs,inode_id);
+	int real_count=file_readv(fs,inode_id,&one,1,offset);
+	inode_unlock(fs,inode_id);
+	return real_count;
+}
+
+int fsh_pwrite( fs_t *fs, int fd, char *buf, int count, int offset) {
+	if(rw_check(fs,fd,count,TRUE)<0)
+		return -1;
+	if(offset<0)
+	{
+		ERROR_MSG(("offset <0 !\n"))
+		return -1;
+	}
+	fs_iovec one={buf,count};
+	uint32_t pos=offset;
+	int inode_id=fs->fd_table[fd].inode_id;
+	txn_begin(fs);
+	inode_lock(fs,inode_id);
+	int real_count=file_writev(fs,inode_id,&one,1,&pos);
+	inode_unlock(fs,inode_id);
+	txn_end(fs);
+	return real_count;
+}
+
+int fsh_readv( fs_t *fs, int fd, fs_iovec *iov, int iovcnt) {
+	if(rw_check(fs,fd,iov_total(iov,iovcnt),FALSE)<0)
+		return -1;
+	int inode_id=fs->fd_table[fd].inode_id;
+	inode_rdlock(fs,inode_id);
+	int real_count=file_readv(fs,inode_id,iov,iovcnt,fs->fd_table[fd].cursor);
+	fs->fd_table[fd].cursor+=real_count;
+	inode_unlock(fs,inode_id);
+	return real_count;
+}
+
+int fsh_writev( fs_t *fs, int fd, fs_iovec *iov, int iovcnt) {
+	if(rw_check(fs,fd,iov_total(iov,iovcnt),TRUE)<0)
+		return -1;
+	int inode_id=fs->fd_table[fd].inode_id;
+	txn_begin(fs);
+	inode_lock(fs,inode_id);
+	uint32_t pos=fs->fd_table[fd].append?OFFSET_APPEND:fs->fd_table[fd].cursor;
+	int real_count=file_writev(fs,inode_id,iov,iovcnt,&pos);
+	fs->fd_table[fd].cursor=pos;
+	inode_unlock(fs,inode_id);
+	txn_end(fs);
+	return real_count;
+}
 
-		//trick to find in direct blocks
-		total_block_num=DIRECT_BLOCK;
-		total_entry_num=DIRECT_BLOCK*DIR_ENTRY_PER_BLOCK;
+int fsh_preadv( fs_t *fs, int fd, fs_iovec *iov, int iovcnt, int offset) {
+	if(rw_check(fs,fd,iov_total(iov,iovcnt),FALSE)<0)
+		return -1;
+	if(offset<0)
+	{
+		ERROR_MSG(("offset <0 !\n"))
+		return -1;
+	}
+	int inode_id=fs->fd_table[fd].inode_id;
+	inode_rdlock(fs,inode_id);
+	int real_count=file_readv(fs,inode_id,iov,iovcnt,offset);
+	inode_unlock(fs,inode_id);
+	return real_count;
+}
 
+int fsh_pwritev( fs_t *fs, int fd, fs_iovec *iov, int iovcnt, int offset) {
+	if(rw_check(fs,fd,iov_total(iov,iovcnt),TRUE)<0)
+		return -1;
+	if(offset<0)
+	{
+		ERROR_MSG(("offset <0 !\n"))
+		return -1;
 	}
+	uint32_t pos=offset;
+	int inode_id=fs->fd_table[fd].inode_id;
+	txn_begin(fs);
+	inode_lock(fs,inode_id);
+	int real_count=file_writev(fs,inode_id,iov,iovcnt,&pos);
+	inode_unlock(fs,inode_id);
+	txn_end(fs);
+	return real_count;
+}
 
-	int i,j,entry_block;
-	for(i=0;i<total_block_num-1;i++)
+int fsh_copy_file_range( fs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int len) {
+	if(rw_check(fs,fd_in,len,FALSE)<0 || rw_check(fs,fd_out,len,TRUE)<0)
+		return -1;
+	if(off_in<0 || off_out<0)
 	{
-		entry_block=dir_inode.blocks[i];
-		dblock_read(entry_block,block_scratch);
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		for(j=0;j<DIR_ENTRY_PER_BLOCK;j++)
-			if(same_string(entry_list[j].file_name,filename))
-			{
-				swap_in_last_entry(entry_block,j,last_block_id,in_last_block_id);
-				if(in_last_block_id==0)//need to free dblock
-				{
-					dblock_free(last_block_id);
-					if(free_indirect_index_block_flag)//also need to free indirect dblock
-						dblock_free(dir_inode.blocks[DIRECT_BLOCK]);	
-				}
-				dir_inode.size-=sizeof(dir_entry);
-				inode_write(dir_index,&dir_inode);
-				return 0;
-			}
+		ERROR_MSG(("offset <0 !\n"))
+		return -1;
 	}
-	//last block
-	int final_end=(total_entry_num-1)%DIR_ENTRY_PER_BLOCK;
-	entry_block=dir_inode.blocks[total_block_num-1];
-	dblock_read(entry_block,block_scratch);
-	dir_entry *entry_list=(dir_entry *)block_scratch;
-	for(j=0;j<=final_end;j++)
-		if(same_string(entry_list[j].file_name,filename))
+	int in_id=fs->fd_table[fd_in].inode_id;
+	int out_id=fs->fd_table[fd_out].inode_id;
+	if(in_id==out_id && off_in<off_out+len && off_out<off_in+len)
+	{
+		ERROR_MSG(("copy ranges overlap in one file\n"))
+		return -1;
+	}
+	int done=0;
+	char copy_scratch[NEW_BLOCK_SIZE];
+	while(done<len)
+	{
+		//one output block per step, each with its own handle and both file locks
+		int step=NEW_BLOCK_SIZE-(off_out+done)%NEW_BLOCK_SIZE;
+		fs_iovec chunk={copy_scratch,len-done<step?len-done:step};
+		txn_begin(fs);
+		inode_lock_two(fs,in_id,out_id);
+		int got=file_readv(fs,in_id,&chunk,1,off_in+done);
+		int put=0;
+		if(got>0)
 		{
-			swap_in_last_entry(entry_block,j,last_block_id,in_last_block_id);
-			if(in_last_block_id==0)//need to free dblock
-			{
-				dblock_free(last_block_id);
-				if(free_indirect_index_block_flag)//also need to free indirect dblock
-					dblock_free(dir_inode.blocks[DIRECT_BLOCK]);	
-			}
-			dir_inode.size-=sizeof(dir_entry);
-			inode_write(dir_index,&dir_inode);
-			return 0;
+			chunk.len=got;
+			uint32_t pos=off_out+done;
+			put=file_writev(fs,out_id,&chunk,1,&pos);
 		}
+		inode_unlock_two(fs,in_id,out_id);
+		txn_end(fs);
+		done+=put;
+		if(got<=0 || put<got)//end of fd_in, or disk full
+			break;
+	}
+	return done;
+}
 
+int fsh_reflink( fs_t *fs, int fd_in, int fd_out) {
+	if(rw_check(fs,fd_in,0,FALSE)<0 || rw_check(fs,fd_out,0,TRUE)<0)
+		return -1;
+	if(!(fs->my_sb->features&SB_FEATURE_REFLINK))
+	{
+		ERROR_MSG(("this image has no block sharing, mkfs it first\n"))
+		return -1;
+	}
+	int in_id=fs->fd_table[fd_in].inode_id;
+	int out_id=fs->fd_table[fd_out].inode_id;
+	if(in_id==out_id)
+	{
+		ERROR_MSG(("can only clone a file into another, empty, file\n"))
+		return -1;
+	}
+	txn_begin(fs);
+	inode_lock_two(fs,in_id,out_id);
+	inode src,dst;
+	inode_read(fs,in_id,&src);
+	inode_read(fs,out_id,&dst);
+	if(src.type!=REAL_FILE || dst.size!=0)
+	{
+		inode_unlock_two(fs,in_id,out_id);
+		txn_end(fs);
+		ERROR_MSG(("can only clone a file into another, empty, file\n"))
+		return -1;
+	}
+	int nblocks=(src.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	char index_scratch[NEW_BLOCK_SIZE];
+	if(nblocks>DIRECT_BLOCK)
+		dblock_read(fs,src.blocks[DIRECT_BLOCK],index_scratch);
+	int n;
+	batch_begin(fs);//share counts of other files' blocks can't change from here on
+	for(n=0;n<nblocks;n++)
+		if(fs->my_sb->dblock_share[block_map(&src,n,index_scratch)]==MAX_DBLOCK_SHARE)
+		{
+			batch_end(fs);
+			inode_unlock_two(fs,in_id,out_id);
+			txn_end(fs);
+			ERROR_MSG(("block shared too many times\n"))
+			return -1;
+		}
+	if(nblocks>DIRECT_BLOCK)//the index block is never shared, the clone gets its own copy
+	{
+		int index_id=dblock_alloc_raw(fs);
+		if(index_id<0)
+		{
+			batch_end(fs);
+			inode_unlock_two(fs,in_id,out_id);
+			txn_end(fs);
+			return -1;
+		}
+		dblock_write(fs,index_id,index_scratch);
+		src.blocks[DIRECT_BLOCK]=index_id;
+	}
+	for(n=0;n<nblocks;n++)
+		fs->my_sb->dblock_share[block_map(&src,n,index_scratch)]++;
+	sb_write(fs);
+	dst.size=src.size;
+	bcopy((unsigned char *)src.blocks,(unsigned char *)dst.blocks,sizeof(dst.blocks));
+	inode_write_data(fs,out_id,&dst);
+	batch_end(fs);
+	inode_unlock_two(fs,in_id,out_id);
+	txn_end(fs);
+	return 0;
+}
 
-	return -1;
+int fsh_ftruncate( fs_t *fs, int fd, int len) {
+	if(rw_check(fs,fd,0,TRUE)<0)
+		return -1;
+	if(len<0||len>MAX_FILE_SIZE)
+	{
+		ERROR_MSG(("Wrong length input!\n"))
+		return -1;
+	}
+	int inode_id=fs->fd_table[fd].inode_id;
+	txn_begin(fs);
+	inode_lock(fs,inode_id);
+	int res=file_truncate(fs,inode_id,len);
+	inode_unlock(fs,inode_id);
+	txn_end(fs);
+	return res;
 }
-//--- file descriptor helper---------------------------------------------
-//these func just handle fd_table , won't delete inode & data
-static int fd_open(int inode_id, int mode)
+
+//--- memory maps ---------------------------------------------
+//mapping that holds addr, NULL if none
+static file_map *map_find(fs_t *fs,char *addr)
 {
-    int i;
-    for (i = 0; i < MAX_OPEN_FILE_NUM; i++)
-        if (fd_table[i].is_using==FALSE){
-            fd_table[i].is_using = TRUE;
-            fd_table[i].cursor = 0;
-            fd_table[i].inode_id = inode_id;
-            fd_table[i].mode = mode;
-            return i;
-        }
-    ERROR_MSG(("Not enough file descriptor!\n"))
-    return -1;
+	int i;
+	for(i=0;i<MAX_MAP_NUM;i++)
+		if(fs->map_table[i].is_using && addr>=fs->map_table[i].addr
+			&& addr<fs->map_table[i].addr+fs->map_table[i].nblocks*NEW_BLOCK_SIZE)
+			return &fs->map_table[i];
+	return NULL;
 }
-static void fd_close(int fd)
+//first run of nblocks free pool blocks, -1 if none
+static int map_pool_alloc(fs_t *fs,int nblocks)
 {
-    fd_table[fd].is_using = FALSE;
+	int i,run=0;
+	for(i=0;i<MAP_POOL_BLOCKS;i++)
+	{
+		run=fs->map_pool_used[i]?0:run+1;
+		if(run==nblocks)
+		{
+			int first=i-nblocks+1;
+			for(i=first;i<first+nblocks;i++)
+				fs->map_pool_used[i]=TRUE;
+			return first;
+		}
+	}
+	return -1;
 }
-static int fd_find_same_num(int inode_id)
+//whether len bytes of a mapping differ from its twin
+static bool_t map_changed(char *mem,char *twin,int len)
 {
 	int i;
-	int count=0;
-	for(i=0;i<MAX_OPEN_FILE_NUM;i++)
-		if(fd_table[i].is_using && fd_table[i].inode_id==inode_id)
-			count++;
-	return count;
+	for(i=0;i<len;i++)
+		if(mem[i]!=twin[i])
+			return TRUE;
+	return FALSE;
 }
-//--- path resolve------------------------------------
 
-//caller should save a copy of file_path , because this func will be changed the content 
-static int rel_path_dir_resolve(char * file_path,int temp_pwd)//this just resolve relative path and find inode
-{
-	int path_len=strlen(file_path);
-	if(path_len<=0)
+char *fsh_mmap( fs_t *fs, int fd, int offset, int len, int prot) {
+	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
 	{
-		return temp_pwd;
+		ERROR_MSG(("Wrong fd input!\n"))
+		return NULL;
+	}
+	if(fs->fd_table[fd].is_using==FALSE)
+	{
+		ERROR_MSG(("fd %d is not using!",fd))
+		return NULL;
+	}
+	if(fs->fd_table[fd].mode==FS_O_WRONLY || ((prot&FS_PROT_WRITE) && fs->fd_table[fd].mode==FS_O_RDONLY))
+	{
+		ERROR_MSG(("fd %d wasn't opened for this protection\n",fd))
+		return NULL;
+	}
+	if(offset<0 || offset%NEW_BLOCK_SIZE || len<=0 || len>MAP_POOL_BLOCKS*NEW_BLOCK_SIZE)
+	{
+		ERROR_MSG(("mmap offset must be block aligned and len in 1..%d\n",MAP_POOL_BLOCKS*NEW_BLOCK_SIZE))
+		return NULL;
 	}
 	int i;
-	for(i=0;i<path_len;i++)
-		if(file_path[i]=='/'){
-			file_path[i]='\0';
+	FS_LOCK(&fs->fd_lock);
+	for(i=0;i<MAX_MAP_NUM;i++)
+		if(fs->map_table[i].is_using==FALSE)
+			break;
+	int nblocks=(len-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	int first=i<MAX_MAP_NUM?map_pool_alloc(fs,nblocks):-1;
+	if(first<0)
+	{
+		FS_UNLOCK(&fs->fd_lock);
+		ERROR_MSG(("no room left for a mapping\n"))
+		return NULL;
+	}
+	file_map *m=&fs->map_table[i];
+	m->is_using=TRUE;
+	m->inode_id=fs->fd_table[fd].inode_id;
+	m->offset=offset;
+	m->addr=fs->map_pool+first*NEW_BLOCK_SIZE;
+	m->nblocks=nblocks;
+	m->prot=prot;
+	fs->inode_mem_table[m->inode_id].open_count++;//the file outlives fs_close while mapped
+	FS_UNLOCK(&fs->fd_lock);
+
+	//past the end of the file the mapping reads as zeros
+	bzero(m->addr,nblocks*NEW_BLOCK_SIZE);
+	fs_iovec whole={m->addr,nblocks*NEW_BLOCK_SIZE};
+	inode_rdlock(fs,m->inode_id);
+	file_readv(fs,m->inode_id,&whole,1,offset);
+	inode_unlock(fs,m->inode_id);
+	bcopy((unsigned char *)m->addr,(unsigned char *)fs->map_twin+first*NEW_BLOCK_SIZE,nblocks*NEW_BLOCK_SIZE);
+	return m->addr;
+}
+
+int fsh_msync( fs_t *fs, char *addr, int len) {
+	FS_LOCK(&fs->fd_lock);
+	file_map *m=map_find(fs,addr);
+	int inode_id=m?m->inode_id:-1;
+	int prot=m?m->prot:0;
+	FS_UNLOCK(&fs->fd_lock);
+	if(m==NULL || len<0)
+	{
+		ERROR_MSG(("address isn't in a mapping\n"))
+		return -1;
+	}
+	if(!(prot&FS_PROT_WRITE))
+		return 0;
+	txn_begin(fs);
+	inode_lock(fs,inode_id);
+	//fs_munmap frees a mapping only under its inode lock, so if addr still
+	//finds m here, m stays until inode_unlock
+	FS_LOCK(&fs->fd_lock);
+	bool_t mapped=map_find(fs,addr)==m && m->inode_id==inode_id;
+	FS_UNLOCK(&fs->fd_lock);
+	if(!mapped)
+	{
+		inode_unlock(fs,inode_id);
+		txn_end(fs);
+		ERROR_MSG(("address isn't in a mapping\n"))
+		return -1;
+	}
+	//whole blocks holding [addr,addr+len), never past the mapping or the file's end
+	int start=(addr-m->addr)/NEW_BLOCK_SIZE*NEW_BLOCK_SIZE;
+	int end=addr-m->addr+len;
+	end=(end-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE*NEW_BLOCK_SIZE;
+	if(end>m->nblocks*NEW_BLOCK_SIZE)
+		end=m->nblocks*NEW_BLOCK_SIZE;
+	inode temp;
+	inode_read(fs,inode_id,&temp);
+	if(m->offset+end>temp.size)
+		end=temp.size>m->offset+start?temp.size-m->offset:start;
+	//only runs of blocks that differ from the twin are written
+	char *twin=fs->map_twin+(m->addr-fs->map_pool);
+	int res=0;
+	int run=start;
+	while(run<end)
+	{
+		int run_end=run;
+		while(run_end<end)
+		{
+			int n=end-run_end<NEW_BLOCK_SIZE?end-run_end:NEW_BLOCK_SIZE;
+			if(!map_changed(m->addr+run_end,twin+run_end,n))
+				break;
+			run_end+=n;
+		}
+		if(run_end==run)
+		{
+			run+=NEW_BLOCK_SIZE;
+			continue;
+		}
+		fs_iovec dirty={m->addr+run,run_end-run};
+		uint32_t pos=m->offset+run;
+		if(file_writev(fs,inode_id,&dirty,1,&pos)!=run_end-run)
+		{
+			res=-1;
 			break;
 		}
-	int res=dir_entry_find(temp_pwd,file_path);
-	if(res<0){
-		// ERROR_MSG(("%s doesn't exist!\n",file_path))
-		return -1;
+		bcopy((unsigned char *)m->addr+run,(unsigned char *)twin+run,run_end-run);
+		run=run_end;
 	}
-	if(i==path_len)//we reach the last item
-		return res;
-	inode temp;
-	inode_read(res,&temp);
-	if(temp.type!=MY_DIRECTORY)
+	inode_unlock(fs,inode_id);
+	txn_end(fs);
+	return res;
+}
+
+int fsh_munmap( fs_t *fs, char *addr, int len) {
+	txn_begin(fs);
+	FS_LOCK(&fs->ns_lock);//for inode_put
+	FS_LOCK(&fs->fd_lock);
+	file_map *m=map_find(fs,addr);
+	if(m==NULL || addr!=m->addr)
 	{
-		ERROR_MSG(("%s is a data file not a path!\n",file_path))
+		FS_UNLOCK(&fs->fd_lock);
+		FS_UNLOCK(&fs->ns_lock);
+		txn_end(fs);
+		ERROR_MSG(("address doesn't start a mapping\n"))
 		return -1;
 	}
-	return rel_path_dir_resolve(file_path+i+1,res);
+	int inode_id=m->inode_id;
+	FS_UNLOCK(&fs->fd_lock);
+	//wait out an fs_msync writing from the mapping; ns_lock keeps other
+	//fs_munmap calls off m meanwhile
+	inode_lock(fs,inode_id);
+	FS_LOCK(&fs->fd_lock);
+	int first=(m->addr-fs->map_pool)/NEW_BLOCK_SIZE;
+	int i;
+	for(i=first;i<first+m->nblocks;i++)
+		fs->map_pool_used[i]=FALSE;
+	m->is_using=FALSE;
+	FS_UNLOCK(&fs->fd_lock);
+	inode_unlock(fs,inode_id);
+	inode_put(fs,inode_id);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end(fs);
+	return 0;
 }
-//mode MY_DIRECTORY 0, REAL_FILE 1 , find last dir 2
-//mode 0 allow input d/ or d , 1 find file's inode , 2 find it's parent's inode
-static int path_resolve(char * file_path , int temp_pwd ,int mode)
-{
-	if(file_path==NULL){
-		ERROR_MSG(("No path input!\n"))
+
+//we assume the start position of fs_lseek is always SEEK_SET = 0
+int fsh_lseek( fs_t *fs, int fd, int offset) {
+	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+	{
+		ERROR_MSG(("Wrong fd !\n"))
 		return -1;
 	}
-	int path_len=strlen(file_path);
-	if(path_len>MAX_PATH_NAME){
-		ERROR_MSG(("too long path!\n"))
+	if(fs->fd_table[fd].is_using==FALSE)
+	{
+		ERROR_MSG(("The fd isn't open!\n"))
 		return -1;
 	}
-	if(path_len==0)
+	if(offset<0)
 	{
-		ERROR_MSG(("no path input!\n"))
+		ERROR_MSG(("offset <0 !\n"))
 		return -1;
 	}
+	int inode_id=fs->fd_table[fd].inode_id;
+	inode_rdlock(fs,inode_id);
+	int old_cursor=fs->fd_table[fd].cursor;
 
-	//copy the path
-	char path_buffer[MAX_PATH_NAME+1];
-	bcopy((unsigned char *)file_path,(unsigned char *)path_buffer,path_len);
-	path_buffer[path_len]='\0';
-	file_path=path_buffer;
-	
-	if(file_path[0]=='/')//absolute path
-	{
-		//trick to change str and temp_pwd
-		temp_pwd=ROOT_DIR_ID;
-		file_path++;
-		path_len--;
-	}
+	fs->fd_table[fd].cursor=offset;
+	inode_unlock(fs,inode_id);
+	return old_cursor;
+}
 
-	if(mode==2)//to find the last dir
+static int fs_mkdir_locked(fs_t *fs,int cwd,char *fileName)
+{
+	//missing parents are created by the walk itself
+	path_walk_res walk;
+	path_walk(fs,fileName,cwd,&walk,1);
+	if(walk.parent<0)
+		return 0;
+	if(walk.leaf_id>=0)
 	{
-		int i;
-		for(i=path_len-1;i>=0;i--)//cut the last term
-			if(file_path[i]=='/'){
-				file_path[i+1]='\0';
-				break;
-			}
-		//find dir
-		if(i==-1)
-			return temp_pwd;
-		else if(i==0)
-			return ROOT_DIR_ID;
-		else
-			return path_resolve(file_path,temp_pwd,MY_DIRECTORY);
+		ERROR_MSG(("Already have a same name file !\n"))
+		return 0;
 	}
-
-	
-	//real file or last dir mode need to check last char
-	if(mode!=MY_DIRECTORY)
+	dir_create(fs,walk.parent,walk.leaf);
+	return 0;
+}
+int fsh_mkdir( fs_t *fs, char *fileName)
+{
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_mkdir_locked(fs,fs->pwd,fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
+//--- recursive delete ------------------------------------------
+//write back the inode block rm_walk has loaded and let others at it again
+static void rm_inode_done(fs_t *fs,rm_walk *w)
+{
+	if(w->inode_block<0)
+		return;
+	if(w->inode_dirty)
+		new_block_write(fs,fs->my_sb->inode_start+w->inode_block,w->inode_scratch);
+	FS_RWUNLOCK(&fs->itable_lock[w->inode_block]);
+	w->inode_block=-1;
+	w->inode_dirty=FALSE;
+}
+//inode id in the block rm_walk has loaded, the pointer is good until the next call
+//the loaded block stays locked, so nobody changes it under the walk's copy
+static inode *rm_inode(fs_t *fs,rm_walk *w,int id)
+{
+	if(id/INODE_PER_BLOCK!=w->inode_block)
 	{
-		if(path_len==0 || file_path[path_len-1]=='/')//root or end up with /
-		{
-			ERROR_MSG(("try to find a file but input a path!\n"))
-			return -1;
-		}
+		rm_inode_done(fs,w);
+		w->inode_block=id/INODE_PER_BLOCK;
+		FS_WRLOCK(&fs->itable_lock[w->inode_block]);
+		new_block_read(fs,fs->my_sb->inode_start+w->inode_block,w->inode_scratch);
 	}
-	else if(file_path[path_len-1]=='/')//dir allow input: cd abc/ or cd abc  
-		file_path[path_len-1]='\0';
-	
-	//now we have a prepared relative path
-	return rel_path_dir_resolve(file_path,temp_pwd);
+	return (inode *)w->inode_scratch+id%INODE_PER_BLOCK;
 }
-
-//fs init ------------------------------------------------------
-void fs_init( void) {
-	block_init();
-	/* More code HERE */
-	//load super block
-	my_sb = (super_b *)super_block_scratch;
-	new_block_read(SUPER_BLOCK,super_block_scratch);
-	if(my_sb->magic_num != MY_MAGIC) //main sb crash or not formatted
+static dir_entry *rm_entry(fs_t *fs,rm_walk *w,int dir_id,inode *dir_inode,int index)
+{
+	int now_block=index/DIR_ENTRY_PER_BLOCK;
+	int entry_block;
+	if(now_block<DIRECT_BLOCK)
+		entry_block=dir_inode->blocks[now_block];
+	else
 	{
-		new_block_read(SUPER_BLOCK_BACKUP,super_block_scratch);
-		if(my_sb->magic_num != MY_MAGIC)//need formatted
+		if(w->index_of!=dir_id)
 		{
-			fs_mkfs();
-			return;
+			dblock_read(fs,dir_inode->blocks[DIRECT_BLOCK],w->index_scratch);
+			w->index_of=dir_id;
 		}
-		else
-			new_block_write(SUPER_BLOCK,super_block_scratch);
-	}
-	//mount to root
-	pwd=(uint16_t)ROOT_DIR_ID;
-	//clear fd_table
-	bzero((char *)fd_table,sizeof(fd_table));
-
-	//load bitmaps
-	new_block_read(my_sb->inode_bitmap_place,inode_bitmap_block_scratch);
-	new_block_read(my_sb->dblock_bitmap_place,dblock_bitmap_block_scratch);
-}
-
-int fs_mkfs( void) {
-	my_sb = (super_b *)super_block_scratch;
-	my_sb->file_sys_size = FS_SIZE;
-	my_sb->inode_bitmap_place = SUPER_BLOCK+1;
-	my_sb->dblock_bitmap_place = SUPER_BLOCK+2;
-	my_sb->inode_start = SUPER_BLOCK+3;
-	my_sb->inode_count = 1;
-	my_sb->dblock_start= SUPER_BLOCK+3+INODE_BLOCK_NUMBER;
-	my_sb->magic_num=MY_MAGIC;
-	sb_write();
-	//zero bitmaps
-	my_bzero_block(my_sb->inode_bitmap_place);
-	my_bzero_block(my_sb->dblock_bitmap_place);
-	bzero(inode_bitmap_block_scratch,NEW_BLOCK_SIZE);
-	bzero(dblock_bitmap_block_scratch,NEW_BLOCK_SIZE);
-	//reset pointers
-	inode_bitmap_last=0;
-	dblock_bitmap_last=0;
-	
-	inode temp_root;
-	inode_init(&temp_root,MY_DIRECTORY);
-	inode_write(ROOT_DIR_ID,&temp_root);
-	write_bitmap_block(INODE_BITMAP,ROOT_DIR_ID,1);
-
-	int res;
-	res=dir_entry_add(ROOT_DIR_ID,ROOT_DIR_ID,".");
-	if(res<0){
-		bzero(super_block_scratch,NEW_BLOCK_SIZE);
-		sb_write();
-		return -1;
+		entry_block=((uint16_t *)w->index_scratch)[now_block-DIRECT_BLOCK];
 	}
-	res=dir_entry_add(ROOT_DIR_ID,ROOT_DIR_ID,"..");
-	if(res<0){
-		bzero(super_block_scratch,NEW_BLOCK_SIZE);
-		sb_write();
-		return -1;
+	//nothing is allocated during the walk, so a block id can't change meaning
+	if(entry_block!=w->entry_block)
+	{
+		dblock_read(fs,entry_block,w->entry_scratch);
+		w->entry_block=entry_block;
 	}
-
-	//mount to root
-	pwd = ROOT_DIR_ID;
-	//clear fd_table
-	bzero((char *)fd_table,sizeof(fd_table));
-
-	return 0;
+	return (dir_entry *)w->entry_scratch+index%DIR_ENTRY_PER_BLOCK;
 }
-
-int fs_open( char *fileName, int flags) {
-	int path_res=path_resolve(fileName,pwd,MY_DIRECTORY);
-	if(flags!=FS_O_RDONLY && flags!= FS_O_WRONLY && flags!= FS_O_RDWR)
-		return -1;
-	int new_fd=fd_open(path_res,flags);
-	if(new_fd<0)
-		return -1;
-	if(path_res<0)
+//remove dir_id and everything below it, by inode number and without recursion
+//directory blocks of removed directories are freed, never rewritten,
+//and all bitmap & superblock updates go out once at the end
+static void rmdir_tree(fs_t *fs,int dir_id)
+{
+	rm_walk w;
+	w.inode_block=-1;
+	w.inode_dirty=FALSE;
+	w.index_of=-1;
+	w.entry_block=-1;
+	int depth=0;
+	int loaded_depth=-1;//frame whose inode is in dir_inode
+	inode dir_inode;
+	fs->rm_stack[0].dir_id=dir_id;
+	fs->rm_stack[0].next=0;
+	batch_begin(fs);
+	while(depth>=0)
 	{
-		if(flags==FS_O_RDONLY)//read only can not create file
+		rm_frame *f=&fs->rm_stack[depth];
+		if(loaded_depth!=depth)
 		{
-			fd_close(new_fd);
-			ERROR_MSG(("%s doesn't exist,and try to open as read-only\n",fileName))
-			return -1;
+			dir_inode=*rm_inode(fs,&w,f->dir_id);
+			loaded_depth=depth;
 		}
-		else
+		if(f->next>=dir_inode.size/sizeof(dir_entry))//all children are gone
 		{
-			path_res=path_resolve(fileName,pwd,2);//try to find parent dir and create?
-			if(path_res<0)
-			{
-				fd_close(new_fd);
-				ERROR_MSG(("%s doesn't exist,and its parent dir doesn't exist either\n",fileName));
-				return -1;
-			}
-			int i;
-			for(i=strlen(fileName)-1;i>=0;i--)//cut the last term
-				if(fileName[i]=='/')
-					break;
-			i++;
-			int new_inode=inode_create(REAL_FILE);
-			if(new_inode<0)
-			{
-				fd_close(new_fd);
-				ERROR_MSG(("can't create inode when try to open a new file\n"));
-				return -1;
-			}
-			dir_entry_add(path_res,new_inode,fileName+i);
-			fd_table[new_fd].inode_id=new_inode;
+			inode_release(fs,f->dir_id,&dir_inode);
+			depth--;
+			continue;
 		}
-	}
-	else{
-		inode temp;
-		inode_read(path_res,&temp);
-		if(flags!=FS_O_RDONLY && temp.type == MY_DIRECTORY)
+		dir_entry *e=rm_entry(fs,&w,f->dir_id,&dir_inode,f->next);
+		f->next++;
+		if(e->file_name[0]=='\0' || same_string(e->file_name,".") || same_string(e->file_name,".."))
+			continue;
+		int child=e->inode_id;
+		inode *c=rm_inode(fs,&w,child);
+		if(c->type==MY_DIRECTORY)
 		{
-			ERROR_MSG(("%s is a directory,but try to open as writable\n",fileName))
-			fd_close(new_fd);
-			return -1;
+			depth++;
+			fs->rm_stack[depth].dir_id=child;
+			fs->rm_stack[depth].next=0;
+			continue;
+		}
+		c->link_count--;
+		w.inode_dirty=TRUE;
+		if(c->link_count==0 && fd_find_same_num(fs,child)==0)
+		{
+			inode temp=*c;
+			inode_release(fs,child,&temp);
 		}
-		fd_table[new_fd].inode_id=path_res;
 	}
-	return new_fd;
+	rm_inode_done(fs,&w);
+	batch_end(fs);
 }
 
-int fs_close( int fd) {
-	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+//we assume -r is set
+static int fs_rmdir_locked(fs_t *fs,int cwd,char *fileName)
+{
+	path_walk_res walk;
+	int dir_res=path_walk(fs,fileName,cwd,&walk,0);
+	if(dir_res<0)
 	{
-		ERROR_MSG(("Wrong fd input!\n"))
+		ERROR_MSG(("The directory doesn't exist!\n"))
 		return -1;
 	}
-	if(fd_table[fd].is_using==FALSE)
+	inode dir_inode;
+	inode_read(fs,dir_res,&dir_inode);
+	if(dir_inode.type!=MY_DIRECTORY)
 	{
-		ERROR_MSG(("fd %d is not using!",fd))
+		ERROR_MSG(("%s is not a directory\n",fileName))
 		return -1;
 	}
-	fd_close(fd);
+	if(dir_res==ROOT_DIR_ID || walk.parent<0 || same_string(walk.leaf,".") || same_string(walk.leaf,".."))
+		return -1;
+	rmdir_tree(fs,dir_res);
+	dir_entry_delete(fs,walk.parent,walk.leaf);
+	return 0;
+}
+int fsh_rmdir( fs_t *fs, char *fileName)
+{
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_rmdir_locked(fs,fs->pwd,fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
 
-	//check whether we need to delete the file
-	if(fd_find_same_num(fd_table[fd].inode_id)==0)
+//the directory dirName leads to from cwd, -1 if none
+static int fs_cd_locked(fs_t *fs,int cwd,char *dirName) {
+	int path_res=path_resolve(fs,dirName,cwd,MY_DIRECTORY);
+	if(path_res<0)
+		return -1;
+	inode temp_inode;
+	inode_read(fs,path_res,&temp_inode);
+	if(temp_inode.type!=MY_DIRECTORY)
 	{
-		inode temp;
-		inode_read(fd_table[fd].inode_id,&temp);
-		if(temp.link_count==0)//need to free the file
-			inode_free(fd_table[fd].inode_id);
+		ERROR_MSG(("%s is not a dir\n",dirName));
+		return -1;
 	}
-	return fd;
+	return path_res;
+}
+int fsh_cd( fs_t *fs, char *dirName)
+{
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_cd_locked(fs,fs->pwd,dirName);
+	if(res>=0)
+		fs->pwd=res;
+	FS_UNLOCK(&fs->ns_lock);
+	return res<0?-1:0;
 }
 
-int fs_read( int fd, char *buf, int count) {
-	if(count<0)
+static int fs_link_locked(fs_t *fs,int cwd,char *old_fileName, char *new_fileName) {
+	int old_res=path_resolve(fs,old_fileName,cwd,REAL_FILE);
+	if(old_res<0)
 	{
-		ERROR_MSG(("Wrong count input!\n"))
+		ERROR_MSG(("The old file doesn't exist!\n"))
 		return -1;
 	}
-	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+	inode temp;
+	inode_read(fs,old_res,&temp);
+	if(temp.type==MY_DIRECTORY)
 	{
-		ERROR_MSG(("Wrong fd input!\n"))
+		ERROR_MSG(("Try to link a directory!\n"))
 		return -1;
 	}
-	if(fd_table[fd].is_using==FALSE)
+	path_walk_res walk;
+	int new_res=path_walk(fs,new_fileName,cwd,&walk,0);
+	if(new_res>=0)
 	{
-		ERROR_MSG(("fd %d is not using!",fd))
+		ERROR_MSG(("new filename already exist!\n"))
 		return -1;
 	}
-	if(fd_table[fd].mode==FS_O_WRONLY)
+	if(walk.parent<0 || walk.dir_only)
 	{
-		ERROR_MSG(("can't read the file open as write-only file"))
+		ERROR_MSG(("%s 's parent dir doesn't exist\n",new_fileName));
 		return -1;
 	}
-	if (count==0)
+	dir_entry_add(fs,walk.parent,old_res,walk.leaf);
+	inode_links_add(fs,old_res,1);
+	return 0;
+}
+int fsh_link( fs_t *fs, char *old_fileName, char *new_fileName)
+{
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_link_locked(fs,fs->pwd,old_fileName,new_fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
+
+static int fs_unlink_locked(fs_t *fs,int cwd,char *fileName) {
+	path_walk_res walk;
+	int res=path_walk(fs,fileName,cwd,&walk,0);
+	if(res>=0 && walk.dir_only)
 	{
-		return 0;
+		ERROR_MSG(("try to find a file but input a path!\n"))
+		res=-1;
 	}
-	inode temp_file;
-	inode_read(fd_table[fd].inode_id,&temp_file);
-	
-	int real_count=0;
-	if(fd_table[fd].cursor>=temp_file.size)
-		return 0;
-	if(fd_table[fd].cursor+count>temp_file.size)
-		count=temp_file.size-fd_table[fd].cursor;
-
-	int end_block=(fd_table[fd].cursor+count-1)/NEW_BLOCK_SIZE;
-	int in_end_block_cursor=(fd_table[fd].cursor+count-1)%NEW_BLOCK_SIZE;
-	
-	while(real_count<count)
+	if(res<0)
 	{
-		int now_block=fd_table[fd].cursor/NEW_BLOCK_SIZE;
-		int now_block_id;
-		if(now_block>=DIRECT_BLOCK)
-		{
-			dblock_read(temp_file.blocks[DIRECT_BLOCK],block_scratch);
-			uint16_t *block_list=(uint16_t *)block_scratch;
-			now_block_id=block_list[now_block-DIRECT_BLOCK];
-		}
-		else
-		{
-			now_block_id=temp_file.blocks[now_block];
-		}
-		dblock_read(now_block_id,block_scratch);
-
-		int rdy_count;
-		if(now_block<end_block)
-			rdy_count=NEW_BLOCK_SIZE-fd_table[fd].cursor%NEW_BLOCK_SIZE;
-		else
-			rdy_count=in_end_block_cursor-fd_table[fd].cursor%NEW_BLOCK_SIZE+1;
-		bcopy((unsigned char *)(block_scratch+fd_table[fd].cursor%NEW_BLOCK_SIZE),(unsigned char *)buf,rdy_count);
-		buf+=rdy_count;
-		real_count+=rdy_count;
-		fd_table[fd].cursor+=rdy_count;
+		ERROR_MSG(("The file doesn't exist!\n"))
+		return -1;
 	}
-	return real_count;
-}
-	
-int fs_write( int fd, char *buf, int count) {
-	if(count<0)
+	inode temp;
+	inode_read(fs,res,&temp);
+	if(temp.type==MY_DIRECTORY)
 	{
-		ERROR_MSG(("Wrong count input!\n"))
+		ERROR_MSG(("try to unlink a dir!\n"))
 		return -1;
 	}
-	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+	if(inode_links_add(fs,res,-1)==0)
 	{
-		ERROR_MSG(("Wrong fd input!\n"))
+		if(fd_find_same_num(fs,res)==0)
+			inode_free(fs,res);
+	}
+	dir_entry_delete(fs,walk.parent,walk.leaf);
+	return 0;
+}
+int fsh_unlink( fs_t *fs, char *fileName)
+{
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_unlink_locked(fs,fs->pwd,fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
+
+static int fs_rename_locked(fs_t *fs,int cwd,char *old_fileName, char *new_fileName) {
+	path_walk_res old_walk;
+	int old_res=path_walk(fs,old_fileName,cwd,&old_walk,0);
+	if(old_res<0 || old_walk.parent<0 || same_string(old_walk.leaf,".") || same_string(old_walk.leaf,".."))
+	{
+		ERROR_MSG(("The old file doesn't exist!\n"))
 		return -1;
 	}
-	if(fd_table[fd].is_using==FALSE)
+	inode temp;
+	inode_read(fs,old_res,&temp);
+	path_walk_res new_walk;
+	int new_res=path_walk(fs,new_fileName,cwd,&new_walk,0);
+	if(new_walk.parent<0 || same_string(new_walk.leaf,".") || same_string(new_walk.leaf,".."))
 	{
-		ERROR_MSG(("fd %d is not using!",fd))
+		ERROR_MSG(("%s 's parent dir doesn't exist\n",new_fileName));
 		return -1;
 	}
-	if(fd_table[fd].mode==FS_O_RDONLY)
+	if(temp.type!=MY_DIRECTORY && (old_walk.dir_only || new_walk.dir_only))
 	{
-		ERROR_MSG(("can't write the file open as read-only file"))
+		ERROR_MSG(("try to find a file but input a path!\n"))
 		return -1;
 	}
-	if (count==0)
+	if(strlen(new_walk.leaf)>MAX_FILE_NAME)
 	{
-		return 0;
+		ERROR_MSG(("Too long file name!\n"))
+		return -1;
 	}
-	inode temp_file;
-	inode_read(fd_table[fd].inode_id,&temp_file);
-	int temp_size=temp_file.size;
-
-	int total_block_num=(temp_file.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
-	int end_block_num=(fd_table[fd].cursor+count-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
-	int in_end_block_cursor=(fd_table[fd].cursor+count-1)%NEW_BLOCK_SIZE;
-	while(total_block_num<end_block_num)
+	if(new_res==old_res)//same file
+		return 0;
+	if(temp.type==MY_DIRECTORY)
 	{
-		if(alloc_dblock_mount_to_inode(fd_table[fd].inode_id)<0)
+		if(new_res>=0)
 		{
-			end_block_num=total_block_num;
-			in_end_block_cursor=NEW_BLOCK_SIZE-1;
-			break;
+			ERROR_MSG(("new filename already exist!\n"))
+			return -1;
+		}
+		//a directory can't go below itself
+		int up=new_walk.parent;
+		while(up!=ROOT_DIR_ID)
+		{
+			if(up==old_res)
+			{
+				ERROR_MSG(("can't move %s into itself\n",old_fileName))
+				return -1;
+			}
+			up=dir_entry_find(fs,up,"..");
+			if(up<0)
+				return -1;
 		}
-		inode_read(fd_table[fd].inode_id,&temp_file);
-		temp_file.size+=NEW_BLOCK_SIZE;
-		inode_write(fd_table[fd].inode_id,&temp_file);
-		total_block_num++;
 	}
-	//there may be some new dblocks , so we need the newest inode
-	//inode_read(fd_table[fd].inode_id,&temp_file);
-	
-	count=(end_block_num-1)*NEW_BLOCK_SIZE+in_end_block_cursor-fd_table[fd].cursor+1;
-
-	if(fd_table[fd].cursor+count>temp_size)
-		temp_file.size=fd_table[fd].cursor+count;
-	else
-		temp_file.size=temp_size;
 
-	inode_write(fd_table[fd].inode_id,&temp_file);
-	
-	int real_count=0;
-	while(real_count<count)
+	if(new_res>=0)//replace an existing file, the new name switches over in one write
 	{
-		int now_block=fd_table[fd].cursor/NEW_BLOCK_SIZE;
-		int now_block_id;
-		if(now_block>=DIRECT_BLOCK)
-		{
-			dblock_read(temp_file.blocks[DIRECT_BLOCK],block_scratch);
-			uint16_t *block_list=(uint16_t *)block_scratch;
-			now_block_id=block_list[now_block-DIRECT_BLOCK];
-		}
-		else
+		inode target;
+		inode_read(fs,new_res,&target);
+		if(target.type==MY_DIRECTORY)
 		{
-			now_block_id=temp_file.blocks[now_block];
+			ERROR_MSG(("%s is a directory\n",new_fileName))
+			return -1;
 		}
-		dblock_read(now_block_id,block_scratch);
+		dir_entry_update(fs,new_walk.parent,new_walk.leaf,old_res,NULL);
+		dir_entry_delete(fs,old_walk.parent,old_walk.leaf);
+		if(inode_links_add(fs,new_res,-1)==0 && fd_find_same_num(fs,new_res)==0)
+			inode_free(fs,new_res);
+		return 0;
+	}
+	if(new_walk.parent==old_walk.parent)//same directory, rename in place
+		return dir_entry_update(fs,old_walk.parent,old_walk.leaf,-1,new_walk.leaf);
+	if(dir_entry_add(fs,new_walk.parent,old_res,new_walk.leaf)<0)
+		return -1;
+	dir_entry_delete(fs,old_walk.parent,old_walk.leaf);
+	if(temp.type==MY_DIRECTORY)
+		dir_entry_update(fs,old_res,"..",new_walk.parent,NULL);
+	return 0;
+}
+int fsh_rename( fs_t *fs, char *old_fileName, char *new_fileName)
+{
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_rename_locked(fs,fs->pwd,old_fileName,new_fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
 
-		int rdy_count;
-		if(now_block<end_block_num-1)
-			rdy_count=NEW_BLOCK_SIZE-fd_table[fd].cursor%NEW_BLOCK_SIZE;
-		else
-			rdy_count=in_end_block_cursor-fd_table[fd].cursor%NEW_BLOCK_SIZE+1;
-		bcopy((unsigned char *)buf,(unsigned char *)(block_scratch+fd_table[fd].cursor%NEW_BLOCK_SIZE),rdy_count);
-		dblock_write(now_block_id,block_scratch);
-		buf+=rdy_count;
-		real_count+=rdy_count;
-		fd_table[fd].cursor+=rdy_count;
+static int fs_stat_locked(fs_t *fs,int cwd,char *fileName, fileStat *buf) {
+	int res=path_resolve(fs,fileName,cwd,REAL_FILE);
+	if(res<0)
+	{
+		ERROR_MSG(("The file doesn't exist!\n"))
+		return -1;
 	}
-	return real_count;
+	inode temp;
+	inode_read(fs,res,&temp);
+	buf->inodeNo=res;
+	buf->type=temp.type+1;
+	buf->links=temp.link_count;
+	buf->size=temp.size;
+	buf->numBlocks=(temp.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+	if(buf->numBlocks>DIRECT_BLOCK)
+		buf->numBlocks++;
+	return 0;
+}
+int fsh_stat( fs_t *fs, char *fileName, fileStat *buf)
+{
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_stat_locked(fs,fs->pwd,fileName,buf);
+	FS_UNLOCK(&fs->ns_lock);
+	return res;
 }
 
-//we assume the start position of fs_lseek is always SEEK_SET = 0
-int fs_lseek( int fd, int offset) {
-	if(fd<0||fd>=MAX_OPEN_FILE_NUM)
+static int fs_readdir_plus_locked(fs_t *fs,int dirfd, int *cookie, dirent_plus *buf, int n) {
+	if(dirfd<0||dirfd>=MAX_OPEN_FILE_NUM)
 	{
-		ERROR_MSG(("Wrong fd !\n"))
+		ERROR_MSG(("Wrong fd input!\n"))
 		return -1;
 	}
-	if(fd_table[fd].is_using==FALSE)
+	if(fs->fd_table[dirfd].is_using==FALSE)
 	{
-		ERROR_MSG(("The fd isn't open!\n"))
+		ERROR_MSG(("fd %d is not using!",dirfd))
 		return -1;
 	}
-	if(offset<0)
+	if(cookie==NULL||*cookie<0||n<0)
+		return -1;
+	inode dir_inode;
+	inode_read(fs,fs->fd_table[dirfd].inode_id,&dir_inode);
+	if(dir_inode.type!=MY_DIRECTORY)
 	{
-		ERROR_MSG(("offset <0 !\n"))
+		ERROR_MSG(("fd %d is not a directory\n",dirfd))
 		return -1;
 	}
-	int old_cursor=fd_table[fd].cursor;
-
-	fd_table[fd].cursor=offset;
-	return old_cursor;
-}
+	if(n>READDIR_PLUS_BATCH)
+		n=READDIR_PLUS_BATCH;
+	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
 
-int fs_mkdir_pwd( char *fileName) {
-	if(strlen(fileName)>MAX_FILE_NAME)
+	//names and inode numbers, one read per directory block, empty slots skipped
+	char index_scratch[NEW_BLOCK_SIZE];
+	char entry_scratch[NEW_BLOCK_SIZE];
+	dir_entry *entry_list=(dir_entry *)entry_scratch;
+	int i=0,now_block=-1,entry=*cookie;
+	if(total_entry_num>DIRECT_BLOCK*DIR_ENTRY_PER_BLOCK)
+		dblock_read(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+	while(i<n && entry<total_entry_num)
 	{
-		ERROR_MSG(("Too long file name!\n"))
-		return -1;
+		if(entry/DIR_ENTRY_PER_BLOCK!=now_block)
+		{
+			now_block=entry/DIR_ENTRY_PER_BLOCK;
+			dblock_read(fs,block_map(&dir_inode,now_block,index_scratch),entry_scratch);
+		}
+		dir_entry *e=&entry_list[entry%DIR_ENTRY_PER_BLOCK];
+		entry++;
+		if(e->file_name[0]=='\0')
+			continue;
+		bzero(buf[i].name,MAX_FILE_NAME+1);
+		strcpy_safe(e->file_name,buf[i].name,MAX_FILE_NAME);
+		buf[i].inodeNo=e->inode_id;
+		i++;
 	}
-	if(dir_entry_find(pwd,fileName)>=0)
+	n=i;
+
+	//attributes, visiting entries in inode order so each inode block is read once
+	uint16_t order[READDIR_PLUS_BATCH];
+	int j;
+	for(i=0;i<n;i++)
 	{
-		ERROR_MSG(("Already have a same name file !\n"))
-		return -1;
-	}
-	
-	int new_inode=inode_create(MY_DIRECTORY);
-	if(new_inode<0)
-		return -1;
-	if(dir_entry_add(new_inode,new_inode,".")<0){
-		inode_free(new_inode);
-		return -1;
+		for(j=i;j>0&&buf[order[j-1]].inodeNo>buf[i].inodeNo;j--)
+			order[j]=order[j-1];
+		order[j]=i;
 	}
-	if(dir_entry_add(new_inode,pwd,"..")<0){
-		inode_free(new_inode);
-		return -1;
-	}
-	if(dir_entry_add(pwd,new_inode,fileName)<0){
-		inode_free(new_inode);
-		return -1;
+	char inode_scratch[NEW_BLOCK_SIZE];
+	inode *inode_list=(inode *)inode_scratch;
+	int now_inode_block=-1;
+	for(i=0;i<n;i++)
+	{
+		dirent_plus *d=&buf[order[i]];
+		if(d->inodeNo/INODE_PER_BLOCK!=now_inode_block)
+		{
+			now_inode_block=d->inodeNo/INODE_PER_BLOCK;
+			FS_RDLOCK(&fs->itable_lock[now_inode_block]);
+			new_block_read(fs,fs->my_sb->inode_start+now_inode_block,inode_scratch);
+			FS_RWUNLOCK(&fs->itable_lock[now_inode_block]);
+		}
+		inode *p=&inode_list[d->inodeNo%INODE_PER_BLOCK];
+		d->type=p->type+1;
+		d->links=p->link_count;
+		d->size=p->size;
+		d->numBlocks=(p->size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
+		if(d->numBlocks>DIRECT_BLOCK)
+			d->numBlocks++;
 	}
-	return new_inode;
+	*cookie=entry;
+	return n;
 }
-int fs_mkdir(char *fileName)
+int fsh_readdir_plus( fs_t *fs, int dirfd, int *cookie, dirent_plus *buf, int n)
 {
-	
-	int path_len=strlen(fileName);
-	
-	int path_res=path_resolve(fileName,pwd,2);//try to find parent dir
-	if(path_res<0)//create parent dir
-	{
-		char path_buffer[MAX_PATH_NAME];
-		bzero(path_buffer,MAX_PATH_NAME);
-		
-		bcopy((unsigned char *)fileName,(unsigned char *)path_buffer,path_len);
-		int i;
-		for(i=path_len-1;i>=0;i--)
-			if(path_buffer[i]=='/')
-			{
-				path_buffer[i]=0;
-				break;
-			}
-		fs_mkdir(path_buffer);
-	}
-	path_res=path_resolve(fileName,pwd,2);//get parent dir
-	
-	if(path_res>=0)//we need to make sure parent dir is successfully created
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_readdir_plus_locked(fs,dirfd,cookie,buf,n);
+	FS_UNLOCK(&fs->ns_lock);
+	return res;
+}
+
+static int fs_create_many_locked(fs_t *fs,int dirfd, char **names, int n, int *out_inodes) {
+	if(dirfd<0||dirfd>=MAX_OPEN_FILE_NUM)
 	{
-		int temp_pwd=pwd;
-		
-		int i;
-		for(i=path_len-1;i>=0;i--)//cut the last term
-			if(fileName[i]=='/')
-				break;
-		i++;
-		
-		pwd=path_res;
-		fs_mkdir_pwd(fileName+i);
-		pwd=temp_pwd;
+		ERROR_MSG(("Wrong fd input!\n"))
+		return -1;
 	}
-	return 0;
-}
-//we assume -r is set
-int fs_rmdir_part( char *fileName) {
-	int dir_res=path_resolve(fileName,pwd,MY_DIRECTORY);
-	if(dir_res<0)
+	if(fs->fd_table[dirfd].is_using==FALSE)
 	{
-		ERROR_MSG(("The directory doesn't exist!\n"))
+		ERROR_MSG(("fd %d is not using!",dirfd))
 		return -1;
 	}
+	int dir_index=fs->fd_table[dirfd].inode_id;
 	inode dir_inode;
-	inode_read(dir_res,&dir_inode);
+	inode_read(fs,dir_index,&dir_inode);
 	if(dir_inode.type!=MY_DIRECTORY)
 	{
-		ERROR_MSG(("%s is not a directory\n",fileName))
+		ERROR_MSG(("fd %d is not a directory\n",dirfd))
 		return -1;
 	}
-	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
-	int total_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
-	if(total_block_num==0)
-		return 0;
-
-	//save the pwd and change it
-	int save_pwd=pwd;
-	pwd=dir_res;
-	//because we may need recursion , we need to use local variables block scratch and block scratch1
-
-	char block_scratch[NEW_BLOCK_SIZE];
-	char block_scratch_1[NEW_BLOCK_SIZE];
+	//names that can't be created keep -1
+	int i,j,count=0;
+	for(i=0;i<n;i++)
+	{
+		out_inodes[i]=-1;
+		if(names[i]==NULL||names[i][0]=='\0'||strlen(names[i])>MAX_FILE_NAME)
+			continue;
+		uint32_t h=name_hash(names[i]);
+		for(j=0;j<i;j++)
+			if(out_inodes[j]==0 && name_hash(names[j])==h && same_string(names[j],names[i]))
+				break;
+		if(j<i || dir_entry_find(fs,dir_index,names[i])>=0)
+		{
+			ERROR_MSG(("%s already exists\n",names[i]))
+			continue;
+		}
+		out_inodes[i]=0;//to create
+		count++;
+	}
 
-	if(total_block_num>DIRECT_BLOCK)
+	batch_begin(fs);
+	//inodes, in one pass over the in-memory bitmap
+	int created=0;
+	for(i=0;i<n && created<count;i++)
 	{
-		int i,j;
-		dblock_read(dir_inode.blocks[DIRECT_BLOCK],block_scratch);
-		uint16_t *block_list=(uint16_t *)block_scratch;
+		if(out_inodes[i]!=0)
+			continue;
+		out_inodes[i]=inode_alloc(fs);
+		if(out_inodes[i]<0)
+			break;
+		created++;
+	}
+	for(;i<n;i++)
+		if(out_inodes[i]==0)
+			out_inodes[i]=-1;
 
-		for(i=0;i<total_block_num-DIRECT_BLOCK-1;i++)
+	//directory blocks for the new entries
+	int total_entry_num=dir_inode.size/(sizeof(dir_entry));
+	int old_block_num=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	int new_block_num=(total_entry_num+created-1+DIR_ENTRY_PER_BLOCK)/DIR_ENTRY_PER_BLOCK;
+	char index_scratch[NEW_BLOCK_SIZE];
+	bool_t index_dirty=FALSE;
+	if(old_block_num>DIRECT_BLOCK)
+		dblock_read(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+	int b;
+	for(b=old_block_num;b<new_block_num;b++)
+	{
+		if(b>=MAX_BLOCKS_INDEX_IN_INODE)
+			break;
+		if(b==DIRECT_BLOCK)
 		{
-			dblock_read(block_list[i],block_scratch_1);
-			dir_entry *entry_list=(dir_entry *)block_scratch_1;
-			for(j=0;j<DIR_ENTRY_PER_BLOCK;j++)
-			{
-				inode temp_j;
-				inode_read(entry_list[j].inode_id,&temp_j);
-				if(temp_j.type==MY_DIRECTORY)
-				{
-					if(same_string(entry_list[j].file_name,".") || same_string(entry_list[j].file_name,".."))
-						continue;
-					fs_rmdir_part(entry_list[j].file_name);
-				}
-				else
-					fs_unlink(entry_list[j].file_name);
-			}
+			int alloc_res=dblock_alloc_raw(fs);
+			if(alloc_res<0)
+				break;
+			dir_inode.blocks[DIRECT_BLOCK]=alloc_res;
+			bzero(index_scratch,NEW_BLOCK_SIZE);
 		}
-		//last block
-		dblock_read(block_list[total_block_num-DIRECT_BLOCK-1],block_scratch_1);
-		int final_end=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)%DIR_ENTRY_PER_BLOCK;
-		dir_entry *entry_list=(dir_entry *)block_scratch_1;
-		for(j=0;j<=final_end;j++)
+		int alloc_res=dblock_alloc_raw(fs);
+		if(alloc_res<0)
 		{
-			inode temp_j;
-			inode_read(entry_list[i].inode_id,&temp_j);
-			if(temp_j.type==MY_DIRECTORY)
-			{
-				if(same_string(entry_list[j].file_name,".") || same_string(entry_list[j].file_name,".."))
-					continue;
-				fs_rmdir_part(entry_list[j].file_name);
-			}
-			else
-				fs_unlink(entry_list[j].file_name);
+			if(b==DIRECT_BLOCK)
+				dblock_free(fs,dir_inode.blocks[DIRECT_BLOCK]);
+			break;
+		}
+		if(b<DIRECT_BLOCK)
+			dir_inode.blocks[b]=alloc_res;
+		else
+		{
+			((uint16_t *)index_scratch)[b-DIRECT_BLOCK]=alloc_res;
+			index_dirty=TRUE;
 		}
-		//trick to find in direct blocks
-		total_block_num=DIRECT_BLOCK;
-		total_entry_num=DIRECT_BLOCK*DIR_ENTRY_PER_BLOCK;
-
 	}
-	//direct blocks
-	int i,j,entry_block;
-	for(i=0;i<total_block_num-1;i++)
+	//give back the inodes that didn't get a slot
+	int room=b*DIR_ENTRY_PER_BLOCK-total_entry_num;
+	if(room<0)
+		room=0;
+	for(i=n-1;i>=0 && created>room;i--)
+		if(out_inodes[i]>=0)
+		{
+			write_bitmap_block(fs,INODE_BITMAP,out_inodes[i],0);
+			fs->my_sb->inode_count--;
+			out_inodes[i]=-1;
+			created--;
+		}
+
+	//inode table, one read and one write per block
+	char inode_scratch[NEW_BLOCK_SIZE];
+	inode *inode_list=(inode *)inode_scratch;
+	int now_inode_block=-1;
+	for(i=0;i<n;i++)
 	{
-		entry_block=dir_inode.blocks[i];
-		dblock_read(entry_block,block_scratch);
-		dir_entry *entry_list=(dir_entry *)block_scratch;
-		for(j=0;j<DIR_ENTRY_PER_BLOCK;j++)
+		if(out_inodes[i]<0)
+			continue;
+		if(out_inodes[i]/INODE_PER_BLOCK!=now_inode_block)
 		{
-			inode temp_j;
-			inode_read(entry_list[j].inode_id,&temp_j);
-			if(temp_j.type==MY_DIRECTORY)
+			if(now_inode_block>=0)
 			{
-				if(same_string(entry_list[j].file_name,".") || same_string(entry_list[j].file_name,".."))
-					continue;
-				fs_rmdir_part(entry_list[j].file_name);
+				new_block_write(fs,fs->my_sb->inode_start+now_inode_block,inode_scratch);
+				FS_RWUNLOCK(&fs->itable_lock[now_inode_block]);
 			}
-			else
-				fs_unlink(entry_list[j].file_name);
+			now_inode_block=out_inodes[i]/INODE_PER_BLOCK;
+			FS_WRLOCK(&fs->itable_lock[now_inode_block]);
+			new_block_read(fs,fs->my_sb->inode_start+now_inode_block,inode_scratch);
 		}
+		inode_init(&inode_list[out_inodes[i]%INODE_PER_BLOCK],REAL_FILE);
+	}
+	if(now_inode_block>=0)
+	{
+		new_block_write(fs,fs->my_sb->inode_start+now_inode_block,inode_scratch);
+		FS_RWUNLOCK(&fs->itable_lock[now_inode_block]);
 	}
-	//last block
-	int final_end=(total_entry_num-1+DIR_ENTRY_PER_BLOCK)%DIR_ENTRY_PER_BLOCK;
-	entry_block=dir_inode.blocks[total_block_num-1];
-	dblock_read(entry_block,block_scratch);
-	dir_entry *entry_list=(dir_entry *)block_scratch;
-	for(j=0;j<=final_end;j++)
+
+	//entries, one write per directory block
+	char entry_scratch[NEW_BLOCK_SIZE];
+	dir_entry *entry_list=(dir_entry *)entry_scratch;
+	dir_cache *cached=dcache_get(fs,dir_index);
+	int now_block=-1;
+	int next_i=total_entry_num;
+	for(i=0;i<n;i++)
 	{
-		inode temp_j;
-		inode_read(entry_list[j].inode_id,&temp_j);
-		if(temp_j.type==MY_DIRECTORY)
+		if(out_inodes[i]<0)
+			continue;
+		if(next_i/DIR_ENTRY_PER_BLOCK!=now_block)
 		{
-			if(same_string(entry_list[j].file_name,".") || same_string(entry_list[j].file_name,".."))
-				continue;
-			fs_rmdir_part(entry_list[j].file_name);
+			if(now_block>=0)
+				dblock_write(fs,block_map(&dir_inode,now_block,index_scratch),entry_scratch);
+			now_block=next_i/DIR_ENTRY_PER_BLOCK;
+			if(now_block<old_block_num)//the old last block, partly used
+				dblock_read(fs,block_map(&dir_inode,now_block,index_scratch),entry_scratch);
+			else
+				bzero(entry_scratch,NEW_BLOCK_SIZE);
 		}
-		else
-			fs_unlink(entry_list[j].file_name);
+		dir_entry *e=&entry_list[next_i%DIR_ENTRY_PER_BLOCK];
+		bzero((char *)e,sizeof(dir_entry));
+		e->inode_id=out_inodes[i];
+		strcpy_safe(names[i],e->file_name,MAX_FILE_NAME);
+		e->name_hash=name_hash(e->file_name);
+		e->name_len=strlen(e->file_name);
+		if(cached)
+			bloom_add(cached->bloom,e->name_hash);
+		next_i++;
 	}
-	pwd=save_pwd;
-	if(dir_res!=ROOT_DIR_ID)
-		inode_free(dir_res);
-	else
-		return -1;
-	return 0;
+	if(now_block>=0)
+		dblock_write(fs,block_map(&dir_inode,now_block,index_scratch),entry_scratch);
+	if(index_dirty)
+		dblock_write(fs,dir_inode.blocks[DIRECT_BLOCK],index_scratch);
+	dir_inode.size=next_i*sizeof(dir_entry);
+	inode_write(fs,dir_index,&dir_inode);
+	batch_end(fs);
+	return created;
 }
-int fs_rmdir(char *fileName)
+int fsh_create_many( fs_t *fs, int dirfd, char **names, int n, int *out_inodes)
 {
-	if(fs_rmdir_part(fileName)==0){
-		int parent_res=path_resolve(fileName,pwd,2);//try to find parent dir 
-		int i;
-		for(i=strlen(fileName)-1;i>=0;i--)//cut the last term
-			if(fileName[i]=='/')
-				break;
-		i++;
-		dir_entry_delete(parent_res,fileName+i);
-		return 0;
-	}
-	else
-		return -1;
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_create_many_locked(fs,dirfd,names,n,out_inodes);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
 }
 
-int fs_cd( char *dirName) {
-	int path_res=path_resolve(dirName,pwd,MY_DIRECTORY);
-	if(path_res<0)
-		return -1;
-	inode temp_inode;
-	inode_read(path_res,&temp_inode);
-	if(temp_inode.type!=MY_DIRECTORY)
+int fsh_ns_many( fs_t *fs, fs_ns_op *ops, int n)
+{
+	int i;
+	bool_t changes=FALSE;//stats alone need neither a handle nor a batch
+	for(i=0;i<n;i++)
+		if(ops[i].op!=FS_NS_STAT)
+			changes=TRUE;
+	if(changes)
+		txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	if(changes)
+		batch_begin(fs);
+	for(i=0;i<n;i++)
 	{
-		ERROR_MSG(("%s is not a dir\n",dirName));
-		return -1;
+		fs_ns_op *o=&ops[i];
+		switch(o->op)
+		{
+		case FS_NS_OPEN:
+			if(o->flags&FS_O_TRUNC)//it locks the file, which comes before the batch's alloc_lock
+			{
+				batch_end(fs);
+				o->res=fs_open_locked(fs,fs->pwd,o->path,o->flags,TRUE);
+				batch_begin(fs);
+			}
+			else
+				o->res=fs_open_locked(fs,fs->pwd,o->path,o->flags,TRUE);
+			break;
+		case FS_NS_CLOSE:
+			o->res=fs_close_locked(fs,o->fd);
+			break;
+		case FS_NS_STAT:
+			o->res=fs_stat_locked(fs,fs->pwd,o->path,o->stat);
+			break;
+		default:
+			ERROR_MSG(("unknown namespace op %d\n",o->op))
+			o->res=-1;
+		}
 	}
-	pwd=path_res;
-	return 0;
+	if(changes)
+		batch_end(fs);
+	FS_UNLOCK(&fs->ns_lock);
+	if(changes)
+		txn_end_ns(fs);
+	return n;
 }
 
-int fs_link( char *old_fileName, char *new_fileName) {
-	int old_res=path_resolve(old_fileName,pwd,REAL_FILE);
-	if(old_res<0)
-	{
-		ERROR_MSG(("The old file doesn't exist!\n"))
-		return -1;
-	}
+static int fs_cd_inode_id_locked(fs_t *fs,int dir_id)
+{
 	inode temp;
-	inode_read(old_res,&temp);
-	if(temp.type==MY_DIRECTORY)
-	{
-		ERROR_MSG(("Try to link a directory!\n"))
-		return -1;
-	}
-	int new_res=path_resolve(new_fileName,pwd,REAL_FILE);
-	if(new_res>0)
-	{
-		ERROR_MSG(("new filename already exist!\n"))
-		return -1;
-	}
-	new_res=path_resolve(new_fileName,pwd,2);//try to find parent dir 
-	if(new_res<0)
-	{
-		ERROR_MSG(("%s 's parent dir doesn't exist\n",new_fileName));
+	inode_read(fs,dir_id,&temp);
+	if(temp.type!=MY_DIRECTORY)
 		return -1;
-	}
-	int i;
-	for(i=strlen(new_fileName)-1;i>=0;i--)//cut the last term
-		if(new_fileName[i]=='/')
-			break;
-	i++;
-	dir_entry_add(new_res,old_res,new_fileName+i);
-	temp.link_count++;
-	inode_write(old_res,&temp);
+	fs->pwd=dir_id;
 	return 0;
 }
+int fsh_cd_inode_id( fs_t *fs, int dir_id)
+{
+	FS_LOCK(&fs->ns_lock);
+	int res=fs_cd_inode_id_locked(fs,dir_id);
+	FS_UNLOCK(&fs->ns_lock);
+	return res;
+}
 
-int fs_unlink( char *fileName) {
-	int res=path_resolve(fileName,pwd,REAL_FILE);
-	if(res<0)
-	{
-		ERROR_MSG(("The file doesn't exist!\n"))
+//--- sessions & directory-relative calls ------------------------
+//dir_id if it's still a directory, else -1; a directory can be removed
+//while a session is in it or an fd is open on it
+static int dir_usable(fs_t *fs,int dir_id)
+{
+	FS_LOCK(&fs->alloc_lock);
+	int used=read_bitmap_block(fs,INODE_BITMAP,dir_id);
+	FS_UNLOCK(&fs->alloc_lock);
+	if(!used)
 		return -1;
-	}
 	inode temp;
-	inode_read(res,&temp);
-	if(temp.type==MY_DIRECTORY)
+	inode_read(fs,dir_id,&temp);
+	return temp.type==MY_DIRECTORY?dir_id:-1;
+}
+//directory a *at call starts from, -1 if dirfd isn't usable; caller holds ns_lock
+static int at_dir(fs_t *fs,int dirfd)
+{
+	if(dirfd==FS_AT_FDCWD)
+		return fs->pwd;
+	if(dirfd<0||dirfd>=MAX_OPEN_FILE_NUM||fs->fd_table[dirfd].is_using==FALSE)
 	{
-		ERROR_MSG(("try to unlink a dir!\n"))
+		ERROR_MSG(("Wrong dirfd input!\n"))
 		return -1;
 	}
-	temp.link_count--;
-	inode_write(res,&temp);
-	if(temp.link_count==0)
+	if(dir_usable(fs,fs->fd_table[dirfd].inode_id)<0)
 	{
-		if(fd_find_same_num(res)==0)
-			inode_free(res);
+		ERROR_MSG(("fd %d is not open on a directory\n",dirfd))
+		return -1;
 	}
+	return fs->fd_table[dirfd].inode_id;
+}
+
+int fsh_openat( fs_t *fs, int dirfd, char *fileName, int flags) {
+	txn_begin(fs);
+	FS_LOCK(&fs->ns_lock);
+	int dir=at_dir(fs,dirfd);
+	int res=dir<0?-1:fs_open_locked(fs,dir,fileName,flags,FALSE);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end(fs);
+	if(res!=OPEN_NEEDS_NS)
+		return res;
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	dir=at_dir(fs,dirfd);
+	res=dir<0?-1:fs_open_locked(fs,dir,fileName,flags,TRUE);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
+
+int fsh_mkdirat( fs_t *fs, int dirfd, char *fileName) {
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int dir=at_dir(fs,dirfd);
+	int res=dir<0?-1:fs_mkdir_locked(fs,dir,fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
+
+int fsh_unlinkat( fs_t *fs, int dirfd, char *fileName, int flags) {
+	if(flags&~FS_AT_REMOVEDIR)
+		return -1;
+	txn_begin_ns(fs);
+	FS_LOCK(&fs->ns_lock);
+	int dir=at_dir(fs,dirfd);
+	int res=-1;
+	if(dir>=0)
+		res=(flags&FS_AT_REMOVEDIR)?fs_rmdir_locked(fs,dir,fileName):fs_unlink_locked(fs,dir,fileName);
+	FS_UNLOCK(&fs->ns_lock);
+	txn_end_ns(fs);
+	return res;
+}
 
-	int parent_res=path_resolve(fileName,pwd,2);//try to find parent dir 
+fs_session *fs_session_open( fs_t *fs) {
 	int i;
-	for(i=strlen(fileName)-1;i>=0;i--)//cut the last term
-		if(fileName[i]=='/')
+	FS_LOCK(&fs->fd_lock);
+	for(i=0;i<MAX_SESSION_NUM;i++)
+		if(!fs->sessions[i].is_using)
 			break;
-	i++;
-	dir_entry_delete(parent_res,fileName+i);
-	return 0;
+	if(i==MAX_SESSION_NUM)
+	{
+		FS_UNLOCK(&fs->fd_lock);
+		ERROR_MSG(("Not enough sessions!\n"))
+		return NULL;
+	}
+	fs_session *s=&fs->sessions[i];
+	s->is_using=TRUE;
+	s->fs=fs;
+	s->cwd=ROOT_DIR_ID;
+	FS_UNLOCK(&fs->fd_lock);
+	return s;
 }
 
-int fs_stat( char *fileName, fileStat *buf) {
-	int res=path_resolve(fileName,pwd,REAL_FILE);
-	if(res<0)
-	{
-		ERROR_MSG(("The file doesn't exist!\n"))
+int fs_session_close( fs_session *s) {
+	if(s==NULL || !s->is_using)
 		return -1;
-	}
-	inode temp;
-	inode_read(res,&temp);
-	buf->inodeNo=res;
-	buf->type=temp.type+1;
-	buf->links=temp.link_count;
-	buf->size=temp.size;
-	buf->numBlocks=(temp.size-1+NEW_BLOCK_SIZE)/NEW_BLOCK_SIZE;
-	if(buf->numBlocks>DIRECT_BLOCK)
-		buf->numBlocks++;
+	FS_LOCK(&s->fs->fd_lock);
+	s->is_using=FALSE;
+	FS_UNLOCK(&s->fs->fd_lock);
 	return 0;
 }
 
-int fs_cd_inode_id(int dir_id)
+//working directory of s, -1 if it was removed; caller holds ns_lock
+static int session_cwd(fs_session *s)
 {
-	inode temp;
-	inode_read(dir_id,&temp);
-	if(temp.type!=MY_DIRECTORY)
+	if(dir_usable(s->fs,s->cwd)<0)
+	{
+		ERROR_MSG(("the session's directory was removed\n"))
 		return -1;
-	pwd=dir_id;
-	return 0;
+	}
+	return s->cwd;
+}
+
+int fss_cd( fs_session *s, char *dirName) {
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_cd_locked(s->fs,cwd,dirName);
+	if(res>=0)
+		s->cwd=res;
+	FS_UNLOCK(&s->fs->ns_lock);
+	return res<0?-1:0;
+}
+
+int fss_open( fs_session *s, char *fileName, int flags) {
+	txn_begin(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_open_locked(s->fs,cwd,fileName,flags,FALSE);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end(s->fs);
+	if(res!=OPEN_NEEDS_NS)
+		return res;
+	txn_begin_ns(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	cwd=session_cwd(s);
+	res=cwd<0?-1:fs_open_locked(s->fs,cwd,fileName,flags,TRUE);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end_ns(s->fs);
+	return res;
+}
+
+int fss_mkdir( fs_session *s, char *fileName) {
+	txn_begin_ns(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_mkdir_locked(s->fs,cwd,fileName);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end_ns(s->fs);
+	return res;
+}
+
+int fss_rmdir( fs_session *s, char *fileName) {
+	txn_begin_ns(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_rmdir_locked(s->fs,cwd,fileName);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end_ns(s->fs);
+	return res;
+}
+
+int fss_link( fs_session *s, char *old_fileName, char *new_fileName) {
+	txn_begin_ns(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_link_locked(s->fs,cwd,old_fileName,new_fileName);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end_ns(s->fs);
+	return res;
+}
+
+int fss_unlink( fs_session *s, char *fileName) {
+	txn_begin_ns(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_unlink_locked(s->fs,cwd,fileName);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end_ns(s->fs);
+	return res;
+}
+
+int fss_rename( fs_session *s, char *old_fileName, char *new_fileName) {
+	txn_begin_ns(s->fs);
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_rename_locked(s->fs,cwd,old_fileName,new_fileName);
+	FS_UNLOCK(&s->fs->ns_lock);
+	txn_end_ns(s->fs);
+	return res;
+}
+
+int fss_stat( fs_session *s, char *fileName, fileStat *buf) {
+	FS_LOCK(&s->fs->ns_lock);
+	int cwd=session_cwd(s);
+	int res=cwd<0?-1:fs_stat_locked(s->fs,cwd,fileName,buf);
+	FS_UNLOCK(&s->fs->ns_lock);
+	return res;
+}
+
+//--- default volume ------------------------------------------
+//the single-volume API, on the image fs_init mounted
+fs_t *fs_default( void) {
+	return default_fs;
+}
+int fs_sync( void) {
+	return fsh_sync(default_fs);
+}
+
+int fs_mkfs( void) {
+	return fsh_mkfs(default_fs);
+}
+int fs_open( char *fileName, int flags) {
+	return fsh_open(default_fs,fileName,flags);
+}
+int fs_close( int fd) {
+	return fsh_close(default_fs,fd);
+}
+int fs_read( int fd, char *buf, int count) {
+	return fsh_read(default_fs,fd,buf,count);
+}
+int fs_write( int fd, char *buf, int count) {
+	return fsh_write(default_fs,fd,buf,count);
+}
+int fs_lseek( int fd, int offset) {
+	return fsh_lseek(default_fs,fd,offset);
+}
+int fs_ftruncate( int fd, int len) {
+	return fsh_ftruncate(default_fs,fd,len);
+}
+int fs_pread( int fd, char *buf, int count, int offset) {
+	return fsh_pread(default_fs,fd,buf,count,offset);
+}
+int fs_pwrite( int fd, char *buf, int count, int offset) {
+	return fsh_pwrite(default_fs,fd,buf,count,offset);
+}
+int fs_readv( int fd, fs_iovec *iov, int iovcnt) {
+	return fsh_readv(default_fs,fd,iov,iovcnt);
+}
+int fs_writev( int fd, fs_iovec *iov, int iovcnt) {
+	return fsh_writev(default_fs,fd,iov,iovcnt);
+}
+int fs_preadv( int fd, fs_iovec *iov, int iovcnt, int offset) {
+	return fsh_preadv(default_fs,fd,iov,iovcnt,offset);
+}
+int fs_pwritev( int fd, fs_iovec *iov, int iovcnt, int offset) {
+	return fsh_pwritev(default_fs,fd,iov,iovcnt,offset);
+}
+int fs_copy_file_range( int fd_in, int off_in, int fd_out, int off_out, int len) {
+	return fsh_copy_file_range(default_fs,fd_in,off_in,fd_out,off_out,len);
+}
+int fs_reflink( int fd_in, int fd_out) {
+	return fsh_reflink(default_fs,fd_in,fd_out);
+}
+char *fs_mmap( int fd, int offset, int len, int prot) {
+	return fsh_mmap(default_fs,fd,offset,len,prot);
+}
+int fs_msync( char *addr, int len) {
+	return fsh_msync(default_fs,addr,len);
+}
+int fs_munmap( char *addr, int len) {
+	return fsh_munmap(default_fs,addr,len);
+}
+int fs_mkdir( char *fileName) {
+	return fsh_mkdir(default_fs,fileName);
+}
+int fs_rmdir( char *fileName) {
+	return fsh_rmdir(default_fs,fileName);
+}
+int fs_cd( char *dirName) {
+	return fsh_cd(default_fs,dirName);
+}
+int fs_cd_inode_id( int dir_id) {
+	return fsh_cd_inode_id(default_fs,dir_id);
+}
+int fs_link( char *old_fileName, char *new_fileName) {
+	return fsh_link(default_fs,old_fileName,new_fileName);
+}
+int fs_unlink( char *fileName) {
+	return fsh_unlink(default_fs,fileName);
+}
+int fs_stat( char *fileName, fileStat *buf) {
+	return fsh_stat(default_fs,fileName,buf);
+}
+int fs_rename( char *old_fileName, char *new_fileName) {
+	return fsh_rename(default_fs,old_fileName,new_fileName);
+}
+int fs_readdir_plus( int dirfd, int *cookie, dirent_plus *buf, int n) {
+	return fsh_readdir_plus(default_fs,dirfd,cookie,buf,n);
+}
+int fs_create_many( int dirfd, char **names, int n, int *out_inodes) {
+	return fsh_create_many(default_fs,dirfd,names,n,out_inodes);
+}
+int fs_ns_many( fs_ns_op *ops, int n) {
+	return fsh_ns_many(default_fs,ops,n);
+}
+int fs_openat( int dirfd, char *fileName, int flags) {
+	return fsh_openat(default_fs,dirfd,fileName,flags);
+}
+int fs_mkdirat( int dirfd, char *fileName) {
+	return fsh_mkdirat(default_fs,dirfd,fileName);
+}
+int fs_unlinkat( int dirfd, char *fileName, int flags) {
+	return fsh_unlinkat(default_fs,dirfd,fileName,flags);
 }
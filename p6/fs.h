@@ -10,23 +10,217 @@
 
 void fs_init( void);
 int fs_mkfs( void);
+//write ./disk back and mark it clean, like fs_unmount; fs_init mounts it again
+int fs_shutdown( void);
 int fs_open( char *fileName, int flags);
 int fs_close( int fd);
 int fs_read( int fd, char *buf, int count);
 int fs_write( int fd, char *buf, int count);
 int fs_lseek( int fd, int offset);
+//cut or zero-extend the file open as fd to len bytes
+int fs_ftruncate( int fd, int len);
+//read/write at byte offset without using or moving the fd's cursor
+//reads of one file run in parallel, but the cursor of an fd isn't shared
+//safely by threads reading at once, they should each use fs_pread
+int fs_pread( int fd, char *buf, int count, int offset);
+int fs_pwrite( int fd, char *buf, int count, int offset);
+
+//one buffer of a scatter/gather request
+typedef struct
+{
+	char *base;
+	int len;
+}fs_iovec;
+
+//max buffers in one fs_readv/fs_writev call
+#define FS_IOV_MAX 1024
+
+//like fs_read/fs_write, with the data spread over iov[0..iovcnt-1] in order
+int fs_readv( int fd, fs_iovec *iov, int iovcnt);
+int fs_writev( int fd, fs_iovec *iov, int iovcnt);
+//both at once: scatter/gather at offset, the cursor doesn't move
+int fs_preadv( int fd, fs_iovec *iov, int iovcnt, int offset);
+int fs_pwritev( int fd, fs_iovec *iov, int iovcnt, int offset);
+
+//copy len bytes from fd_in at off_in to fd_out at off_out inside the fs,
+//cursors don't move; return bytes copied, short at the end of fd_in or when the disk fills
+int fs_copy_file_range( int fd_in, int off_in, int fd_out, int off_out, int len);
+//make the empty file open as fd_out a copy of fd_in that shares its data blocks,
+//a shared block is copied when either file writes to it
+int fs_reflink( int fd_in, int fd_out);
+
+#define FS_PROT_READ 1
+#define FS_PROT_WRITE 2
+
+//map len bytes of the file open as fd from offset (a multiple of NEW_BLOCK_SIZE)
+//into memory, NULL on failure; the map keeps the file alive after fs_close
+//the map is a copy read in through the block cache at fs_mmap, and changes
+//reach the file only through fs_msync, within the file's current size
+char *fs_mmap( int fd, int offset, int len, int prot);
+//write back the blocks of a FS_PROT_WRITE mapping that hold [addr,addr+len)
+//and changed since fs_mmap or the last fs_msync
+int fs_msync( char *addr, int len);
+//drop the mapping starting at addr, unsynced changes are lost
+int fs_munmap( char *addr, int len);
 int fs_mkdir( char *fileName);
 int fs_rmdir( char *fileName);
 int fs_cd( char *dirName);
 int fs_link( char *old_fileName, char *new_fileName);
 int fs_unlink( char *fileName);
 int fs_stat( char *fileName, fileStat *buf);
+//move a file or directory to new_fileName, an existing file there is replaced
+int fs_rename( char *old_fileName, char *new_fileName);
 
 #define MAX_FILE_NAME 32
 #define MAX_PATH_NAME 256  // This is the maximum supported "full" path len, eg: /foo/bar/test.txt, rather than the maximum individual filename len.
 
-
-//this unix-like file sys is write_through
+//one directory entry with the attributes fs_stat would give for it
+typedef struct
+{
+	char name[MAX_FILE_NAME+1];
+	int inodeNo;
+	short type;//DIRECTORY or FILE_TYPE
+	char links;
+	int size;
+	int numBlocks;
+}dirent_plus;
+
+//max entries filled by one fs_readdir_plus call
+#define READDIR_PLUS_BATCH 128
+
+//read up to n entries of the directory open as dirfd, starting at entry *cookie
+//(0 for the first call), and advance *cookie; return entries filled, 0 at the end
+int fs_readdir_plus( int dirfd, int *cookie, dirent_plus *buf, int n);
+
+//create empty files names[0..n-1] in the directory open as dirfd, in one batch
+//out_inodes[i] gets the new inode id or -1 if names[i] wasn't created;
+//return how many were created
+int fs_create_many( int dirfd, char **names, int n, int *out_inodes);
+
+//one call of fs_ns_many: FS_NS_OPEN takes path & flags, FS_NS_CLOSE fd,
+//FS_NS_STAT path & stat; res gets what fs_open/fs_close/fs_stat returns
+#define FS_NS_OPEN 1
+#define FS_NS_CLOSE 2
+#define FS_NS_STAT 3
+
+typedef struct
+{
+	int op;
+	char *path;
+	int flags;
+	int fd;
+	fileStat *stat;
+	int res;
+}fs_ns_op;
+
+//run ops[0..n-1] in order under one namespace lock, journal handle and
+//bitmap & superblock batch; return n
+int fs_ns_many( fs_ns_op *ops, int n);
+
+//--- volumes ---
+//the calls above work on the default volume, which fs_init mounts on ./disk;
+//each fsh_ call below does the same on the volume it is given
+typedef struct fs_s fs_t;
+
+typedef struct
+{
+	bool_t mkfs;//format the image even if it already holds a file system
+	bool_t no_format;//fail instead of formatting an image that holds none
+	bool_t journal;//when formatting, give the volume a metadata journal
+	bool_t log_writes;//overwritten file blocks move to the allocation cursor instead of changing in place; journaled volumes only
+}fs_mount_opts;
+
+//mount the image file (created if missing), NULL opts for the defaults;
+//NULL if it can't be opened or all FS_MAX_MOUNTS volumes are in use
+fs_t *fs_mount( const char *image, fs_mount_opts *opts);
+//close the image, every fd and mapping on it becomes invalid and an unlinked
+//file only they kept is freed
+int fs_unmount( fs_t *fs);
+//the volume fs_init mounted, for the fsh_ calls
+fs_t *fs_default( void);
+
+int fsh_mkfs( fs_t *fs);
+int fsh_open( fs_t *fs, char *fileName, int flags);
+int fsh_close( fs_t *fs, int fd);
+int fsh_read( fs_t *fs, int fd, char *buf, int count);
+int fsh_write( fs_t *fs, int fd, char *buf, int count);
+int fsh_lseek( fs_t *fs, int fd, int offset);
+int fsh_ftruncate( fs_t *fs, int fd, int len);
+int fsh_pread( fs_t *fs, int fd, char *buf, int count, int offset);
+int fsh_pwrite( fs_t *fs, int fd, char *buf, int count, int offset);
+int fsh_readv( fs_t *fs, int fd, fs_iovec *iov, int iovcnt);
+int fsh_writev( fs_t *fs, int fd, fs_iovec *iov, int iovcnt);
+int fsh_preadv( fs_t *fs, int fd, fs_iovec *iov, int iovcnt, int offset);
+int fsh_pwritev( fs_t *fs, int fd, fs_iovec *iov, int iovcnt, int offset);
+int fsh_copy_file_range( fs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int len);
+int fsh_reflink( fs_t *fs, int fd_in, int fd_out);
+char *fsh_mmap( fs_t *fs, int fd, int offset, int len, int prot);
+int fsh_msync( fs_t *fs, char *addr, int len);
+int fsh_munmap( fs_t *fs, char *addr, int len);
+int fsh_mkdir( fs_t *fs, char *fileName);
+int fsh_rmdir( fs_t *fs, char *fileName);
+int fsh_cd( fs_t *fs, char *dirName);
+int fsh_cd_inode_id( fs_t *fs, int dir_id);
+int fsh_link( fs_t *fs, char *old_fileName, char *new_fileName);
+int fsh_unlink( fs_t *fs, char *fileName);
+int fsh_stat( fs_t *fs, char *fileName, fileStat *buf);
+int fsh_rename( fs_t *fs, char *old_fileName, char *new_fileName);
+int fsh_readdir_plus( fs_t *fs, int dirfd, int *cookie, dirent_plus *buf, int n);
+int fsh_create_many( fs_t *fs, int dirfd, char **names, int n, int *out_inodes);
+int fsh_ns_many( fs_t *fs, fs_ns_op *ops, int n);
+
+//--- write-back ---
+//by default every block write goes to the device before the call returns;
+//with write-back on, blocks are written in a BCACHE_BLOCKS cache and a
+//flusher thread writes them back (FAKE build only, -1 in the kernel)
+typedef struct
+{
+	int expire_ms;//a block dirty for this long is written back
+	int interval_ms;//how often the flusher wakes up
+	int background_ratio;//% of the cache dirty that wakes the flusher early
+	int dirty_ratio;//% of the cache dirty at which writers wait for the flusher
+}fs_writeback_opts;
+
+//turn write-back on with wb, or with NULL flush everything and go back to write-through
+int fsh_writeback( fs_t *fs, fs_writeback_opts *wb);
+//write every dirty block back and wait for it
+int fsh_sync( fs_t *fs);
+int fs_sync( void);
+
+//--- directory-relative calls ---
+//a relative fileName starts at the directory open as dirfd instead of the
+//current one; FS_AT_FDCWD as dirfd means the current directory
+#define FS_AT_FDCWD (-100)
+//fs_unlinkat flag: remove a directory tree, like fs_rmdir
+#define FS_AT_REMOVEDIR 1
+
+int fs_openat( int dirfd, char *fileName, int flags);
+int fs_mkdirat( int dirfd, char *fileName);
+int fs_unlinkat( int dirfd, char *fileName, int flags);
+int fsh_openat( fs_t *fs, int dirfd, char *fileName, int flags);
+int fsh_mkdirat( fs_t *fs, int dirfd, char *fileName);
+int fsh_unlinkat( fs_t *fs, int dirfd, char *fileName, int flags);
+
+//--- sessions ---
+//a client of a volume with a working directory of its own, so clients don't
+//move each other around; fds opened through a session belong to the volume
+//and are used with the fsh_ calls
+typedef struct fs_session_s fs_session;
+
+//NULL when the volume has MAX_SESSION_NUM sessions already; cwd starts at "/"
+fs_session *fs_session_open( fs_t *fs);
+int fs_session_close( fs_session *s);
+int fss_cd( fs_session *s, char *dirName);
+int fss_open( fs_session *s, char *fileName, int flags);
+int fss_mkdir( fs_session *s, char *fileName);
+int fss_rmdir( fs_session *s, char *fileName);
+int fss_link( fs_session *s, char *old_fileName, char *new_fileName);
+int fss_unlink( fs_session *s, char *fileName);
+int fss_rename( fs_session *s, char *old_fileName, char *new_fileName);
+int fss_stat( fs_session *s, char *fileName, fileStat *buf);
+
+
+//this unix-like file sys is write_through unless fsh_writeback turns the cache on
 
 int fs_cd_inode_id(int dir_id);
 
@@ -58,6 +252,8 @@ int fs_cd_inode_id(int dir_id);
 // -- super block -----------------------------------
 #define SUPER_BLOCK 1
 #define SUPER_BLOCK_BACKUP (FS_SIZE/8 -1)
+#define INODE_PER_BLOCK (NEW_BLOCK_SIZE/32)
+//128
 #define INODE_BLOCK_NUMBER (MAX_FILE_COUNT/INODE_PER_BLOCK)
 //16
 #define DATA_BLOCK_NUMBER (FS_SIZE/8 -5-INODE_BLOCK_NUMBER)
@@ -65,8 +261,17 @@ int fs_cd_inode_id(int dir_id);
 
 
 
-#define SB_PADDING (NEW_BLOCK_SIZE-18)
+#define SB_PADDING (NEW_BLOCK_SIZE-30-DATA_BLOCK_NUMBER)
 #define MY_MAGIC 4008208820
+
+//feature flags, images made before a feature existed read as 0
+#define SB_FEATURE_NAME_HASH 0x1 //dir_entry carries name_hash & name_len
+#define SB_FEATURE_DIR_HOLES 0x2 //deleted dir_entry slots are left empty and reused
+#define SB_FEATURE_REFLINK 0x4 //dblock_share is kept, files may share data blocks
+#define SB_FEATURE_JOURNAL 0x8 //metadata goes through the journal at journal_start
+#define MAX_DBLOCK_SHARE 255
+//state flags
+#define SB_STATE_CLEAN 0x1 //unmounted with everything written, the counts & bitmaps agree
 typedef struct __attribute__ ((__packed__))
 {
 	uint16_t file_sys_size;
@@ -77,18 +282,46 @@ typedef struct __attribute__ ((__packed__))
 	uint16_t dblock_bitmap_place;
 	uint16_t dblock_start;
 	uint16_t dblock_count;
+	uint32_t features;
+	uint8_t dblock_share[DATA_BLOCK_NUMBER];//owners of each data block beyond the first
+	uint16_t journal_start;//first block of the journal, SB_FEATURE_JOURNAL only
+	uint16_t journal_blocks;
+	uint16_t state;//SB_STATE_*, cleared while mounted
+	uint16_t mount_count;//loads since mkfs
 
 	char _padding[SB_PADDING];
 
 }super_b;
 
+// -- journal ---------------------------------
+//the last JOURNAL_BLOCKS data blocks of a journaled volume: a header, then the
+//log, where each transaction is a descriptor followed by the images of the
+//blocks it changed; the descriptor is written last, so a transaction whose
+//images didn't all reach the disk fails its checksum and isn't replayed
+#define JOURNAL_BLOCKS 16
+#define JOURNAL_MAGIC 0x4a4f524e
+#define JOURNAL_TXN_MAX (JOURNAL_BLOCKS-2)//images in one transaction
+
+typedef struct __attribute__ ((__packed__))
+{
+	uint32_t magic;
+	uint32_t seq;//the first transaction in the log has this sequence number
+}journal_header;
+
+typedef struct __attribute__ ((__packed__))
+{
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t checksum;//over the images
+	uint16_t count;
+	uint16_t blocks[JOURNAL_TXN_MAX];//home block of each image
+}journal_desc;
+
 // -- inode -----------------------------------
 #define DIRECT_BLOCK 11
 #define INODE_PADDING 0
 //total size: 32 bytes
 // #define INODE_SIZE 32
-#define INODE_PER_BLOCK (NEW_BLOCK_SIZE/32)
-//128
 
 #define MAX_BLOCKS_INDEX_IN_INODE (DIRECT_BLOCK+NEW_BLOCK_SIZE/2)
 //11+2048=2059
@@ -104,7 +337,7 @@ typedef struct __attribute__ ((__packed__))
 // -- dir_entry -----------------------------------
 //id for No. in inode table
 #define ROOT_DIR_ID 0
-#define DIR_ENTRY_PADDING (64-2-MAX_FILE_NAME-1)
+#define DIR_ENTRY_PADDING (64-2-MAX_FILE_NAME-1-4-1)
 //dir entry total size: 64 bytes
 #define DIR_ENTRY_PER_BLOCK (NEW_BLOCK_SIZE/64)
 //64
@@ -113,6 +346,8 @@ typedef struct __attribute__ ((__packed__))
 {
 	uint16_t inode_id;
 	char file_name[MAX_FILE_NAME+1];
+	uint32_t name_hash;//only valid with SB_FEATURE_NAME_HASH
+	uint8_t name_len;
 	char _padding[DIR_ENTRY_PADDING];
 }dir_entry;
 
@@ -120,7 +355,33 @@ typedef struct __attribute__ ((__packed__))
 
 // --- below is on-memory ---
 
-#define MAX_OPEN_FILE_NUM 256
+//locks: pthread mutexes and rwlocks in the FAKE (linux) build, nothing in the kernel,
+//where one fs call runs at a time
+#ifdef FAKE
+#include <pthread.h>
+typedef pthread_mutex_t fs_lock_t;
+#define FS_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define FS_LOCK(l) pthread_mutex_lock(l)
+#define FS_UNLOCK(l) pthread_mutex_unlock(l)
+typedef pthread_rwlock_t fs_rwlock_t;
+#define FS_RDLOCK(l) pthread_rwlock_rdlock(l)
+#define FS_WRLOCK(l) pthread_rwlock_wrlock(l)
+#define FS_RWUNLOCK(l) pthread_rwlock_unlock(l)
+#else
+typedef int fs_lock_t;
+#define FS_LOCK_INITIALIZER 0
+#define FS_LOCK(l) ((void)(l))
+#define FS_UNLOCK(l) ((void)(l))
+typedef int fs_rwlock_t;
+#define FS_RDLOCK(l) ((void)(l))
+#define FS_WRLOCK(l) ((void)(l))
+#define FS_RWUNLOCK(l) ((void)(l))
+#endif
+
+#define MAX_OPEN_FILE_NUM 4096
+//fd_used words, each bit of fd_full covers one of them
+#define FD_WORDS (MAX_OPEN_FILE_NUM/32)
+#define FD_FULL_WORDS ((FD_WORDS+31)/32)
 
 typedef struct 
 {
@@ -128,6 +389,222 @@ typedef struct
 	uint32_t cursor;//in bytes
 	uint16_t inode_id;
 	uint16_t mode;//(FS_O_RDONLY, FS_O_WRONLY, FS_ORDWR)
+	bool_t append;//opened with FS_O_APPEND
 }file_desc;
 
+//in-memory state of an inode, shared by every descriptor open on it
+typedef struct
+{
+	uint16_t open_count;//descriptors open on this inode
+	fs_rwlock_t lock;//held around the file's data, size and block map
+}inode_mem;
+
+//position in an fs_iovec array, seen as one byte stream
+typedef struct
+{
+	fs_iovec *iov;
+	int iovcnt;
+	int i;//current buffer
+	int off;//bytes of it already used
+}iov_cursor;
+
+//mappings live in a static pool of MAP_POOL_BLOCKS blocks, in the FAKE
+//build big enough for a file filling the whole data area
+#define MAX_MAP_NUM 16
+#ifdef FAKE
+#define MAP_POOL_BLOCKS DATA_BLOCK_NUMBER
+#else
+#define MAP_POOL_BLOCKS 32
+#endif
+
+typedef struct
+{
+	bool_t is_using;
+	uint16_t inode_id;
+	uint32_t offset;//file offset of addr
+	char *addr;
+	int nblocks;
+	int prot;
+}file_map;
+
+//file_writev offset meaning "the current end of the file"
+#define OFFSET_APPEND 0xffffffffu
+
+//result of one walk over a path, see path_walk
+typedef struct
+{
+	int parent;//directory holding the leaf, -1 if the walk stopped before it
+	int leaf_id;//inode id of the leaf, -1 if it doesn't exist
+	bool_t dir_only;//path is "/" or ends with '/'
+	char leaf[MAX_FILE_NAME+2];//last component, one char longer than a legal name
+}path_walk_res;
+
+//what one fs_rmdir walk has loaded, so siblings sharing a block don't read it again
+typedef struct
+{
+	int inode_block;//inode table block in inode_scratch, -1 for none
+	bool_t inode_dirty;
+	char inode_scratch[NEW_BLOCK_SIZE];
+	int index_of;//dir whose indirect index block is in index_scratch, -1 for none
+	char index_scratch[NEW_BLOCK_SIZE];
+	int entry_block;//dir data block in entry_scratch, -1 for none
+	char entry_scratch[NEW_BLOCK_SIZE];
+}rm_walk;
+
+typedef struct
+{
+	uint16_t dir_id;
+	uint16_t next;//next entry of dir_id to visit
+}rm_frame;
+
+//directory lookup cache: a bloom filter over the names of one directory,
+//so "does not exist" is answered from memory instead of a directory scan
+#define DCACHE_SLOTS 16
+#define DCACHE_BLOOM_BYTES 1024
+#define DCACHE_BLOOM_BITS (DCACHE_BLOOM_BYTES*8)
+#define DCACHE_BLOOM_HASHES 3
+
+//a directory is compacted once more than 1/DIR_COMPACT_RATIO of its slots are empty
+#define DIR_COMPACT_RATIO 2
+
+typedef struct
+{
+	bool_t is_using;
+	uint16_t dir_id;//inode id of the directory
+	uint32_t last_use;//for LRU replacement
+	uint8_t bloom[DCACHE_BLOOM_BYTES];
+	uint16_t holes;//empty slots in the directory
+	uint8_t block_free[DATA_BLOCK_NUMBER];//empty slots per directory block
+}dir_cache;
+
+//volumes one process can have mounted, the first is the default one
+#ifdef FAKE
+#define FS_MAX_MOUNTS 8
+#else
+#define FS_MAX_MOUNTS 1
+#endif
+
+#define MAX_SESSION_NUM 64
+
+struct fs_session_s
+{
+	bool_t is_using;
+	fs_t *fs;
+	uint16_t cwd;//inode id of the working directory
+};
+
+//write-back cache
+#define BCACHE_BLOCKS 64
+
+typedef struct
+{
+	int16_t block;//-1 for an empty slot
+	bool_t dirty;
+	bool_t writing;//the flusher is writing it, not to be evicted
+	uint32_t dirtied;//ms, when it became dirty
+	uint32_t last_use;
+	char data[NEW_BLOCK_SIZE];
+}bcache_entry;
+
+//journal: metadata blocks changed since the last commit, or committed and
+//not yet written home
+#define JBUF_BLOCKS (2*JOURNAL_TXN_MAX+4)
+#define JOURNAL_COMMIT_MS 20//group commit interval
+//jbuf blocks one file call may change: superblock, data bitmap, its inode
+//table block and its index block
+#define JOURNAL_HANDLE_CREDITS 4
+
+typedef struct
+{
+	int16_t block;//-1 for an empty slot
+	bool_t dirty;//changed in the running transaction
+	bool_t pending;//ckpt is committed and not yet written home
+	bool_t writing;//the journal thread is writing ckpt home, not to be evicted
+	uint32_t ckpt_gen;//bumped whenever ckpt changes
+	char data[NEW_BLOCK_SIZE];//current contents
+	char ckpt[NEW_BLOCK_SIZE];//contents as last committed
+}jbuf_entry;
+
+//everything kept in memory for one mounted image
+//the locks guard the rest as described at the top of fs.c
+struct fs_s
+{
+	bool_t is_using;
+	bool_t locks_ready;
+	int dev;//block device of the image, see block_open
+
+	fs_lock_t ns_lock;
+	fs_lock_t alloc_lock;
+	fs_rwlock_t itable_lock[INODE_BLOCK_NUMBER];
+	fs_lock_t fd_lock;
+
+	char inode_bitmap_block_scratch[NEW_BLOCK_SIZE];
+	char dblock_bitmap_block_scratch[NEW_BLOCK_SIZE];
+
+	char super_block_scratch[NEW_BLOCK_SIZE];
+	super_b *my_sb;//points into super_block_scratch
+
+	file_desc fd_table[MAX_OPEN_FILE_NUM];
+	uint32_t fd_used[FD_WORDS];//bit set for an fd in use
+	uint32_t fd_full[FD_FULL_WORDS];//bit set for a fd_used word with no free fd
+	inode_mem inode_mem_table[MAX_FILE_COUNT];
+
+	file_map map_table[MAX_MAP_NUM];
+	char map_pool[MAP_POOL_BLOCKS*NEW_BLOCK_SIZE];//fs_mmap memory, handed out in blocks
+	char map_twin[MAP_POOL_BLOCKS*NEW_BLOCK_SIZE];//each pool block as the file last had it
+	bool_t map_pool_used[MAP_POOL_BLOCKS];
+
+	uint16_t pwd;//start from 0 as inode index
+	fs_session sessions[MAX_SESSION_NUM];
+
+	uint16_t inode_bitmap_last;
+	uint16_t dblock_bitmap_last;//next-fit cursor, the head of the log with log_writes
+	bool_t log_writes;
+	bool_t inode_bitmap_loaded;//bitmaps of a clean image are read at first use
+	bool_t dblock_bitmap_loaded;
+
+	int meta_batch_depth;//>0 while bitmap & superblock writes are deferred
+	bool_t inode_bitmap_dirty;
+	bool_t dblock_bitmap_dirty;
+	bool_t sb_dirty;
+
+	//one frame per directory being removed, a directory can't be on it twice
+	rm_frame rm_stack[MAX_FILE_COUNT];
+
+	dir_cache dcache[DCACHE_SLOTS];
+	uint32_t dcache_clock;
+
+#ifdef FAKE
+	bool_t writeback;//block writes go to bcache
+	fs_writeback_opts wb;
+	bcache_entry bcache[BCACHE_BLOCKS];
+	int16_t bcache_slot[FS_SIZE/8];//block -> bcache index or -1
+	int bcache_dirty;//dirty entries
+	uint32_t bcache_clock;
+	fs_lock_t bcache_lock;//innermost, guards all of the above
+	pthread_cond_t bcache_flushed;//an entry was written back
+	pthread_cond_t bcache_kick;//wakes the flusher
+	pthread_t flusher;
+
+	bool_t journal_on;//metadata writes go through jbuf
+	bool_t journal_fmt;//fsh_mkfs makes a journal
+	jbuf_entry jbuf[JBUF_BLOCKS];
+	int16_t jbuf_slot[FS_SIZE/8];//block -> jbuf index or -1
+	bool_t jlogged[FS_SIZE/8];//the log holds an image of the block
+	bool_t jfreed[FS_SIZE/8];//freed by the running transaction, kept until it commits
+	int jdirty;//dirty jbuf entries
+	int jlog_pos;//next free block of the log, from 1
+	uint32_t jseq;//sequence number of the next transaction
+	int jhandles;//operations running
+	int jreserved;//credits of the running file calls
+	bool_t jcommitting;//a commit waits for jhandles to drain, no new ones start
+	bool_t jexclusive;//a namespace call runs or waits for jhandles to drain, no new ones start
+	bool_t jstop;
+	fs_lock_t journal_lock;//inside all but bcache_lock, guards the fields above
+	pthread_cond_t journal_cond;//jhandles drained, or the commit is done
+	pthread_cond_t journal_kick;//wakes the journal thread
+	pthread_t journal_thread;
+#endif
+};
+
 #endif
@@ -0,0 +1,94 @@
+/*
+ * Read throughput of the fs core under threads.
+ * NFILES files on a scratch volume; every thread does random block-sized
+ * fs_pread calls over all of them, and one op in WRITE_EVERY is a fs_pwrite,
+ * so the set is read-mostly. Reads of one file share its inode lock.
+ * usage: fs_bench [ops per thread]
+ */
+#include "util.h"
+#include "common.h"
+#include "fs.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#define NFILES 8
+#define FILE_BLOCKS 16
+#define WRITE_EVERY 64
+#define MAX_THREADS 8
+
+static fs_t *vol;
+static int fds[NFILES];
+static int ops_per_thread = 20000;
+
+static double now( void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *worker( void *arg)
+{
+    unsigned int seed = (unsigned int)(long)arg + 1;
+    char buf[NEW_BLOCK_SIZE];
+    int i;
+    for (i = 0; i < NEW_BLOCK_SIZE; i++)
+        buf[i] = i + seed;
+    for (i = 0; i < ops_per_thread; i++){
+        int f = rand_r(&seed) % NFILES;
+        int off = rand_r(&seed) % FILE_BLOCKS * NEW_BLOCK_SIZE;
+        if (i % WRITE_EVERY == WRITE_EVERY - 1)
+            fsh_pwrite(vol, fds[f], buf, NEW_BLOCK_SIZE, off);
+        else if (fsh_pread(vol, fds[f], buf, NEW_BLOCK_SIZE, off) != NEW_BLOCK_SIZE){
+            printf("short read!\n");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+int main( int argc, char **argv)
+{
+    if (argc > 1)
+        ops_per_thread = atoi(argv[1]);
+    fs_mount_opts opts = {TRUE, FALSE};
+    vol = fs_mount("bench_disk", &opts);
+    if (vol == NULL){
+        printf("can't mount bench_disk\n");
+        return 1;
+    }
+
+    char buf[NEW_BLOCK_SIZE];
+    char name[MAX_FILE_NAME];
+    int i, j;
+    for (i = 0; i < NEW_BLOCK_SIZE; i++)
+        buf[i] = i;
+    for (i = 0; i < NFILES; i++){
+        sprintf(name, "f%d", i);
+        fds[i] = fsh_open(vol, name, FS_O_RDWR);
+        for (j = 0; j < FILE_BLOCKS; j++)
+            fsh_write(vol, fds[i], buf, NEW_BLOCK_SIZE);
+    }
+
+    int threads;
+    double base = 0;
+    for (threads = 1; threads <= MAX_THREADS; threads *= 2){
+        pthread_t tid[MAX_THREADS];
+        double start = now();
+        for (i = 0; i < threads; i++)
+            pthread_create(&tid[i], NULL, worker, (void *)(long)i);
+        for (i = 0; i < threads; i++)
+            pthread_join(tid[i], NULL);
+        double rate = threads * ops_per_thread / (now() - start);
+        if (threads == 1)
+            base = rate;
+        printf("%d threads: %.0f ops/s (x%.2f)\n", threads, rate, rate / base);
+    }
+
+    for (i = 0; i < NFILES; i++)
+        fsh_close(vol, fds[i]);
+    fs_unmount(vol);
+    return 0;
+}
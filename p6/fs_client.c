@@ -0,0 +1,351 @@
+/*
+ * Client side of fs_server, see fs_client.h.
+*/
+#include "common.h"
+#include "fs.h"
+#include "fs_proto.h"
+#include "fs_client.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define PENDING_MASK (FSC_MAX_PENDING-1)
+
+static int write_full(int sock,char *buf,int len)
+{
+	while(len>0)
+	{
+		int n=send(sock,buf,len,MSG_NOSIGNAL);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			return -1;
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int read_full(int sock,char *buf,int len)
+{
+	while(len>0)
+	{
+		int n=recv(sock,buf,len,0);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			return -1;
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+//the connection is broken: every request in flight fails
+static void fail_pending(fs_client *c)
+{
+	while(c->pending_head!=c->pending_tail)
+	{
+		fsc_req *r=c->pending[c->pending_head++&PENDING_MASK];
+		r->res=-1;
+		r->done=TRUE;
+	}
+}
+
+//take the reply to the oldest request in flight
+static int take_reply(fs_client *c)
+{
+	fsc_req *r=c->pending[c->pending_head&PENDING_MASK];
+	fsp_rep rep;
+	if(read_full(c->sock,(char *)&rep,sizeof(rep))<0)
+	{
+		fail_pending(c);
+		return -1;
+	}
+	char *dest=NULL;
+	if(r->op==FSP_READ && (int)rep.len<=r->len)
+		dest=r->buf;
+	else if(r->op==FSP_STAT && rep.len==sizeof(fileStat))
+		dest=(char *)r->stat;
+	if(rep.tag!=c->next_tag-(c->pending_tail-c->pending_head) || (rep.len>0 && dest==NULL)
+		|| read_full(c->sock,dest,rep.len)<0)
+	{
+		fail_pending(c);
+		return -1;
+	}
+	r->res=rep.res;
+	r->done=TRUE;
+	c->pending_head++;
+	return 0;
+}
+
+int fsc_connect( fs_client *c, const char *sock_path) {
+	struct sockaddr_un addr;
+	if(strlen(sock_path)>=sizeof(addr.sun_path))
+		return -1;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	memcpy(addr.sun_path,sock_path,strlen(sock_path));
+	c->sock=socket(AF_UNIX,SOCK_STREAM,0);
+	if(c->sock<0)
+		return -1;
+	if(connect(c->sock,(struct sockaddr *)&addr,sizeof(addr))<0)
+	{
+		close(c->sock);
+		return -1;
+	}
+	c->next_tag=0;
+	c->pending_head=c->pending_tail=0;
+	c->out_len=0;
+	return 0;
+}
+
+void fsc_disconnect( fs_client *c) {
+	close(c->sock);
+	fail_pending(c);
+}
+
+int fsc_send( fs_client *c, fsc_req *r) {
+	fsp_req q;
+	int len1=0,len2=0;
+	q.fd=r->fd;
+	q.arg=0;
+	q.offset=0;
+	q.len=0;
+	switch(r->op)
+	{
+	case FSP_NOP:
+	case FSP_CLOSE:
+	case FSP_SYNC:
+		break;
+	case FSP_READ:
+	case FSP_WRITE:
+		if(r->len<0 || r->len>FSP_MAX_DATA)
+			return -1;
+		q.arg=r->len;
+		q.offset=r->offset;
+		if(r->op==FSP_WRITE)
+			q.len=r->len;
+		break;
+	case FSP_LSEEK:
+		q.offset=r->offset;
+		break;
+	case FSP_FTRUNCATE:
+		q.arg=r->len;
+		break;
+	case FSP_LINK:
+	case FSP_RENAME:
+		len2=strlen(r->path2)+1;
+		//fall through
+	case FSP_OPEN:
+	case FSP_MKDIR:
+	case FSP_RMDIR:
+	case FSP_CD:
+	case FSP_UNLINK:
+	case FSP_STAT:
+		len1=strlen(r->path)+1;
+		if(len1>MAX_PATH_NAME+1 || len2>MAX_PATH_NAME+1)
+			return -1;
+		q.arg=r->flags;
+		q.len=len1+len2;
+		break;
+	default:
+		return -1;
+	}
+	if(c->pending_tail-c->pending_head==FSC_MAX_PENDING)
+	{
+		if(fsc_flush(c)<0 || take_reply(c)<0)
+			return -1;
+	}
+	if(c->out_len+(int)(sizeof(q)+q.len)>(int)FSC_OUT_SIZE && fsc_flush(c)<0)
+		return -1;
+	q.op=r->op;
+	q.tag=c->next_tag++;
+	memcpy(c->out+c->out_len,&q,sizeof(q));
+	c->out_len+=sizeof(q);
+	if(r->op==FSP_WRITE)
+		memcpy(c->out+c->out_len,r->buf,r->len);
+	else if(len1>0)
+	{
+		memcpy(c->out+c->out_len,r->path,len1);
+		if(len2>0)
+			memcpy(c->out+c->out_len+len1,r->path2,len2);
+	}
+	c->out_len+=q.len;
+	r->done=FALSE;
+	c->pending[c->pending_tail++&PENDING_MASK]=r;
+	return 0;
+}
+
+int fsc_flush( fs_client *c) {
+	if(c->out_len==0)
+		return 0;
+	int res=write_full(c->sock,c->out,c->out_len);
+	c->out_len=0;
+	if(res<0)
+		fail_pending(c);
+	return res;
+}
+
+int fsc_wait( fs_client *c, fsc_req *r) {
+	fsc_flush(c);
+	while(!r->done)
+		if(take_reply(c)<0)
+			break;
+	return r->res;
+}
+
+//--- synchronous calls ---
+static int call(fs_client *c,fsc_req *r)
+{
+	if(fsc_send(c,r)<0)
+		return -1;
+	return fsc_wait(c,r);
+}
+
+static int call_path(fs_client *c,int op,char *path,char *path2,int flags)
+{
+	fsc_req r;
+	memset(&r,0,sizeof(r));
+	r.op=op;
+	r.path=path;
+	r.path2=path2;
+	r.flags=flags;
+	return call(c,&r);
+}
+
+static int call_fd(fs_client *c,int op,int fd,int len,int offset)
+{
+	fsc_req r;
+	memset(&r,0,sizeof(r));
+	r.op=op;
+	r.fd=fd;
+	r.len=len;
+	r.offset=offset;
+	return call(c,&r);
+}
+
+//reads & writes larger than FSP_MAX_DATA go as several requests, all sent
+//before the first reply is awaited
+static int call_rw(fs_client *c,int op,int fd,char *buf,int count,int offset)
+{
+	fsc_req r[FSC_MAX_PENDING];
+	int done=0;
+	if(count<0)
+		return -1;
+	if(count==0)
+	{
+		memset(&r[0],0,sizeof(fsc_req));
+		r[0].op=op;
+		r[0].fd=fd;
+		r[0].buf=buf;
+		r[0].offset=offset;
+		return call(c,&r[0]);
+	}
+	while(done<count)
+	{
+		int n=0,sent=0,i;
+		while(n<FSC_MAX_PENDING && sent<count-done)
+		{
+			int len=count-done-sent<FSP_MAX_DATA?count-done-sent:FSP_MAX_DATA;
+			memset(&r[n],0,sizeof(fsc_req));
+			r[n].op=op;
+			r[n].fd=fd;
+			r[n].buf=buf+done+sent;
+			r[n].len=len;
+			r[n].offset=offset==FSP_CURSOR?FSP_CURSOR:offset+done+sent;
+			if(fsc_send(c,&r[n])<0)
+				break;
+			n++;
+			sent+=len;
+		}
+		if(n==0)
+			return done>0?done:-1;
+		for(i=0;i<n;i++)
+			fsc_wait(c,&r[i]);
+		for(i=0;i<n;i++)
+		{
+			if(r[i].res<0)
+				return done>0?done:-1;
+			done+=r[i].res;
+			if(r[i].res<r[i].len)//end of file, or the disk is full
+				return done;
+		}
+	}
+	return done;
+}
+
+int fsc_open( fs_client *c, char *fileName, int flags) {
+	return call_path(c,FSP_OPEN,fileName,NULL,flags);
+}
+
+int fsc_close( fs_client *c, int fd) {
+	return call_fd(c,FSP_CLOSE,fd,0,0);
+}
+
+int fsc_read( fs_client *c, int fd, char *buf, int count) {
+	return call_rw(c,FSP_READ,fd,buf,count,FSP_CURSOR);
+}
+
+int fsc_write( fs_client *c, int fd, char *buf, int count) {
+	return call_rw(c,FSP_WRITE,fd,buf,count,FSP_CURSOR);
+}
+
+int fsc_pread( fs_client *c, int fd, char *buf, int count, int offset) {
+	if(offset<0)
+		return -1;
+	return call_rw(c,FSP_READ,fd,buf,count,offset);
+}
+
+int fsc_pwrite( fs_client *c, int fd, char *buf, int count, int offset) {
+	if(offset<0)
+		return -1;
+	return call_rw(c,FSP_WRITE,fd,buf,count,offset);
+}
+
+int fsc_lseek( fs_client *c, int fd, int offset) {
+	return call_fd(c,FSP_LSEEK,fd,0,offset);
+}
+
+int fsc_ftruncate( fs_client *c, int fd, int len) {
+	return call_fd(c,FSP_FTRUNCATE,fd,len,0);
+}
+
+int fsc_mkdir( fs_client *c, char *fileName) {
+	return call_path(c,FSP_MKDIR,fileName,NULL,0);
+}
+
+int fsc_rmdir( fs_client *c, char *fileName) {
+	return call_path(c,FSP_RMDIR,fileName,NULL,0);
+}
+
+int fsc_cd( fs_client *c, char *dirName) {
+	return call_path(c,FSP_CD,dirName,NULL,0);
+}
+
+int fsc_link( fs_client *c, char *old_fileName, char *new_fileName) {
+	return call_path(c,FSP_LINK,old_fileName,new_fileName,0);
+}
+
+int fsc_unlink( fs_client *c, char *fileName) {
+	return call_path(c,FSP_UNLINK,fileName,NULL,0);
+}
+
+int fsc_stat( fs_client *c, char *fileName, fileStat *buf) {
+	fsc_req r;
+	memset(&r,0,sizeof(r));
+	r.op=FSP_STAT;
+	r.path=fileName;
+	r.stat=buf;
+	return call(c,&r);
+}
+
+int fsc_rename( fs_client *c, char *old_fileName, char *new_fileName) {
+	return call_path(c,FSP_RENAME,old_fileName,new_fileName,0);
+}
+
+int fsc_sync( fs_client *c) {
+	return call_fd(c,FSP_SYNC,0,0,0);
+}
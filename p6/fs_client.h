@@ -0,0 +1,78 @@
+/*
+ * Client side of fs_server.
+ * fsc_send queues a request without waiting for it; requests queued
+ * together go out in one write and the server runs them as one batch.
+ * fsc_wait collects replies in order until the one asked for is done.
+ * The fsc_ calls below the requests are the synchronous versions of the
+ * fs_ calls, on the connection's own working directory and fds.
+ * FAKE (linux) build only.
+*/
+#ifndef FS_CLIENT_INCLUDED
+#define FS_CLIENT_INCLUDED
+
+#include "common.h"
+#include "fs.h"
+#include "fs_proto.h"
+
+//requests sent and not yet answered, power of two
+#define FSC_MAX_PENDING 64
+#define FSC_OUT_SIZE (2*(sizeof(fsp_req)+FSP_MAX_PAYLOAD))
+
+typedef struct
+{
+	int op;//FSP_*
+	int fd;//close, read, write, lseek, ftruncate
+	char *path;//open, mkdir, rmdir, cd, link, unlink, stat, rename
+	char *path2;//link, rename: the new name
+	int flags;//open
+	char *buf;//read, write
+	int len;//read, write: at most FSP_MAX_DATA; ftruncate
+	int offset;//read, write: byte offset or FSP_CURSOR; lseek
+	fileStat *stat;//stat
+
+	int res;//what the matching fs call returns, once done
+	bool_t done;
+}fsc_req;
+
+typedef struct
+{
+	int sock;
+	uint32_t next_tag;
+	fsc_req *pending[FSC_MAX_PENDING];//sent, waiting for the reply
+	uint32_t pending_head;
+	uint32_t pending_tail;
+	char out[FSC_OUT_SIZE];//queued, not yet written
+	int out_len;
+}fs_client;
+
+//connect to the server listening on sock_path
+int fsc_connect( fs_client *c, const char *sock_path);
+//the server closes the fds still open on the connection
+void fsc_disconnect( fs_client *c);
+
+//queue r, which must stay around until it is done; waits for the oldest
+//replies when FSC_MAX_PENDING are in flight
+int fsc_send( fs_client *c, fsc_req *r);
+//write the queued requests to the server
+int fsc_flush( fs_client *c);
+//flush, then take replies until r is done; return r->res
+int fsc_wait( fs_client *c, fsc_req *r);
+
+int fsc_open( fs_client *c, char *fileName, int flags);
+int fsc_close( fs_client *c, int fd);
+int fsc_read( fs_client *c, int fd, char *buf, int count);
+int fsc_write( fs_client *c, int fd, char *buf, int count);
+int fsc_pread( fs_client *c, int fd, char *buf, int count, int offset);
+int fsc_pwrite( fs_client *c, int fd, char *buf, int count, int offset);
+int fsc_lseek( fs_client *c, int fd, int offset);
+int fsc_ftruncate( fs_client *c, int fd, int len);
+int fsc_mkdir( fs_client *c, char *fileName);
+int fsc_rmdir( fs_client *c, char *fileName);
+int fsc_cd( fs_client *c, char *dirName);
+int fsc_link( fs_client *c, char *old_fileName, char *new_fileName);
+int fsc_unlink( fs_client *c, char *fileName);
+int fsc_stat( fs_client *c, char *fileName, fileStat *buf);
+int fsc_rename( fs_client *c, char *old_fileName, char *new_fileName);
+int fsc_sync( fs_client *c);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Wire format between fs_server and the fs_client library.
+ * A client sends requests back to back without waiting for the replies
+ * (pipelining); the server runs them in order and sends one reply per
+ * request, in the same order, with the request's tag. Both ends are on
+ * one host, so the fields are in host byte order.
+ *
+ * request:  fsp_req, then len bytes of payload
+ *   - one NUL-terminated path for OPEN, MKDIR, RMDIR, CD, UNLINK, STAT
+ *   - two of them (old, new) for LINK and RENAME
+ *   - the data for WRITE
+ * reply:    fsp_rep, then len bytes of payload
+ *   - the data read for READ, a fileStat for STAT
+*/
+#ifndef FS_PROTO_INCLUDED
+#define FS_PROTO_INCLUDED
+
+#include "common.h"
+#include "fs.h"
+
+#define FSP_NOP 0
+#define FSP_OPEN 1//arg: flags
+#define FSP_CLOSE 2//fd
+#define FSP_READ 3//fd, arg: count, offset
+#define FSP_WRITE 4//fd, arg: count, offset
+#define FSP_LSEEK 5//fd, offset
+#define FSP_FTRUNCATE 6//fd, arg: len
+#define FSP_MKDIR 7
+#define FSP_RMDIR 8
+#define FSP_CD 9
+#define FSP_LINK 10
+#define FSP_UNLINK 11
+#define FSP_STAT 12
+#define FSP_RENAME 13
+#define FSP_SYNC 14
+
+//read/write offset meaning "at the fd's cursor, and move it"
+#define FSP_CURSOR (-1)
+
+//largest read or write in one request
+#define FSP_MAX_DATA (64*1024)
+#define FSP_MAX_PAYLOAD (FSP_MAX_DATA>2*MAX_PATH_NAME?FSP_MAX_DATA:2*MAX_PATH_NAME)
+
+typedef struct
+{
+	uint32_t len;//payload bytes after this header
+	uint32_t tag;//echoed in the reply
+	int32_t op;//FSP_*
+	int32_t fd;
+	int32_t arg;
+	int32_t offset;
+}fsp_req;
+
+typedef struct
+{
+	uint32_t len;//payload bytes after this header
+	uint32_t tag;
+	int32_t res;//what the matching fs call returns
+}fsp_rep;
+
+#endif
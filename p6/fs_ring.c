@@ -0,0 +1,210 @@
+/*
+ * Submission/completion rings in front of the fs API, see fs_ring.h.
+*/
+#include "util.h"
+#include "common.h"
+#include "fs.h"
+#include "fs_ring.h"
+
+#define RING_MASK (FS_RING_ENTRIES-1)
+
+//can e be run in the same vector call as prev, which is read or write
+static bool_t ring_mergeable(fs_sqe *prev,fs_sqe *e)
+{
+	if(e->op!=prev->op || e->fd!=prev->fd || e->len<0)
+		return FALSE;
+	if(prev->offset==FS_RING_CURSOR)
+		return e->offset==FS_RING_CURSOR;
+	return e->offset==prev->offset+prev->len;
+}
+
+//run the read or write at sq slot head+i together with the ones after it it
+//can be merged with, fill their cqes; return how many sqes were run
+static int ring_run_rw(fs_ring *r,uint32_t head,uint32_t i,uint32_t n)
+{
+	fs_sqe *first=&r->sq[(head+i)&RING_MASK];
+	int run=1;
+	r->iov[0].base=first->buf;
+	r->iov[0].len=first->len;
+	if(first->len>=0)
+		while(i+run<n && ring_mergeable(&r->sq[(head+i+run-1)&RING_MASK],&r->sq[(head+i+run)&RING_MASK]))
+		{
+			fs_sqe *e=&r->sq[(head+i+run)&RING_MASK];
+			r->iov[run].base=e->buf;
+			r->iov[run].len=e->len;
+			run++;
+		}
+	int res;
+	if(first->op==FS_OP_READ)
+		res=first->offset==FS_RING_CURSOR?fsh_readv(r->fs,first->fd,r->iov,run)
+			:fsh_preadv(r->fs,first->fd,r->iov,run,first->offset);
+	else
+		res=first->offset==FS_RING_CURSOR?fsh_writev(r->fs,first->fd,r->iov,run)
+			:fsh_pwritev(r->fs,first->fd,r->iov,run,first->offset);
+	//each sqe gets the part of the result that covers its buffer
+	int j;
+	for(j=0;j<run;j++)
+	{
+		fs_cqe *c=&r->cq[(r->cq_tail+i+j)&RING_MASK];
+		c->user_data=r->sq[(head+i+j)&RING_MASK].user_data;
+		if(res<0)
+			c->res=-1;
+		else
+		{
+			c->res=res<r->iov[j].len?res:r->iov[j].len;
+			res-=c->res;
+		}
+	}
+	return run;
+}
+
+static bool_t ring_is_ns(fs_sqe *e)
+{
+	return e->op==FS_OP_OPEN || e->op==FS_OP_CLOSE || e->op==FS_OP_STAT;
+}
+
+//run the open, close or stat at sq slot head+i and the ones right after it
+//in one fs_ns_many call, fill their cqes; return how many sqes were run
+static int ring_run_ns(fs_ring *r,uint32_t head,uint32_t i,uint32_t n)
+{
+	int run=0;
+	while(i+run<n && ring_is_ns(&r->sq[(head+i+run)&RING_MASK]))
+	{
+		fs_sqe *e=&r->sq[(head+i+run)&RING_MASK];
+		fs_ns_op *o=&r->ns[run];
+		o->op=e->op==FS_OP_OPEN?FS_NS_OPEN:e->op==FS_OP_CLOSE?FS_NS_CLOSE:FS_NS_STAT;
+		o->path=e->path;
+		o->flags=e->flags;
+		o->fd=e->fd;
+		o->stat=e->stat;
+		run++;
+	}
+	fsh_ns_many(r->fs,r->ns,run);
+	int j;
+	for(j=0;j<run;j++)
+	{
+		fs_cqe *c=&r->cq[(r->cq_tail+i+j)&RING_MASK];
+		c->user_data=r->sq[(head+i+j)&RING_MASK].user_data;
+		c->res=r->ns[j].res;
+	}
+	return run;
+}
+
+//run n submitted sqes from sq slot head into the cq slots from cq_tail
+static void ring_run(fs_ring *r,uint32_t head,uint32_t n)
+{
+	uint32_t i=0;
+	while(i<n)
+	{
+		fs_sqe *e=&r->sq[(head+i)&RING_MASK];
+		if(e->op==FS_OP_READ || e->op==FS_OP_WRITE)
+		{
+			i+=ring_run_rw(r,head,i,n);
+			continue;
+		}
+		if(ring_is_ns(e))
+		{
+			i+=ring_run_ns(r,head,i,n);
+			continue;
+		}
+		fs_cqe *c=&r->cq[(r->cq_tail+i)&RING_MASK];
+		c->user_data=e->user_data;
+		c->res=e->op==FS_OP_NOP?0:-1;
+		i++;
+	}
+}
+
+static void *ring_worker(void *arg)
+{
+	fs_ring *r=(fs_ring *)arg;
+	pthread_mutex_lock(&r->lock);
+	for(;;)
+	{
+		uint32_t ready=r->sq_submitted-r->sq_head;
+		uint32_t room=FS_RING_ENTRIES-(r->cq_tail-r->cq_head);
+		if(ready==0 || room==0)
+		{
+			if(r->stop && ready==0)
+				break;
+			pthread_cond_wait(&r->work,&r->lock);
+			continue;
+		}
+		uint32_t n=ready<room?ready:room;
+		//the slots are the worker's until sq_head & cq_tail move past them
+		pthread_mutex_unlock(&r->lock);
+		ring_run(r,r->sq_head,n);
+		pthread_mutex_lock(&r->lock);
+		r->sq_head+=n;
+		r->cq_tail+=n;
+		pthread_cond_broadcast(&r->done);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+int fs_ring_init( fs_ring *r, fs_t *fs) {
+	r->fs=fs;
+	r->sq_head=r->sq_submitted=r->sq_tail=0;
+	r->cq_head=r->cq_tail=0;
+	r->stop=FALSE;
+	pthread_mutex_init(&r->lock,NULL);
+	pthread_cond_init(&r->work,NULL);
+	pthread_cond_init(&r->done,NULL);
+	if(pthread_create(&r->worker,NULL,ring_worker,r)!=0)
+	{
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->work);
+		pthread_cond_destroy(&r->done);
+		return -1;
+	}
+	return 0;
+}
+
+void fs_ring_exit( fs_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	r->stop=TRUE;
+	pthread_cond_signal(&r->work);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->worker,NULL);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->work);
+	pthread_cond_destroy(&r->done);
+}
+
+fs_sqe *fs_ring_get_sqe( fs_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	bool_t full=r->sq_tail-r->sq_head==FS_RING_ENTRIES;
+	pthread_mutex_unlock(&r->lock);
+	if(full)
+		return NULL;
+	fs_sqe *e=&r->sq[r->sq_tail++&RING_MASK];
+	bzero((char *)e,sizeof(fs_sqe));
+	return e;
+}
+
+int fs_ring_submit( fs_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	int n=r->sq_tail-r->sq_submitted;
+	r->sq_submitted=r->sq_tail;
+	pthread_cond_signal(&r->work);
+	pthread_mutex_unlock(&r->lock);
+	return n;
+}
+
+fs_cqe *fs_ring_peek_cqe( fs_ring *r, bool_t wait) {
+	fs_cqe *c=NULL;
+	pthread_mutex_lock(&r->lock);
+	while(wait && r->cq_head==r->cq_tail)
+		pthread_cond_wait(&r->done,&r->lock);
+	if(r->cq_head!=r->cq_tail)
+		c=&r->cq[r->cq_head&RING_MASK];
+	pthread_mutex_unlock(&r->lock);
+	return c;
+}
+
+void fs_ring_cqe_seen( fs_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	r->cq_head++;
+	pthread_cond_signal(&r->work);//the worker may be waiting for cq room
+	pthread_mutex_unlock(&r->lock);
+}
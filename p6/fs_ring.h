@@ -0,0 +1,84 @@
+/*
+ * Submission/completion rings in front of the fs API.
+ * The caller fills sqes and submits them; a worker thread runs them in
+ * order and posts one cqe per sqe. Adjacent reads or writes of one fd are
+ * merged into a single vector call, so they share one block-map walk,
+ * one inode update and one bitmap & superblock flush. Adjacent opens,
+ * closes and stats run as one fs_ns_many call, under one namespace lock,
+ * journal handle and bitmap & superblock flush.
+ * FAKE (linux) build only, the worker is a pthread.
+*/
+#ifndef FS_RING_INCLUDED
+#define FS_RING_INCLUDED
+
+#include "common.h"
+#include "fs.h"
+
+//power of two
+#define FS_RING_ENTRIES 256
+
+#define FS_OP_NOP 0
+#define FS_OP_OPEN 1
+#define FS_OP_CLOSE 2
+#define FS_OP_READ 3
+#define FS_OP_WRITE 4
+#define FS_OP_STAT 5
+
+//read/write offset meaning "at the fd's cursor, and move it"
+#define FS_RING_CURSOR (-1)
+
+typedef struct
+{
+	int op;//FS_OP_*
+	int fd;//close, read, write
+	char *path;//open, stat
+	int flags;//open
+	char *buf;//read, write
+	int len;//read, write
+	int offset;//read, write: byte offset or FS_RING_CURSOR
+	fileStat *stat;//stat
+	uint64_t user_data;//copied to the cqe
+}fs_sqe;
+
+typedef struct
+{
+	uint64_t user_data;
+	int res;//what the matching fs call returns
+}fs_cqe;
+
+typedef struct
+{
+	fs_t *fs;
+	//sq: the caller fills [sq_submitted,sq_tail), the worker runs [sq_head,sq_submitted)
+	uint32_t sq_head;
+	uint32_t sq_submitted;
+	uint32_t sq_tail;
+	fs_sqe sq[FS_RING_ENTRIES];
+	//cq: the worker fills up to cq_tail, the caller consumes from cq_head
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	fs_cqe cq[FS_RING_ENTRIES];
+	fs_iovec iov[FS_RING_ENTRIES];//worker's merge buffer
+	fs_ns_op ns[FS_RING_ENTRIES];//and its namespace batch
+
+	bool_t stop;
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t work;//sqes submitted or cq space freed
+	pthread_cond_t done;//cqes posted
+}fs_ring;
+
+//start the ring's worker on volume fs (fs_default() for the legacy one)
+int fs_ring_init( fs_ring *r, fs_t *fs);
+//wait for the submitted sqes to finish, then stop the worker
+void fs_ring_exit( fs_ring *r);
+//next free sqe, zeroed, NULL while FS_RING_ENTRIES are queued or running
+fs_sqe *fs_ring_get_sqe( fs_ring *r);
+//hand the sqes taken since the last submit to the worker, return how many
+int fs_ring_submit( fs_ring *r);
+//oldest cqe, waiting for one if wait is set; NULL if none and !wait
+fs_cqe *fs_ring_peek_cqe( fs_ring *r, bool_t wait);
+//release the cqe returned by fs_ring_peek_cqe
+void fs_ring_cqe_seen( fs_ring *r);
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ * fs_server: mount an image and serve the fs calls on a unix socket, so
+ * several processes share one volume, its cache and its allocator.
+ * usage: fs_server image socket [-w]
+ *   -w  turn the write-back cache on
+ * One poll loop serves every connection. Each connection gets a session of
+ * its own for the working directory; the fds it opens are its own and are
+ * closed when it goes away. All complete requests in a connection's input
+ * are run as one batch: reads and writes go through an fs_ring, so adjacent
+ * ones are merged, and the replies go out in one send.
+ * FAKE (linux) build only, wire format in fs_proto.h.
+*/
+#include "common.h"
+#include "fs.h"
+#include "fs_ring.h"
+#include "fs_proto.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define MAX_CLIENTS 16
+#define IN_SIZE (2*(sizeof(fsp_req)+FSP_MAX_PAYLOAD))
+#define OUT_SIZE (4*(sizeof(fsp_rep)+FSP_MAX_DATA))
+//read data and stat buffers of the batch being run
+#define STAGE_SIZE (4*FSP_MAX_DATA)
+#define MAX_PENDING FS_RING_ENTRIES
+
+typedef struct
+{
+	int sock;//-1 for a free slot
+	fs_session *session;
+	char in[IN_SIZE];
+	int in_len;
+	char out[OUT_SIZE];
+	int out_start;//[out_start,out_len) still to send
+	int out_len;
+}client;
+
+//a reply of the running batch, sent once the whole batch has run
+typedef struct
+{
+	uint32_t tag;
+	int op;
+	int res;
+	char *data;//in stage: the buffer of a read, the fileStat of a stat
+}pending_reply;
+
+static fs_t *vol;
+static fs_ring ring;
+static client clients[MAX_CLIENTS];
+static int16_t fd_owner[MAX_OPEN_FILE_NUM];//client index, -1 if no client has it open
+
+static pending_reply pending[MAX_PENDING];
+static int npending;
+static int pending_bytes;//reply bytes npending will take in out
+static int ring_queued;//reads & writes queued on the ring, not yet run
+static uint64_t stage[STAGE_SIZE/8];//uint64_t for the alignment of fileStat
+static int stage_len;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop=1;
+}
+
+static char *stage_alloc(int len)
+{
+	char *p=(char *)stage+stage_len;
+	stage_len+=(len+7)&~7;
+	return p;
+}
+
+static bool_t owns(client *c,int fd)
+{
+	return fd>=0 && fd<MAX_OPEN_FILE_NUM && fd_owner[fd]==c-clients;
+}
+
+//payload size of the reply to a request, at most
+static int reply_data_max(fsp_req *q)
+{
+	if(q->op==FSP_READ)
+		return q->arg>0 && q->arg<=FSP_MAX_DATA?q->arg:0;
+	if(q->op==FSP_STAT)
+		return sizeof(fileStat);
+	return 0;
+}
+
+//the one or two NUL-terminated paths of a payload, FALSE if it holds fewer
+static bool_t payload_paths(char *payload,int len,int want,char **p1,char **p2)
+{
+	int i,found=0;
+	char *start=payload;
+	for(i=0;i<len && found<want;i++)
+		if(payload[i]=='\0')
+		{
+			if(payload+i-start>MAX_PATH_NAME)
+				return FALSE;
+			if(found==0)
+				*p1=start;
+			else
+				*p2=start;
+			found++;
+			start=payload+i+1;
+		}
+	return found==want;
+}
+
+//run the reads & writes queued on the ring, fill their replies
+static void ring_wait(void)
+{
+	if(ring_queued==0)
+		return;
+	fs_ring_submit(&ring);
+	while(ring_queued>0)
+	{
+		fs_cqe *cqe=fs_ring_peek_cqe(&ring,TRUE);
+		pending[cqe->user_data].res=cqe->res;
+		fs_ring_cqe_seen(&ring);
+		ring_queued--;
+	}
+}
+
+//everything else runs right away, after the queued reads & writes
+static int run_direct(client *c,fsp_req *q,char *payload,pending_reply *p)
+{
+	char *path=NULL,*path2=NULL;
+	int paths=q->op==FSP_LINK || q->op==FSP_RENAME?2:1;
+	switch(q->op)
+	{
+	case FSP_NOP:
+		return 0;
+	case FSP_CLOSE:
+		if(!owns(c,q->fd))
+			return -1;
+		fd_owner[q->fd]=-1;
+		return fsh_close(vol,q->fd);
+	case FSP_LSEEK:
+		return owns(c,q->fd)?fsh_lseek(vol,q->fd,q->offset):-1;
+	case FSP_FTRUNCATE:
+		return owns(c,q->fd)?fsh_ftruncate(vol,q->fd,q->arg):-1;
+	case FSP_SYNC:
+		return fsh_sync(vol);
+	}
+	if(!payload_paths(payload,q->len,paths,&path,&path2))
+		return -1;
+	switch(q->op)
+	{
+	case FSP_OPEN:
+	{
+		int fd=fss_open(c->session,path,q->arg);
+		if(fd>=0)
+			fd_owner[fd]=c-clients;
+		return fd;
+	}
+	case FSP_MKDIR:
+		return fss_mkdir(c->session,path);
+	case FSP_RMDIR:
+		return fss_rmdir(c->session,path);
+	case FSP_CD:
+		return fss_cd(c->session,path);
+	case FSP_LINK:
+		return fss_link(c->session,path,path2);
+	case FSP_UNLINK:
+		return fss_unlink(c->session,path);
+	case FSP_STAT:
+		p->data=stage_alloc(sizeof(fileStat));
+		return fss_stat(c->session,path,(fileStat *)p->data);
+	case FSP_RENAME:
+		return fss_rename(c->session,path,path2);
+	}
+	return -1;
+}
+
+static void run_request(client *c,fsp_req *q,char *payload)
+{
+	pending_reply *p=&pending[npending];
+	p->tag=q->tag;
+	p->op=q->op;
+	p->data=NULL;
+	pending_bytes+=sizeof(fsp_rep)+reply_data_max(q);
+	if(q->op==FSP_READ || q->op==FSP_WRITE)
+	{
+		if(!owns(c,q->fd) || q->arg<0 || q->arg>FSP_MAX_DATA
+			|| (q->offset<0 && q->offset!=FSP_CURSOR) || (q->op==FSP_WRITE && q->len!=q->arg))
+			p->res=-1;
+		else
+		{
+			//there is a free sqe: the ring is empty between batches, and a batch has at most MAX_PENDING
+			fs_sqe *e=fs_ring_get_sqe(&ring);
+			e->op=q->op==FSP_READ?FS_OP_READ:FS_OP_WRITE;
+			e->fd=q->fd;
+			e->len=q->arg;
+			e->offset=q->offset==FSP_CURSOR?FS_RING_CURSOR:q->offset;
+			e->buf=q->op==FSP_READ?(p->data=stage_alloc(q->arg)):payload;
+			e->user_data=npending;
+			ring_queued++;
+		}
+	}
+	else
+	{
+		ring_wait();
+		p->res=run_direct(c,q,payload,p);
+	}
+	npending++;
+}
+
+//run what is queued and put the replies of the batch in out
+static void batch_end(client *c)
+{
+	ring_wait();
+	int i;
+	for(i=0;i<npending;i++)
+	{
+		pending_reply *p=&pending[i];
+		fsp_rep rep;
+		rep.tag=p->tag;
+		rep.res=p->res;
+		rep.len=0;
+		if(p->op==FSP_READ && p->res>0)
+			rep.len=p->res;
+		else if(p->op==FSP_STAT && p->res==0)
+			rep.len=sizeof(fileStat);
+		memcpy(c->out+c->out_len,&rep,sizeof(rep));
+		c->out_len+=sizeof(rep);
+		if(rep.len>0)
+			memcpy(c->out+c->out_len,p->data,rep.len);
+		c->out_len+=rep.len;
+	}
+	npending=0;
+	pending_bytes=0;
+	stage_len=0;
+}
+
+//run the complete requests in c's input as long as their replies fit in out;
+//FALSE if the connection has to be dropped
+static bool_t serve(client *c)
+{
+	if(c->out_start>0)
+	{
+		memmove(c->out,c->out+c->out_start,c->out_len-c->out_start);
+		c->out_len-=c->out_start;
+		c->out_start=0;
+	}
+	int pos=0;
+	while(c->in_len-pos>=(int)sizeof(fsp_req))
+	{
+		fsp_req q;
+		memcpy(&q,c->in+pos,sizeof(q));
+		if(q.len>FSP_MAX_PAYLOAD)
+		{
+			printf("request too large, dropping the client\n");
+			return FALSE;
+		}
+		if(c->in_len-pos<(int)(sizeof(q)+q.len))
+			break;
+		int reply=sizeof(fsp_rep)+reply_data_max(&q);
+		if(reply>OUT_SIZE-c->out_len-pending_bytes)
+			break;//the rest once out is sent
+		if(npending==MAX_PENDING || reply>STAGE_SIZE-stage_len)
+		{
+			batch_end(c);
+			if(reply>OUT_SIZE-c->out_len)
+				break;
+		}
+		run_request(c,&q,c->in+pos+sizeof(q));
+		pos+=sizeof(q)+q.len;
+	}
+	//writes point into in until the batch ends
+	batch_end(c);
+	memmove(c->in,c->in+pos,c->in_len-pos);
+	c->in_len-=pos;
+	return TRUE;
+}
+
+static void drop_client(client *c)
+{
+	int fd;
+	for(fd=0;fd<MAX_OPEN_FILE_NUM;fd++)
+		if(fd_owner[fd]==c-clients)
+		{
+			fsh_close(vol,fd);
+			fd_owner[fd]=-1;
+		}
+	fs_session_close(c->session);
+	close(c->sock);
+	c->sock=-1;
+}
+
+static void accept_client(int listener)
+{
+	int sock=accept(listener,NULL,NULL);
+	if(sock<0)
+		return;
+	int i;
+	for(i=0;i<MAX_CLIENTS;i++)
+		if(clients[i].sock<0)
+			break;
+	fs_session *s=i<MAX_CLIENTS?fs_session_open(vol):NULL;
+	if(s==NULL)
+	{
+		printf("too many clients\n");
+		close(sock);
+		return;
+	}
+	fcntl(sock,F_SETFL,O_NONBLOCK);
+	client *c=&clients[i];
+	c->sock=sock;
+	c->session=s;
+	c->in_len=0;
+	c->out_start=c->out_len=0;
+}
+
+//send what out holds, FALSE if the connection is gone
+static bool_t client_send(client *c)
+{
+	while(c->out_start<c->out_len)
+	{
+		int n=send(c->sock,c->out+c->out_start,c->out_len-c->out_start,MSG_NOSIGNAL);
+		if(n<0)
+			return errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR;
+		c->out_start+=n;
+	}
+	c->out_start=c->out_len=0;
+	return TRUE;
+}
+
+//read what is there, serve it and send the replies; FALSE if the connection is gone
+static bool_t client_io(client *c,short revents)
+{
+	if(revents&POLLIN)
+	{
+		int n=recv(c->sock,c->in+c->in_len,IN_SIZE-c->in_len,0);
+		if(n==0 || (n<0 && errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR))
+			return FALSE;
+		if(n>0)
+			c->in_len+=n;
+	}
+	if(revents&(POLLERR|POLLHUP) && !(revents&POLLIN))
+		return FALSE;
+	if(!client_send(c))
+		return FALSE;
+	if(!serve(c))
+		return FALSE;
+	return client_send(c);
+}
+
+static int listen_on(const char *path)
+{
+	struct sockaddr_un addr;
+	if(strlen(path)>=sizeof(addr.sun_path))
+	{
+		printf("socket path too long\n");
+		return -1;
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	memcpy(addr.sun_path,path,strlen(path));
+	int sock=socket(AF_UNIX,SOCK_STREAM,0);
+	if(sock<0)
+		return -1;
+	unlink(path);
+	if(bind(sock,(struct sockaddr *)&addr,sizeof(addr))<0 || listen(sock,MAX_CLIENTS)<0)
+	{
+		close(sock);
+		return -1;
+	}
+	fcntl(sock,F_SETFL,O_NONBLOCK);
+	return sock;
+}
+
+int main(int argc,char **argv)
+{
+	if(argc<3 || (argc==4 && strcmp(argv[3],"-w")!=0) || argc>4)
+	{
+		printf("usage: %s image socket [-w]\n",argv[0]);
+		return 1;
+	}
+	vol=fs_mount(argv[1],NULL);
+	if(vol==NULL)
+		return 1;
+	if(argc==4)
+	{
+		fs_writeback_opts wb={3000,500,25,50};
+		fsh_writeback(vol,&wb);
+	}
+	int listener=listen_on(argv[2]);
+	if(listener<0)
+	{
+		printf("can't listen on %s\n",argv[2]);
+		fs_unmount(vol);
+		return 1;
+	}
+	fs_ring_init(&ring,vol);
+	int i;
+	for(i=0;i<MAX_CLIENTS;i++)
+		clients[i].sock=-1;
+	for(i=0;i<MAX_OPEN_FILE_NUM;i++)
+		fd_owner[i]=-1;
+
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler=on_signal;//no SA_RESTART, so poll returns
+	sigaction(SIGINT,&sa,NULL);
+	sigaction(SIGTERM,&sa,NULL);
+
+	while(!stop)
+	{
+		struct pollfd pfd[MAX_CLIENTS+1];
+		int who[MAX_CLIENTS+1];
+		int n=0;
+		pfd[n].fd=listener;
+		pfd[n].events=POLLIN;
+		who[n++]=-1;
+		for(i=0;i<MAX_CLIENTS;i++)
+		{
+			client *c=&clients[i];
+			if(c->sock<0)
+				continue;
+			pfd[n].fd=c->sock;
+			pfd[n].events=0;
+			if(c->in_len<(int)IN_SIZE)
+				pfd[n].events|=POLLIN;
+			if(c->out_start<c->out_len)
+				pfd[n].events|=POLLOUT;
+			who[n++]=i;
+		}
+		if(poll(pfd,n,-1)<0)
+			continue;//EINTR
+		for(i=1;i<n;i++)
+			if(pfd[i].revents && !client_io(&clients[who[i]],pfd[i].revents))
+				drop_client(&clients[who[i]]);
+		if(pfd[0].revents&POLLIN)
+			accept_client(listener);
+	}
+
+	for(i=0;i<MAX_CLIENTS;i++)
+		if(clients[i].sock>=0)
+			drop_client(&clients[i]);
+	close(listener);
+	unlink(argv[2]);
+	fs_ring_exit(&ring);
+	fs_unmount(vol);
+	return 0;
+}
@@ -0,0 +1,778 @@
+/*
+ * fsck: check an image offline, and repair it with -y.
+ * usage: fsck [-y] [-f] [-j workers] image
+ *   -y  repair what can be repaired, else the image is only read
+ *   -f  check an image even if it was unmounted cleanly
+ *   -j  threads scanning the inode table, 4 by default
+ * Each worker takes a range of inode table blocks. It reads them, follows
+ * the block maps of the inodes in use and reads their directories. It
+ * counts into arrays of its own how often each data block is mapped and
+ * each inode is named. The counts are merged once all workers are done.
+ * One thread then checks them against the link counts, the bitmaps, the
+ * share counts and the superblock, and follows the names up from each
+ * inode to find the ones the root doesn't reach. A repair that changes
+ * the tree (an entry cleared, an inode freed) is followed by another pass.
+ * Exit status: 0 no errors, 1 all errors repaired, 4 errors left, 8 the
+ * image can't be checked.
+ * FAKE (linux) build only; the image must not be mounted.
+*/
+#include "common.h"
+#include "fs.h"
+#include "block.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define MAX_WORKERS INODE_BLOCK_NUMBER
+#define MAX_BAD_ENTRIES 256//per worker and pass, the rest wait for the next pass
+
+//what is wrong with a directory entry
+#define ENTRY_DANGLING 1//names an inode that isn't in use
+#define ENTRY_BAD_NAME 2//the name isn't terminated
+#define ENTRY_BAD_HASH 3//name_hash or name_len doesn't match the name
+#define ENTRY_DOT 4//"." isn't the directory itself
+#define ENTRY_DOTDOT 5//".." isn't the parent
+
+typedef struct
+{
+	uint16_t dir;
+	uint16_t slot;
+	uint8_t why;
+}bad_entry;
+
+typedef struct
+{
+	pthread_t tid;
+	int first_block;//inode table blocks [first_block,last_block)
+	int last_block;
+	uint16_t refs[DATA_BLOCK_NUMBER];//times each data block is mapped
+	bool_t unshareable[DATA_BLOCK_NUMBER];//mapped as an index or directory block
+	uint16_t names[MAX_FILE_COUNT];//entries naming each inode, "." and ".." aside
+	int16_t parent[MAX_FILE_COUNT];//a directory holding one of them
+	bad_entry bad[MAX_BAD_ENTRIES];
+	int nbad;
+	bool_t bad_overflow;
+}worker;
+
+static int dev;
+static bool_t repair=FALSE;
+static int nworkers=4;
+
+static char sb_scratch[NEW_BLOCK_SIZE];
+static super_b *sb=(super_b *)sb_scratch;
+static char inode_bitmap[NEW_BLOCK_SIZE];
+static char dblock_bitmap[NEW_BLOCK_SIZE];
+static inode itable[MAX_FILE_COUNT];
+static int journal_first=0;//data block index range of the journal
+static int journal_last=0;
+
+//per inode, each written only by the worker whose range holds it
+static uint32_t good_size[MAX_FILE_COUNT];//the size its map and type allow
+static int16_t dot[MAX_FILE_COUNT];//"." of a directory, -1 if missing
+static int16_t dotdot[MAX_FILE_COUNT];
+static uint16_t dot_slot[MAX_FILE_COUNT];
+static uint16_t dotdot_slot[MAX_FILE_COUNT];
+
+static worker workers[MAX_WORKERS];
+//merged counts
+static uint16_t refs[DATA_BLOCK_NUMBER];
+static bool_t unshareable[DATA_BLOCK_NUMBER];
+static uint16_t names[MAX_FILE_COUNT];
+static int16_t parent[MAX_FILE_COUNT];
+static int8_t reach[MAX_FILE_COUNT];//1 reachable from the root, -1 not, 0 not known yet
+static int16_t up_walk[MAX_FILE_COUNT];
+
+static bad_entry left[MAX_BAD_ENTRIES];//entries reported and not repaired, for later passes
+static int nleft=0;
+
+static int errors=0;
+static int repaired=0;
+static bool_t table_dirty[INODE_BLOCK_NUMBER];
+static bool_t bitmaps_dirty=FALSE;
+static bool_t sb_dirty=FALSE;
+
+//--- image & bitmaps ---
+static void image_read(int block,char *mem)
+{
+	int i;
+	for(i=0;i<NEW_BLOCK_SIZE/BLOCK_SIZE;i++)
+		dev_block_read(dev,block*(NEW_BLOCK_SIZE/BLOCK_SIZE)+i,mem+i*BLOCK_SIZE);
+}
+
+static void image_write(int block,char *mem)
+{
+	int i;
+	for(i=0;i<NEW_BLOCK_SIZE/BLOCK_SIZE;i++)
+		dev_block_write(dev,block*(NEW_BLOCK_SIZE/BLOCK_SIZE)+i,mem+i*BLOCK_SIZE);
+}
+
+static int bit_get(char *bitmap,int i)
+{
+	return (bitmap[i/8]>>(i%8))&1;
+}
+
+static void bit_set(char *bitmap,int i,int val)
+{
+	if(val)
+		bitmap[i/8]|=1<<(i%8);
+	else
+		bitmap[i/8]&=~(1<<(i%8));
+	bitmaps_dirty=TRUE;
+}
+
+static int bit_count(char *bitmap,int n)
+{
+	int i;
+	int count=0;
+	for(i=0;i<n;i++)
+		count+=bit_get(bitmap,i);
+	return count;
+}
+
+//the same hash fs.c keeps in dir_entry
+static uint32_t name_hash(char *name)
+{
+	uint32_t h=2166136261u;
+	int i;
+	for(i=0;i<MAX_FILE_NAME && name[i];i++)
+	{
+		h^=(uint8_t)name[i];
+		h*=16777619u;
+	}
+	return h;
+}
+
+//an error found; a repair that follows counts it as repaired
+static void report(bool_t can_repair,const char *fmt,...) __attribute__((format(printf,2,3)));
+static void report(bool_t can_repair,const char *fmt,...)
+{
+	va_list ap;
+	va_start(ap,fmt);
+	vprintf(fmt,ap);
+	va_end(ap);
+	errors++;
+	if(repair && can_repair)
+	{
+		printf(", repaired\n");
+		repaired++;
+	}
+	else
+		printf("\n");
+}
+
+//a block index an inode may map: inside the data area and not the journal's
+static bool_t data_block_ok(int b)
+{
+	return b<DATA_BLOCK_NUMBER && (b<journal_first || b>=journal_last);
+}
+
+//--- scan, run by the workers ---
+static void note_bad_entry(worker *w,int dir,int slot,int why)
+{
+	if(w->nbad==MAX_BAD_ENTRIES)
+	{
+		w->bad_overflow=TRUE;
+		return;
+	}
+	w->bad[w->nbad].dir=dir;
+	w->bad[w->nbad].slot=slot;
+	w->bad[w->nbad].why=why;
+	w->nbad++;
+}
+
+static void scan_dir(worker *w,int id,char *index_scratch)
+{
+	inode *p=&itable[id];
+	char entry_scratch[NEW_BLOCK_SIZE];
+	dir_entry *entry_list=(dir_entry *)entry_scratch;
+	int nentries=good_size[id]/sizeof(dir_entry);
+	int slot;
+	for(slot=0;slot<nentries;slot++)
+	{
+		int j=slot%DIR_ENTRY_PER_BLOCK;
+		if(j==0)
+		{
+			int n=slot/DIR_ENTRY_PER_BLOCK;
+			int b=n<DIRECT_BLOCK?p->blocks[n]:((uint16_t *)index_scratch)[n-DIRECT_BLOCK];
+			w->unshareable[b]=TRUE;
+			image_read(sb->dblock_start+b,entry_scratch);
+		}
+		dir_entry *e=&entry_list[j];
+		if(e->file_name[0]=='\0')//an empty slot
+			continue;
+		if(memchr(e->file_name,'\0',MAX_FILE_NAME+1)==NULL)
+		{
+			note_bad_entry(w,id,slot,ENTRY_BAD_NAME);
+			continue;
+		}
+		if(strcmp(e->file_name,".")==0)
+		{
+			dot[id]=e->inode_id;
+			dot_slot[id]=slot;
+			continue;
+		}
+		if(strcmp(e->file_name,"..")==0)
+		{
+			dotdot[id]=e->inode_id;
+			dotdot_slot[id]=slot;
+			continue;
+		}
+		int child=e->inode_id;
+		if(child>=MAX_FILE_COUNT || !bit_get(inode_bitmap,child))
+		{
+			note_bad_entry(w,id,slot,ENTRY_DANGLING);
+			continue;
+		}
+		w->names[child]++;
+		w->parent[child]=id;
+		if((sb->features & SB_FEATURE_NAME_HASH)
+			&& (e->name_hash!=name_hash(e->file_name) || e->name_len!=strlen(e->file_name)))
+			note_bad_entry(w,id,slot,ENTRY_BAD_HASH);
+	}
+}
+
+//count the blocks an inode maps, up to the first one it can't; a directory is read too
+static void scan_inode(worker *w,int id)
+{
+	inode *p=&itable[id];
+	dot[id]=-1;
+	dotdot[id]=-1;
+	good_size[id]=p->size;
+	if(p->type!=MY_DIRECTORY && p->type!=REAL_FILE)
+		return;
+	if(good_size[id]>(uint32_t)MAX_BLOCKS_INDEX_IN_INODE*NEW_BLOCK_SIZE)
+		good_size[id]=(uint32_t)MAX_BLOCKS_INDEX_IN_INODE*NEW_BLOCK_SIZE;
+	if(p->type==MY_DIRECTORY)
+		good_size[id]-=good_size[id]%sizeof(dir_entry);
+	int nblocks=(good_size[id]+NEW_BLOCK_SIZE-1)/NEW_BLOCK_SIZE;
+	char index_scratch[NEW_BLOCK_SIZE];
+	int n;
+	if(nblocks>DIRECT_BLOCK)
+	{
+		int b=p->blocks[DIRECT_BLOCK];
+		if(data_block_ok(b))
+		{
+			w->refs[b]++;
+			w->unshareable[b]=TRUE;
+			image_read(sb->dblock_start+b,index_scratch);
+		}
+		else
+			nblocks=DIRECT_BLOCK;
+	}
+	for(n=0;n<nblocks;n++)
+	{
+		int b=n<DIRECT_BLOCK?p->blocks[n]:((uint16_t *)index_scratch)[n-DIRECT_BLOCK];
+		if(!data_block_ok(b))
+			break;
+		w->refs[b]++;
+	}
+	if((uint32_t)n*NEW_BLOCK_SIZE<good_size[id])
+		good_size[id]=(uint32_t)n*NEW_BLOCK_SIZE;
+	if(n<=DIRECT_BLOCK && nblocks>DIRECT_BLOCK)//the index block goes with the blocks it maps
+	{
+		w->refs[p->blocks[DIRECT_BLOCK]]--;
+		w->unshareable[p->blocks[DIRECT_BLOCK]]=FALSE;
+	}
+	if(p->type==MY_DIRECTORY)
+		scan_dir(w,id,index_scratch);
+}
+
+static void *worker_main(void *arg)
+{
+	worker *w=arg;
+	int i;
+	for(i=w->first_block;i<w->last_block;i++)
+		image_read(sb->inode_start+i,(char *)&itable[i*INODE_PER_BLOCK]);
+	for(i=w->first_block*INODE_PER_BLOCK;i<w->last_block*INODE_PER_BLOCK;i++)
+		if(bit_get(inode_bitmap,i))
+			scan_inode(w,i);
+	return NULL;
+}
+
+//every worker scans its range, then their counts are merged
+static void scan(void)
+{
+	int k,i;
+	for(k=0;k<nworkers;k++)
+	{
+		worker *w=&workers[k];
+		memset(w,0,sizeof(worker));
+		w->first_block=k*INODE_BLOCK_NUMBER/nworkers;
+		w->last_block=(k+1)*INODE_BLOCK_NUMBER/nworkers;
+		for(i=0;i<MAX_FILE_COUNT;i++)
+			w->parent[i]=-1;
+		pthread_create(&w->tid,NULL,worker_main,w);
+	}
+	memset(refs,0,sizeof(refs));
+	memset(unshareable,0,sizeof(unshareable));
+	memset(names,0,sizeof(names));
+	for(i=0;i<MAX_FILE_COUNT;i++)
+		parent[i]=-1;
+	for(k=0;k<nworkers;k++)
+	{
+		worker *w=&workers[k];
+		pthread_join(w->tid,NULL);
+		for(i=0;i<DATA_BLOCK_NUMBER;i++)
+		{
+			refs[i]+=w->refs[i];
+			unshareable[i]|=w->unshareable[i];
+		}
+		for(i=0;i<MAX_FILE_COUNT;i++)
+		{
+			names[i]+=w->names[i];
+			if(w->parent[i]>=0)
+				parent[i]=w->parent[i];
+		}
+	}
+}
+
+//--- checks & repairs, one thread ---
+static void inode_free(int id)
+{
+	bit_set(inode_bitmap,id,0);
+}
+
+static void inode_changed(int id)
+{
+	table_dirty[id/INODE_PER_BLOCK]=TRUE;
+}
+
+//data block holding entry slot of directory dir
+static int dir_slot_block(int dir,int slot)
+{
+	inode *p=&itable[dir];
+	int n=slot/DIR_ENTRY_PER_BLOCK;
+	if(n<DIRECT_BLOCK)
+		return p->blocks[n];
+	char index_scratch[NEW_BLOCK_SIZE];
+	image_read(sb->dblock_start+p->blocks[DIRECT_BLOCK],index_scratch);
+	return ((uint16_t *)index_scratch)[n-DIRECT_BLOCK];
+}
+
+static void entry_repair(bad_entry *b,int block)
+{
+	char entry_scratch[NEW_BLOCK_SIZE];
+	image_read(sb->dblock_start+block,entry_scratch);
+	dir_entry *e=(dir_entry *)entry_scratch+b->slot%DIR_ENTRY_PER_BLOCK;
+	switch(b->why)
+	{
+	case ENTRY_DANGLING:
+	case ENTRY_BAD_NAME:
+		memset(e,0,sizeof(dir_entry));
+		break;
+	case ENTRY_BAD_HASH:
+		e->name_hash=name_hash(e->file_name);
+		e->name_len=strlen(e->file_name);
+		break;
+	case ENTRY_DOT:
+		e->inode_id=b->dir;
+		break;
+	case ENTRY_DOTDOT:
+		e->inode_id=b->dir==ROOT_DIR_ID?ROOT_DIR_ID:parent[b->dir];
+		break;
+	}
+	image_write(sb->dblock_start+block,entry_scratch);
+}
+
+//TRUE if the entry was repaired; one in a block something else maps too is
+//left alone, writing it would damage the other owner
+static bool_t check_entry(bad_entry *b)
+{
+	int block=dir_slot_block(b->dir,b->slot);
+	bool_t can_repair=refs[block]==1;
+	if(!can_repair || !repair)
+	{
+		int i;
+		for(i=0;i<nleft;i++)
+			if(left[i].dir==b->dir && left[i].slot==b->slot && left[i].why==b->why)
+				return FALSE;//an earlier pass reported it
+		if(nleft<MAX_BAD_ENTRIES)
+			left[nleft++]=*b;
+	}
+	switch(b->why)
+	{
+	case ENTRY_DANGLING:
+		report(can_repair,"directory %d: entry %d names an inode that isn't in use",b->dir,b->slot);
+		break;
+	case ENTRY_BAD_NAME:
+		report(can_repair,"directory %d: entry %d has a name longer than %d",b->dir,b->slot,MAX_FILE_NAME);
+		break;
+	case ENTRY_BAD_HASH:
+		report(can_repair,"directory %d: entry %d has a wrong name hash",b->dir,b->slot);
+		break;
+	case ENTRY_DOT:
+		report(can_repair,"directory %d: \".\" is inode %d",b->dir,dot[b->dir]);
+		break;
+	case ENTRY_DOTDOT:
+		report(can_repair,"directory %d: \"..\" is inode %d, not its parent",b->dir,dotdot[b->dir]);
+		break;
+	}
+	if(!repair || !can_repair)
+		return FALSE;
+	entry_repair(b,block);
+	return TRUE;
+}
+
+//does following the entries naming directory id lead up to the root; a
+//directory has one name, the one parent[] holds
+static bool_t dir_reachable(int id)
+{
+	int n=0,i;
+	int8_t res=-1;
+	while(id>=0 && reach[id]==0)
+	{
+		reach[id]=2;//on this walk, seeing it again means a cycle
+		up_walk[n++]=id;
+		id=parent[id];
+	}
+	if(id>=0 && reach[id]==1)
+		res=1;
+	for(i=0;i<n;i++)
+		reach[up_walk[i]]=res;
+	return res==1;
+}
+
+//is the file named in a directory that is reachable; a file with more than
+//one name may be reachable through another one than parent[] holds
+static bool_t file_reachable(int id)
+{
+	if(parent[id]>=0 && dir_reachable(parent[id]))
+		return TRUE;
+	if(names[id]<2)
+		return FALSE;
+	char entry_scratch[NEW_BLOCK_SIZE];
+	dir_entry *entry_list=(dir_entry *)entry_scratch;
+	int dir,slot;
+	for(dir=0;dir<MAX_FILE_COUNT;dir++)
+	{
+		if(!bit_get(inode_bitmap,dir) || itable[dir].type!=MY_DIRECTORY || !dir_reachable(dir))
+			continue;
+		int nentries=good_size[dir]/sizeof(dir_entry);
+		for(slot=0;slot<nentries;slot++)
+		{
+			dir_entry *e=&entry_list[slot%DIR_ENTRY_PER_BLOCK];
+			if(slot%DIR_ENTRY_PER_BLOCK==0)
+				image_read(sb->dblock_start+dir_slot_block(dir,slot),entry_scratch);
+			if(e->inode_id==id && e->file_name[0]!='\0' && strcmp(e->file_name,".")!=0 && strcmp(e->file_name,"..")!=0)
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+//inodes and entries; checks that can't repair anything are left to
+//check_links, which runs once; TRUE if a repair changed the tree, which needs a new scan
+static bool_t check_tree(void)
+{
+	bool_t changed=FALSE;//by a repair
+	bool_t overflow=FALSE;
+	int k,i,id;
+	for(k=0;k<nworkers;k++)
+	{
+		for(i=0;i<workers[k].nbad;i++)
+			if(check_entry(&workers[k].bad[i]) && workers[k].bad[i].why!=ENTRY_BAD_HASH)
+				changed=TRUE;
+		overflow|=workers[k].bad_overflow;
+	}
+	if(overflow && !changed)
+		report(FALSE,"more bad directory entries than fsck takes in one pass");
+	memset(reach,0,sizeof(reach));
+	reach[ROOT_DIR_ID]=1;
+	for(id=0;id<MAX_FILE_COUNT;id++)
+	{
+		if(!bit_get(inode_bitmap,id))
+			continue;
+		inode *p=&itable[id];
+		if(p->type!=MY_DIRECTORY && p->type!=REAL_FILE)
+		{
+			report(TRUE,"inode %d: unknown type %d",id,p->type);
+			if(repair)
+				inode_free(id);
+			changed=TRUE;
+			continue;
+		}
+		if(good_size[id]!=p->size)
+		{
+			report(TRUE,"inode %d: size %u, the block map holds %u",id,p->size,good_size[id]);
+			if(repair)
+			{
+				p->size=good_size[id];
+				inode_changed(id);
+			}
+			changed=TRUE;
+		}
+		if(p->type==MY_DIRECTORY)
+		{
+			int up=id==ROOT_DIR_ID?ROOT_DIR_ID:parent[id];
+			if(dot[id]>=0 && dot[id]!=id)
+			{
+				bad_entry b={id,dot_slot[id],ENTRY_DOT};
+				check_entry(&b);
+			}
+			if(dotdot[id]>=0 && up>=0 && dotdot[id]!=up)
+			{
+				bad_entry b={id,dotdot_slot[id],ENTRY_DOTDOT};
+				check_entry(&b);
+			}
+		}
+		if(id!=ROOT_DIR_ID && names[id]==0)
+		{
+			if(p->type==REAL_FILE && p->link_count==0)
+				report(TRUE,"inode %d: orphan, unlinked while open, %u bytes",id,p->size);
+			else
+				report(TRUE,"inode %d: orphan, no directory names it, %u bytes",id,p->size);
+			if(repair)
+				inode_free(id);
+			changed=TRUE;
+		}
+		else if(id!=ROOT_DIR_ID && !(p->type==MY_DIRECTORY?dir_reachable(id):file_reachable(id)))
+		{
+			report(TRUE,"inode %d: not reachable from the root, %u bytes",id,p->size);
+			if(repair)
+				inode_free(id);
+			changed=TRUE;
+		}
+	}
+	return repair && changed;
+}
+
+static void check_links(void)
+{
+	int id;
+	for(id=0;id<MAX_FILE_COUNT;id++)
+	{
+		if(!bit_get(inode_bitmap,id))
+			continue;
+		inode *p=&itable[id];
+		int want=p->type==MY_DIRECTORY?1:names[id];
+		if(p->type==MY_DIRECTORY && names[id]>1)
+			report(FALSE,"directory %d: %d names",id,names[id]);
+		if(p->type==MY_DIRECTORY && (dot[id]<0 || dotdot[id]<0))
+			report(FALSE,"directory %d: no \".\" or \"..\" entry",id);
+		if(p->link_count!=want)
+		{
+			report(TRUE,"inode %d: link count %d, should be %d",id,p->link_count,want);
+			if(repair)
+			{
+				p->link_count=want;
+				inode_changed(id);
+			}
+		}
+	}
+}
+
+static void check_blocks(void)
+{
+	bool_t shares=(sb->features & SB_FEATURE_REFLINK)!=0;
+	int b;
+	for(b=0;b<DATA_BLOCK_NUMBER;b++)
+	{
+		bool_t used=bit_get(dblock_bitmap,b);
+		if(!data_block_ok(b))//the journal's
+		{
+			if(!used)
+			{
+				report(TRUE,"block %d: journal block marked free",b);
+				if(repair)
+					bit_set(dblock_bitmap,b,1);
+			}
+			continue;
+		}
+		if(refs[b]==0 && used)
+		{
+			report(TRUE,"block %d: marked in use, nothing maps it",b);
+			if(repair)
+			{
+				bit_set(dblock_bitmap,b,0);
+				if(shares)
+					sb->dblock_share[b]=0;
+				sb_dirty=TRUE;
+			}
+			continue;
+		}
+		if(refs[b]>0 && !used)
+		{
+			report(TRUE,"block %d: mapped, marked free",b);
+			if(repair)
+				bit_set(dblock_bitmap,b,1);
+		}
+		int share=shares?sb->dblock_share[b]:0;
+		if(refs[b]>1 && (unshareable[b] || !shares || refs[b]-1>MAX_DBLOCK_SHARE))
+			report(FALSE,"block %d: mapped %d times",b,refs[b]);
+		else if(refs[b]>0 && share!=refs[b]-1)
+		{
+			report(TRUE,"block %d: share count %d, mapped %d times",b,share,refs[b]);
+			if(repair)
+			{
+				sb->dblock_share[b]=refs[b]-1;
+				sb_dirty=TRUE;
+			}
+		}
+	}
+}
+
+static void check_counts(void)
+{
+	int inodes=bit_count(inode_bitmap,MAX_FILE_COUNT);
+	int blocks=bit_count(dblock_bitmap,DATA_BLOCK_NUMBER);
+	if(sb->inode_count!=inodes)
+	{
+		report(TRUE,"superblock: %d inodes in use, %d in the bitmap",sb->inode_count,inodes);
+		sb->inode_count=inodes;
+		sb_dirty=TRUE;
+	}
+	if(sb->dblock_count!=blocks)
+	{
+		report(TRUE,"superblock: %d blocks in use, %d in the bitmap",sb->dblock_count,blocks);
+		sb->dblock_count=blocks;
+		sb_dirty=TRUE;
+	}
+}
+
+//write back what a pass repaired
+static void flush(void)
+{
+	int i;
+	if(!repair)
+		return;
+	for(i=0;i<INODE_BLOCK_NUMBER;i++)
+		if(table_dirty[i])
+		{
+			image_write(sb->inode_start+i,(char *)&itable[i*INODE_PER_BLOCK]);
+			table_dirty[i]=FALSE;
+		}
+	if(bitmaps_dirty)
+	{
+		image_write(sb->inode_bitmap_place,inode_bitmap);
+		image_write(sb->dblock_bitmap_place,dblock_bitmap);
+		bitmaps_dirty=FALSE;
+		sb_dirty=TRUE;
+	}
+	if(sb_dirty)
+	{
+		image_write(SUPER_BLOCK,sb_scratch);
+		image_write(SUPER_BLOCK_BACKUP,sb_scratch);
+		sb_dirty=FALSE;
+	}
+}
+
+//--- setup ---
+//0 when the superblock can be used, else the exit status
+static int load_sb(const char *image)
+{
+	image_read(SUPER_BLOCK,sb_scratch);
+	if(sb->magic_num!=MY_MAGIC)
+	{
+		image_read(SUPER_BLOCK_BACKUP,sb_scratch);
+		if(sb->magic_num!=MY_MAGIC)
+		{
+			printf("%s: no file system\n",image);
+			return 8;
+		}
+		report(TRUE,"superblock: bad, the backup is used");
+		sb_dirty=TRUE;
+	}
+	if(sb->file_sys_size!=FS_SIZE || sb->inode_bitmap_place!=SUPER_BLOCK+1 || sb->dblock_bitmap_place!=SUPER_BLOCK+2
+		|| sb->inode_start!=SUPER_BLOCK+3 || sb->dblock_start!=SUPER_BLOCK+3+INODE_BLOCK_NUMBER)
+	{
+		printf("%s: unknown layout\n",image);
+		return 8;
+	}
+	if(!(sb->features & SB_FEATURE_JOURNAL))
+		return 0;
+	journal_first=sb->journal_start-sb->dblock_start;
+	journal_last=journal_first+sb->journal_blocks;
+	if(sb->journal_start<sb->dblock_start || journal_last>DATA_BLOCK_NUMBER || sb->journal_blocks<2)
+	{
+		printf("%s: bad journal location\n",image);
+		return 8;
+	}
+	char header_scratch[NEW_BLOCK_SIZE];
+	char desc_scratch[NEW_BLOCK_SIZE];
+	journal_header *h=(journal_header *)header_scratch;
+	journal_desc *d=(journal_desc *)desc_scratch;
+	image_read(sb->journal_start,header_scratch);
+	image_read(sb->journal_start+1,desc_scratch);
+	if(h->magic==JOURNAL_MAGIC && d->magic==JOURNAL_MAGIC && d->seq==h->seq && d->count>0)
+	{
+		printf("%s: the journal holds transactions, mount the image once to replay them\n",image);
+		return 8;
+	}
+	return 0;
+}
+
+int main(int argc,char **argv)
+{
+	bool_t force=FALSE;
+	int c;
+	while((c=getopt(argc,argv,"yfj:"))!=-1)
+	{
+		if(c=='y')
+			repair=TRUE;
+		else if(c=='f')
+			force=TRUE;
+		else if(c=='j' && atoi(optarg)>0)
+			nworkers=atoi(optarg)<MAX_WORKERS?atoi(optarg):MAX_WORKERS;
+		else
+			optind=argc+1;
+	}
+	if(optind!=argc-1)
+	{
+		printf("usage: %s [-y] [-f] [-j workers] image\n",argv[0]);
+		return 8;
+	}
+	char *image=argv[optind];
+	if(access(image,repair?R_OK|W_OK:R_OK)!=0 || (dev=block_open(image))<0)
+	{
+		printf("can't open %s\n",image);
+		return 8;
+	}
+	int res=load_sb(image);
+	if(res!=0)
+	{
+		block_close(dev);
+		return res;
+	}
+	if((sb->state & SB_STATE_CLEAN) && !force && errors==0)
+	{
+		printf("%s: clean, %d/%d inodes, %d/%d blocks\n",image,sb->inode_count,MAX_FILE_COUNT,sb->dblock_count,DATA_BLOCK_NUMBER);
+		block_close(dev);
+		return 0;
+	}
+	image_read(sb->inode_bitmap_place,inode_bitmap);
+	image_read(sb->dblock_bitmap_place,dblock_bitmap);
+	if(!bit_get(inode_bitmap,ROOT_DIR_ID))
+	{
+		printf("%s: the root directory is not in use\n",image);
+		block_close(dev);
+		return 8;
+	}
+
+	do
+	{
+		scan();
+		res=check_tree();
+		flush();
+	}while(res);
+	check_links();
+	check_blocks();
+	check_counts();
+	if(repair && errors==repaired && !(sb->state & SB_STATE_CLEAN))//checked, the next mount may trust it
+	{
+		sb->state|=SB_STATE_CLEAN;
+		sb_dirty=TRUE;
+	}
+	flush();
+	block_close(dev);
+
+	printf("%s: %d/%d inodes, %d/%d blocks, %d errors",image,sb->inode_count,MAX_FILE_COUNT,sb->dblock_count,DATA_BLOCK_NUMBER,errors);
+	if(repair)
+		printf(", %d repaired",repaired);
+	printf("\n");
+	if(errors==0)
+		return 0;
+	return errors==repaired?1:4;
+}
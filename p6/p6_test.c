@@ -2,8 +2,18 @@
 #include "common.h"
 #include "shellutil.h"
 #include "fs.h"
+#include "block.h"
+#include "fs_ring.h"
+#include "fs_client.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <signal.h>
+
+#define TEST_NUM 20
 
 int superblock_test(int s1,int s2)
 {
@@ -224,6 +234,1678 @@ int rmdir_test(int fs_size,int inode, int file_count, int other_use)
     return 0;
 }
 
+int rename_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, i, count;
+    char buf[] = "rename test\n";
+    count = strlen(buf);
+    //publish a temp file over an existing one
+    if ((fd = fs_open("pub", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    fs_write(fd, "old", 3);
+    fs_close(fd);
+    if ((fd = fs_open("tmp", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    fs_write(fd, buf, count);
+    fs_close(fd);
+    if (fs_rename("tmp", "pub") < 0){
+        printf("rename file error!\n");
+        return -1;
+    }
+    if ((fd = fs_open("tmp", FS_O_RDONLY)) >= 0){
+        printf("old name still exists after rename!\n");
+        return -1;
+    }
+    if ((fd = fs_open("pub", FS_O_RDONLY)) < 0){
+        printf("open renamed file error!\n");
+        return -1;
+    }
+    char out[count];
+    if ((i = fs_read(fd, out, count)) != count){
+        printf("read data error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    for(i=0;i<count;i++){
+        if(out[i] != buf[i]){
+            printf("data not correct !\n") ;
+            return -1;
+        }
+    }
+
+    //move a directory, its ".." has to follow
+    fs_mkdir("/a/b");
+    if ((fd = fs_open("/a/b/f", FS_O_RDWR)) < 0){
+        printf("create full path error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    if (fs_rename("/a/b", "/c") < 0){
+        printf("rename dir error!\n");
+        return -1;
+    }
+    if (fs_rename("/c", "/c/d") == 0){
+        printf("moved a dir into itself!\n");
+        return -1;
+    }
+    if (fs_cd("/c") < 0 || fs_cd("..") < 0){
+        printf("cd moved dir error!\n");
+        return -1;
+    }
+    fileStat st;
+    if (fs_stat(".", &st) < 0 || st.inodeNo != 0){
+        printf("parent of moved dir is not root!\n");
+        return -1;
+    }
+    if ((fd = fs_open("/c/f", FS_O_RDONLY)) < 0){
+        printf("open file in moved dir error!\n");
+        return -1;
+    }
+    fs_close(fd);
+
+    printf("rename test pass!\n");
+    return 0;
+}
+
+int readdir_plus_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, i, n, cookie;
+    char name[MAX_FILE_NAME+8];
+    char buf[200];
+    bzero(buf, 200);
+    fs_mkdir("/r/sub");
+    //files of different sizes, more of them than one batch returns
+    for(i=0;i<150;i++){
+        sprintf(name, "/r/f%d", i);
+        if ((fd = fs_open(name, FS_O_RDWR)) < 0){
+            printf("create file error!\n");
+            return -1;
+        }
+        fs_write(fd, buf, i);
+        fs_close(fd);
+    }
+    if ((fd = fs_open("/r", FS_O_RDONLY)) < 0){
+        printf("open dir error!\n");
+        return -1;
+    }
+    static dirent_plus ents[READDIR_PLUS_BATCH];
+    int seen[150], sub = 0, batches = 0;
+    bzero((char *)seen, sizeof(seen));
+    cookie = 0;
+    while ((n = fs_readdir_plus(fd, &cookie, ents, READDIR_PLUS_BATCH)) > 0){
+        batches++;
+        for(i=0;i<n;i++){
+            fileStat st;
+            sprintf(name, "/r/%s", ents[i].name);
+            if (fs_stat(name, &st) < 0 || st.inodeNo != ents[i].inodeNo || st.type != ents[i].type
+                || st.size != ents[i].size || st.numBlocks != ents[i].numBlocks || st.links != ents[i].links){
+                printf("readdir_plus attributes differ from fs_stat for %s!\n", ents[i].name);
+                return -1;
+            }
+            if (ents[i].name[0] == 'f'){
+                int k = atoi(ents[i].name+1);
+                if (k < 0 || k >= 150 || seen[k]++ || ents[i].size != k){
+                    printf("readdir_plus returned %s wrong!\n", ents[i].name);
+                    return -1;
+                }
+            }
+            else if (same_string(ents[i].name, "sub"))
+                sub++;
+        }
+    }
+    fs_close(fd);
+    if (n < 0 || batches < 2 || sub != 1){
+        printf("readdir_plus listing error!\n");
+        return -1;
+    }
+    for(i=0;i<150;i++){
+        if (!seen[i]){
+            printf("readdir_plus missed f%d!\n", i);
+            return -1;
+        }
+    }
+    if (fs_readdir_plus(fd, &cookie, ents, READDIR_PLUS_BATCH) >= 0){
+        printf("readdir_plus on a closed fd!\n");
+        return -1;
+    }
+
+    printf("readdir_plus test pass!\n");
+    return 0;
+}
+
+int dir_holes_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, i, size0;
+    char name[MAX_FILE_NAME+8];
+    fileStat st;
+    fs_mkdir("/h");
+    for(i=0;i<200;i++){
+        sprintf(name, "/h/h%d", i);
+        if ((fd = fs_open(name, FS_O_RDWR)) < 0){
+            printf("create file error!\n");
+            return -1;
+        }
+        fs_close(fd);
+    }
+    fs_stat("/h", &st);
+    size0 = st.size;
+    //a removed entry leaves a hole that the next create fills
+    if (fs_unlink("/h/h10") < 0 || fs_stat("/h", &st) < 0 || st.size != size0){
+        printf("unlink didn't leave a hole!\n");
+        return -1;
+    }
+    if ((fd = fs_open("/h/n0", FS_O_RDWR)) < 0 || fs_stat("/h", &st) < 0 || st.size != size0){
+        printf("create didn't reuse the hole!\n");
+        return -1;
+    }
+    fs_close(fd);
+    //removing the last entry shortens the directory
+    if (fs_unlink("/h/h199") < 0 || fs_stat("/h", &st) < 0 || st.size >= size0){
+        printf("unlink of the last entry didn't cut it off!\n");
+        return -1;
+    }
+    //once most slots are holes the directory is compacted
+    for(i=20;i<170;i++){
+        sprintf(name, "/h/h%d", i);
+        if (fs_unlink(name) < 0){
+            printf("unlink file error!\n");
+            return -1;
+        }
+    }
+    fs_stat("/h", &st);
+    if (st.size > size0/2){
+        printf("directory wasn't compacted!\n");
+        return -1;
+    }
+    //the same names have to be found after compaction, with the cache cold too
+    int pass;
+    for(pass=0;pass<2;pass++){
+        for(i=0;i<199;i++){
+            sprintf(name, "/h/h%d", i);
+            int exists = fs_stat(name, &st) == 0;
+            if (exists != (i != 10 && (i < 20 || i >= 170))){
+                printf("wrong entries after compaction!\n");
+                return -1;
+            }
+        }
+        if (fs_stat("/h/n0", &st) < 0){
+            printf("wrong entries after compaction!\n");
+            return -1;
+        }
+        fs_init();
+    }
+
+    printf("dir holes test pass!\n");
+    return 0;
+}
+
+int create_many_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, dirfd, i, created;
+    static char names[102][MAX_FILE_NAME+1];
+    char *list[102];
+    int inodes[102];
+    char path[MAX_FILE_NAME+8];
+    char out[5];
+    fileStat st;
+    fs_mkdir("/m");
+    if ((fd = fs_open("/m/pre", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    //100 new names, one that exists and one given twice
+    for(i=0;i<100;i++)
+        sprintf(names[i], "c%d", i);
+    sprintf(names[100], "pre");
+    sprintf(names[101], "c7");
+    for(i=0;i<102;i++)
+        list[i] = names[i];
+    if ((dirfd = fs_open("/m", FS_O_RDONLY)) < 0){
+        printf("open dir error!\n");
+        return -1;
+    }
+    created = fs_create_many(dirfd, list, 102, inodes);
+    fs_close(dirfd);
+    if (created != 100 || inodes[100] != -1 || inodes[101] != -1){
+        printf("create_many created the wrong files!\n");
+        return -1;
+    }
+    for(i=0;i<100;i++){
+        sprintf(path, "/m/%s", names[i]);
+        if (inodes[i] <= 0 || fs_stat(path, &st) < 0 || st.inodeNo != inodes[i] || st.size != 0 || st.links != 1){
+            printf("file from create_many is wrong!\n");
+            return -1;
+        }
+    }
+    //they are ordinary files
+    if ((fd = fs_open("/m/c42", FS_O_RDWR)) < 0 || fs_write(fd, "many", 4) != 4){
+        printf("write file from create_many error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    fs_init();
+    if ((fd = fs_open("/m/c42", FS_O_RDONLY)) < 0 || fs_read(fd, out, 5) != 4 || out[0] != 'm' || out[3] != 'y'){
+        printf("read file from create_many error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    if (fs_unlink("/m/c0") < 0 || fs_stat("/m/c0", &st) == 0 || fs_stat("/m/c99", &st) < 0){
+        printf("unlink file from create_many error!\n");
+        return -1;
+    }
+
+    printf("create_many test pass!\n");
+    return 0;
+}
+
+//bytes that differ from offset to offset and from seed to seed
+void pattern(char *buf, int n, int seed){
+    int i;
+    for(i=0;i<n;i++)
+        buf[i] = (char)((i*7+seed*13)|1);
+}
+
+//1 if the n bytes at a and b are the same
+int same_bytes(char *a, char *b, int n){
+    int i;
+    for(i=0;i<n;i++)
+        if(a[i] != b[i])
+            return 0;
+    return 1;
+}
+
+int pread_pwrite_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, i;
+    static char buf[20100], out[20100];
+    pattern(buf, 10000, 1);
+    if ((fd = fs_open("p", FS_O_RDWR)) < 0 || fs_write(fd, buf, 10000) != 10000){
+        printf("write data error!\n");
+        return -1;
+    }
+    //across a block boundary, and the cursor stays where it is
+    fs_lseek(fd, 100);
+    if (fs_pread(fd, out, 20, 4090) != 20){
+        printf("pread error!\n");
+        return -1;
+    }
+    for(i=0;i<20;i++){
+        if(out[i] != buf[4090+i]){
+            printf("pread data not correct!\n");
+            return -1;
+        }
+    }
+    if (fs_read(fd, out, 10) != 10 || out[0] != buf[100] || out[9] != buf[109]){
+        printf("pread moved the cursor!\n");
+        return -1;
+    }
+    //past the end the gap reads as zeros
+    pattern(buf+20000, 20, 2);
+    if (fs_pwrite(fd, buf+20000, 20, 20000) != 20){
+        printf("pwrite error!\n");
+        return -1;
+    }
+    bzero(buf+10000, 10000);
+    if (fs_pread(fd, out, 20100, 0) != 20020){
+        printf("pread size after pwrite error!\n");
+        return -1;
+    }
+    for(i=0;i<20020;i++){
+        if(out[i] != buf[i]){
+            printf("data not correct after pwrite!\n");
+            return -1;
+        }
+    }
+    if (fs_pread(fd, out, 10, 20020) != 0 || fs_pread(fd, out, 10, -1) >= 0){
+        printf("pread past the end error!\n");
+        return -1;
+    }
+    if (fs_read(fd, out, 1) != 1 || out[0] != buf[110]){
+        printf("pwrite moved the cursor!\n");
+        return -1;
+    }
+    fs_close(fd);
+
+    printf("pread/pwrite test pass!\n");
+    return 0;
+}
+
+int readv_writev_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, i;
+    static char buf[9000], out[9000], a[5], b[4096], c[7];
+    fs_iovec iov[3];
+    pattern(a, 5, 1);
+    pattern(b, 4096, 2);
+    pattern(c, 7, 3);
+    iov[0].base = a; iov[0].len = 5;
+    iov[1].base = b; iov[1].len = 4096;
+    iov[2].base = c; iov[2].len = 7;
+    if ((fd = fs_open("v", FS_O_RDWR)) < 0 || fs_writev(fd, iov, 3) != 4108){
+        printf("writev error!\n");
+        return -1;
+    }
+    //the buffers land back to back, and the cursor moved past them
+    if (fs_write(fd, "z", 1) != 1 || fs_pread(fd, buf, 9000, 0) != 4109){
+        printf("writev size error!\n");
+        return -1;
+    }
+    for(i=0;i<4108;i++){
+        char want = i<5 ? a[i] : i<4101 ? b[i-5] : c[i-4101];
+        if(buf[i] != want){
+            printf("writev data not correct!\n");
+            return -1;
+        }
+    }
+    //read back split differently, with an empty buffer in between
+    fs_iovec riov[3] = {{out, 3000}, {out+3000, 0}, {out+3000, 6000}};
+    fs_lseek(fd, 0);
+    if (fs_readv(fd, riov, 3) != 4109 || fs_read(fd, out+5000, 1) != 0){
+        printf("readv error!\n");
+        return -1;
+    }
+    for(i=0;i<4109;i++){
+        if(out[i] != buf[i]){
+            printf("readv data not correct!\n");
+            return -1;
+        }
+    }
+    //at an offset, without the cursor
+    fs_iovec piov[2] = {{c, 7}, {a, 5}};
+    if (fs_pwritev(fd, piov, 2, 4090) != 12){
+        printf("pwritev error!\n");
+        return -1;
+    }
+    fs_iovec priov[2] = {{out, 6}, {out+6, 6}};
+    if (fs_preadv(fd, priov, 2, 4090) != 12){
+        printf("preadv error!\n");
+        return -1;
+    }
+    for(i=0;i<12;i++){
+        if(out[i] != (i<7 ? c[i] : a[i-7])){
+            printf("pwritev data not correct!\n");
+            return -1;
+        }
+    }
+    riov[0].len = -1;
+    if (fs_writev(fd, riov, 3) >= 0 || fs_readv(fd, iov, FS_IOV_MAX+1) >= 0){
+        printf("bad iov accepted!\n");
+        return -1;
+    }
+    fs_close(fd);
+
+    printf("readv/writev test pass!\n");
+    return 0;
+}
+
+int copy_reflink_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int a, c, r, i, used;
+    static char buf[30000], out[30000];
+    int size = 5*NEW_BLOCK_SIZE+100;
+    pattern(buf, size, 4);
+    if ((a = fs_open("a", FS_O_RDWR)) < 0 || fs_write(a, buf, size) != size
+        || (c = fs_open("c", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    //unaligned on both sides, the cursors stay
+    fs_lseek(a, 7);
+    if (fs_copy_file_range(a, 1000, c, 50, 9000) != 9000 || fs_pread(c, out, 30000, 0) != 9050){
+        printf("copy_file_range error!\n");
+        return -1;
+    }
+    for(i=0;i<9050;i++){
+        if(out[i] != (i<50 ? 0 : buf[950+i])){
+            printf("copy_file_range data not correct!\n");
+            return -1;
+        }
+    }
+    if (fs_read(a, out, 1) != 1 || out[0] != buf[7]){
+        printf("copy_file_range moved the cursor!\n");
+        return -1;
+    }
+    //short at the end of the source, overlapping ranges of one file refused
+    if (fs_copy_file_range(a, size-10, c, 0, 100) != 10 || fs_copy_file_range(a, 0, a, 100, 500) >= 0
+        || fs_copy_file_range(a, 0, a, size, 100) != 100){
+        printf("copy_file_range bounds error!\n");
+        return -1;
+    }
+    fs_ftruncate(a, size);
+
+    //a clone shares the blocks until one side writes
+    used = fs_default()->my_sb->dblock_count;
+    if ((r = fs_open("r", FS_O_RDWR)) < 0 || fs_reflink(a, r) < 0){
+        printf("reflink error!\n");
+        return -1;
+    }
+    if (fs_default()->my_sb->dblock_count != used || fs_pread(r, out, 30000, 0) != size){
+        printf("reflink copied the data!\n");
+        return -1;
+    }
+    for(i=0;i<size;i++){
+        if(out[i] != buf[i]){
+            printf("reflink data not correct!\n");
+            return -1;
+        }
+    }
+    if (fs_pwrite(r, "X", 1, 5000) != 1 || fs_default()->my_sb->dblock_count != used+1){
+        printf("write to a clone didn't copy exactly one block!\n");
+        return -1;
+    }
+    if (fs_pread(a, out, 1, 5000) != 1 || out[0] != buf[5000] || fs_pread(r, out, 1, 5000) != 1 || out[0] != 'X'){
+        printf("write to a clone changed the original!\n");
+        return -1;
+    }
+    if (fs_reflink(a, c) >= 0){
+        printf("reflink into a non-empty file!\n");
+        return -1;
+    }
+    //the clone outlives the original
+    fs_close(a);
+    fs_unlink("a");
+    if (fs_pread(r, out, 30000, 0) != size || out[0] != buf[0] || out[size-1] != buf[size-1]){
+        printf("clone lost its data with the original!\n");
+        return -1;
+    }
+    fs_close(r);
+    fs_close(c);
+
+    printf("copy_file_range/reflink test pass!\n");
+    return 0;
+}
+
+int truncate_append_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, ro, i, used;
+    static char buf[20000], out[20000];
+    fileStat st;
+    pattern(buf, 20000, 5);
+    if ((fd = fs_open("t", FS_O_RDWR)) < 0 || fs_write(fd, buf, 20000) != 20000){
+        printf("write data error!\n");
+        return -1;
+    }
+    //cutting frees the blocks past the new end
+    used = fs_default()->my_sb->dblock_count;
+    if (fs_ftruncate(fd, 5000) < 0 || fs_stat("t", &st) < 0 || st.size != 5000
+        || fs_default()->my_sb->dblock_count != used-3){
+        printf("ftruncate shrink error!\n");
+        return -1;
+    }
+    //growing again reads as zeros, not the old bytes
+    if (fs_ftruncate(fd, 9000) < 0 || fs_pread(fd, out, 20000, 0) != 9000){
+        printf("ftruncate grow error!\n");
+        return -1;
+    }
+    for(i=0;i<9000;i++){
+        if(out[i] != (i<5000 ? buf[i] : 0)){
+            printf("data not correct after ftruncate!\n");
+            return -1;
+        }
+    }
+    if ((ro = fs_open("t", FS_O_RDONLY)) < 0 || fs_ftruncate(ro, 0) >= 0 || fs_ftruncate(fd, -1) >= 0){
+        printf("ftruncate allowed on a read-only fd!\n");
+        return -1;
+    }
+    fs_close(ro);
+    fs_close(fd);
+
+    //every write of an O_APPEND fd goes to the end, wherever the cursor is
+    if ((fd = fs_open("t", FS_O_RDWR|FS_O_APPEND)) < 0){
+        printf("open O_APPEND error!\n");
+        return -1;
+    }
+    fs_lseek(fd, 10);
+    if (fs_write(fd, "ab", 2) != 2 || fs_pread(fd, out, 20000, 0) != 9002 || out[9000] != 'a' || out[9001] != 'b' || out[10] != buf[10]){
+        printf("O_APPEND write error!\n");
+        return -1;
+    }
+    fs_iovec iov[2] = {{"c", 1}, {"d", 1}};
+    fs_lseek(fd, 0);
+    if (fs_writev(fd, iov, 2) != 2 || fs_pread(fd, out, 20000, 0) != 9004 || out[9002] != 'c' || out[9003] != 'd'){
+        printf("O_APPEND writev error!\n");
+        return -1;
+    }
+    fs_close(fd);
+
+    //O_TRUNC empties a writable open, and isn't allowed read-only
+    if (fs_open("t", FS_O_RDONLY|FS_O_TRUNC) >= 0 || fs_stat("t", &st) < 0 || st.size != 9004){
+        printf("O_TRUNC on a read-only open!\n");
+        return -1;
+    }
+    if ((fd = fs_open("t", FS_O_WRONLY|FS_O_TRUNC)) < 0 || fs_stat("t", &st) < 0 || st.size != 0 || st.numBlocks != 0){
+        printf("O_TRUNC error!\n");
+        return -1;
+    }
+    fs_close(fd);
+
+    printf("truncate/append test pass!\n");
+    return 0;
+}
+
+int mmap_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int fd, ro, i;
+    int size = 300000;//more blocks than BCACHE_BLOCKS
+    static char buf[300000], out[300000];
+    char *p;
+    fileStat st;
+    pattern(buf, size, 6);
+    if ((fd = fs_open("mm", FS_O_RDWR)) < 0 || fs_write(fd, buf, size) != size){
+        printf("write data error!\n");
+        return -1;
+    }
+    if ((p = fs_mmap(fd, 0, size, FS_PROT_READ|FS_PROT_WRITE)) == NULL){
+        printf("mmap of a large file error!\n");
+        return -1;
+    }
+    for(i=0;i<size;i++){
+        if(p[i] != buf[i]){
+            printf("mmap data not correct!\n");
+            return -1;
+        }
+    }
+    //changes reach the file only at msync
+    p[5] = 'M';
+    p[200000] = 'N';
+    if (fs_pread(fd, out, 1, 5) != 1 || out[0] != buf[5]){
+        printf("mapping changed the file before msync!\n");
+        return -1;
+    }
+    //a block the mapping didn't change keeps what was written under it
+    if (fs_pwrite(fd, "W", 1, 100000) != 1 || fs_msync(p, size) < 0){
+        printf("msync error!\n");
+        return -1;
+    }
+    if (fs_pread(fd, out, size, 0) != size || out[5] != 'M' || out[200000] != 'N' || out[100000] != 'W' || out[6] != buf[6]){
+        printf("msync wrote the wrong blocks!\n");
+        return -1;
+    }
+    //past the end the map reads as zeros and msync doesn't grow the file
+    char *q = fs_mmap(fd, 73*NEW_BLOCK_SIZE, 2*NEW_BLOCK_SIZE, FS_PROT_READ|FS_PROT_WRITE);
+    if (q == NULL || q[size-73*NEW_BLOCK_SIZE] != 0 || q[size-73*NEW_BLOCK_SIZE-1] != buf[size-1]){
+        printf("mmap past the end error!\n");
+        return -1;
+    }
+    q[2*NEW_BLOCK_SIZE-1] = 'E';
+    if (fs_msync(q, 2*NEW_BLOCK_SIZE) < 0 || fs_stat("mm", &st) < 0 || st.size != size){
+        printf("msync grew the file!\n");
+        return -1;
+    }
+    //the map keeps the file alive after close and unlink
+    fs_close(fd);
+    fs_unlink("mm");
+    if (p[5] != 'M' || fs_msync(p, 1) < 0 || fs_munmap(p, size) < 0 || fs_munmap(q, 1) < 0){
+        printf("mapping of an unlinked file error!\n");
+        return -1;
+    }
+    if (fs_msync(p, 1) >= 0 || fs_munmap(p, size) >= 0){
+        printf("unmapped address still works!\n");
+        return -1;
+    }
+    //protection and alignment
+    if ((fd = fs_open("mm2", FS_O_RDWR)) < 0 || fs_write(fd, buf, 100) != 100 || (ro = fs_open("mm2", FS_O_RDONLY)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    if (fs_mmap(ro, 0, 100, FS_PROT_WRITE) != NULL || fs_mmap(fd, 1, 100, FS_PROT_READ) != NULL){
+        printf("bad mmap accepted!\n");
+        return -1;
+    }
+    if ((p = fs_mmap(ro, 0, 100, FS_PROT_READ)) == NULL){
+        printf("read-only mmap error!\n");
+        return -1;
+    }
+    p[0] = 'R';
+    if (fs_msync(p, 100) < 0 || fs_pread(fd, out, 1, 0) != 1 || out[0] != buf[0]){
+        printf("read-only mapping wrote to the file!\n");
+        return -1;
+    }
+    fs_munmap(p, 100);
+    fs_close(ro);
+    fs_close(fd);
+
+    printf("mmap test pass!\n");
+    return 0;
+}
+
+int at_calls_test(){
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    int dfd, fd, ffd;
+    fileStat st;
+    fs_mkdir("/d1/d2");
+    if ((dfd = fs_open("/d1", FS_O_RDONLY)) < 0){
+        printf("open dir error!\n");
+        return -1;
+    }
+    //relative names start at dirfd, whatever the cwd is
+    fs_cd("/d1/d2");
+    if ((fd = fs_openat(dfd, "d2/f", FS_O_RDWR)) < 0 || fs_stat("/d1/d2/f", &st) < 0){
+        printf("openat error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    if (fs_mkdirat(dfd, "e") < 0 || fs_stat("/d1/e", &st) < 0 || st.type != DIRECTORY){
+        printf("mkdirat error!\n");
+        return -1;
+    }
+    //absolute names ignore it, FS_AT_FDCWD means the cwd
+    if ((fd = fs_openat(dfd, "/top", FS_O_RDWR)) < 0 || fs_stat("/top", &st) < 0){
+        printf("openat with an absolute name error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    if ((fd = fs_openat(FS_AT_FDCWD, "g", FS_O_RDWR)) < 0 || fs_stat("/d1/d2/g", &st) < 0){
+        printf("openat FS_AT_FDCWD error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    //a file isn't a directory to start from
+    if ((ffd = fs_open("/top", FS_O_RDONLY)) < 0 || fs_openat(ffd, "x", FS_O_RDWR) >= 0 || fs_openat(77, "x", FS_O_RDWR) >= 0){
+        printf("openat from a non-directory!\n");
+        return -1;
+    }
+    fs_close(ffd);
+    if (fs_unlinkat(dfd, "d2/f", 0) < 0 || fs_stat("/d1/d2/f", &st) == 0){
+        printf("unlinkat error!\n");
+        return -1;
+    }
+    if (fs_unlinkat(dfd, "e", 0) == 0 || fs_unlinkat(dfd, "e", FS_AT_REMOVEDIR) < 0 || fs_stat("/d1/e", &st) == 0){
+        printf("unlinkat of a directory error!\n");
+        return -1;
+    }
+    fs_close(dfd);
+
+    //sessions keep their own cwd
+    fs_session *s1 = fs_session_open(fs_default());
+    fs_session *s2 = fs_session_open(fs_default());
+    if (s1 == NULL || s2 == NULL || fss_cd(s1, "/d1") < 0){
+        printf("session error!\n");
+        return -1;
+    }
+    if ((fd = fss_open(s1, "x", FS_O_RDWR)) < 0 || fs_stat("/d1/x", &st) < 0){
+        printf("session open error!\n");
+        return -1;
+    }
+    fs_close(fd);
+    if (fss_stat(s2, "x", &st) == 0 || fss_stat(s2, "d1/x", &st) < 0 || fs_stat("g", &st) < 0){
+        printf("session cwd leaked!\n");
+        return -1;
+    }
+    fs_session_close(s1);
+    fs_session_close(s2);
+
+    printf("at calls test pass!\n");
+    return 0;
+}
+
+//run crash() in a child that exits without unmounting, as if the machine died
+int crash_child(void (*crash)(void)){
+    int status;
+    pid_t pid = fork();
+    if (pid == 0){
+        crash();
+        _exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+void journal_crash_create(){
+    fs_mount_opts opts = {FALSE, TRUE, TRUE, FALSE};
+    fs_t *fs = fs_mount("journal_disk", &opts);
+    if (fs == NULL || fsh_open(fs, "c1", FS_O_RDWR) < 0)
+        _exit(1);
+    fsh_sync(fs);
+}
+
+void journal_crash_mkfs(){
+    fs_mount_opts opts = {TRUE, FALSE, TRUE, FALSE};
+    fs_t *fs = fs_mount("journal_disk", &opts);
+    if (fs == NULL || fsh_open(fs, "b1", FS_O_RDWR) < 0)
+        _exit(1);
+    fsh_sync(fs);
+}
+
+int journal_test(){
+    fs_mount_opts opts = {TRUE, FALSE, TRUE, FALSE};
+    fs_t *fs;
+    int fd, i;
+    char buf[100];
+    char clear[BLOCK_SIZE];
+    fileStat st;
+    bzero(buf, 100);
+    bzero(clear, BLOCK_SIZE);
+
+    //S1 a journaled volume that leaves two transactions in its log
+    if ((fs = fs_mount("journal_disk", &opts)) == NULL){
+        printf("mount journaled image error!\n");
+        return -1;
+    }
+    if ((fd = fsh_open(fs, "a1", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    fsh_sync(fs);
+    if (fsh_write(fs, fd, buf, 100) != 100){
+        printf("write data error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    fs_unmount(fs);
+
+    //S2 format it again and crash after the first commit, replay must not
+    //pick up what the old volume logged
+    if (crash_child(journal_crash_mkfs) < 0){
+        printf("crash child error!\n");
+        return -1;
+    }
+    opts.mkfs = FALSE;
+    opts.no_format = TRUE;
+    if ((fs = fs_mount("journal_disk", &opts)) == NULL){
+        printf("mount after crash error!\n");
+        return -1;
+    }
+    if (fsh_stat(fs, "b1", &st) < 0 || st.size != 0 || st.numBlocks != 0){
+        printf("replay brought back the old volume's log!\n");
+        return -1;
+    }
+    if (fsh_stat(fs, "a1", &st) >= 0){
+        printf("file of the old volume exists after replay!\n");
+        return -1;
+    }
+    fs_unmount(fs);
+
+    //S3 crash after a commit and lose the home copies of what it changed,
+    //the log has to bring them back
+    if (crash_child(journal_crash_create) < 0){
+        printf("crash child error!\n");
+        return -1;
+    }
+    int dev = block_open("journal_disk");
+    if (dev < 0){
+        printf("open image error!\n");
+        return -1;
+    }
+    for (i = 0; i < NEW_BLOCK_SIZE/BLOCK_SIZE; i++){
+        dev_block_write(dev, 2*8+i, clear);//inode bitmap
+        dev_block_write(dev, 4*8+i, clear);//first inode table block
+    }
+    block_close(dev);
+    if ((fs = fs_mount("journal_disk", &opts)) == NULL){
+        printf("mount after crash error!\n");
+        return -1;
+    }
+    if (fsh_stat(fs, "c1", &st) < 0 || fsh_stat(fs, "b1", &st) < 0){
+        printf("committed file lost after replay!\n");
+        return -1;
+    }
+    if ((fd = fsh_open(fs, "c2", FS_O_RDWR)) < 0 || fsh_stat(fs, "c2", &st) < 0 || st.inodeNo == 1 || st.inodeNo == 2){
+        printf("replayed inode bitmap is wrong!\n");
+        return -1;
+    }
+    fs_unmount(fs);
+    remove("journal_disk");
+
+    printf("journal test pass!\n");
+    return 0;
+}
+
+//the superblock as the image holds it right now
+int image_sb(char *image, super_b *sb){
+    char sector[BLOCK_SIZE];
+    int dev = block_open(image);
+    if (dev < 0)
+        return -1;
+    dev_block_read(dev, SUPER_BLOCK*8, sector);
+    block_close(dev);
+    bcopy((unsigned char *)sector, (unsigned char *)sb, sizeof(super_b));
+    return 0;
+}
+
+void clean_crash_create(){
+    fs_mount_opts opts = {FALSE, TRUE, FALSE, FALSE};
+    fs_t *fs = fs_mount("clean_disk", &opts);
+    if (fs == NULL || fsh_open(fs, "k", FS_O_RDWR) < 0)
+        _exit(1);
+    //summary counts that only a recount from the bitmaps can fix
+    fs->my_sb->inode_count = 99;
+    fs->my_sb->dblock_count = 3;
+    fsh_sync(fs);
+}
+
+int clean_flag_test(){
+    fs_mount_opts opts = {TRUE, FALSE, FALSE, FALSE};
+    fs_t *fs;
+    super_b sb;
+    fileStat st;
+    int fd, i, inodes, blocks;
+    char name[4];
+
+    //S1 the flag is off while mounted and on after fs_unmount, with the counts
+    if ((fs = fs_mount("clean_disk", &opts)) == NULL){
+        printf("mount image error!\n");
+        return -1;
+    }
+    for(i=0;i<3;i++){
+        sprintf(name, "f%d", i);
+        if ((fd = fsh_open(fs, name, FS_O_RDWR)) < 0 || fsh_write(fs, fd, "clean", 5) != 5){
+            printf("create file error!\n");
+            return -1;
+        }
+        fsh_close(fs, fd);
+    }
+    inodes = fs->my_sb->inode_count;
+    if (image_sb("clean_disk", &sb) < 0 || (sb.state & SB_STATE_CLEAN)){
+        printf("mounted image marked clean!\n");
+        return -1;
+    }
+    fs_unmount(fs);
+    if (image_sb("clean_disk", &sb) < 0 || !(sb.state & SB_STATE_CLEAN) || sb.inode_count != inodes || inodes != 4){
+        printf("unmount didn't mark the image clean!\n");
+        return -1;
+    }
+
+    //S2 a clean image loads its bitmaps at first use
+    opts.mkfs = FALSE;
+    opts.no_format = TRUE;
+    if ((fs = fs_mount("clean_disk", &opts)) == NULL){
+        printf("mount clean image error!\n");
+        return -1;
+    }
+    if (fs->inode_bitmap_loaded || fs->dblock_bitmap_loaded){
+        printf("clean mount read the bitmaps!\n");
+        return -1;
+    }
+    if ((fd = fsh_open(fs, "f3", FS_O_RDWR)) < 0 || fsh_write(fs, fd, "x", 1) != 1 || !fs->inode_bitmap_loaded){
+        printf("create on a clean mount error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if (fsh_stat(fs, "f3", &st) < 0 || st.inodeNo > 4 || fs->my_sb->inode_count != 5){
+        printf("lazily loaded bitmap is wrong!\n");
+        return -1;
+    }
+    blocks = fs->my_sb->dblock_count;
+    fs_unmount(fs);
+
+    //S3 after a crash the counts come from the bitmaps again
+    if (crash_child(clean_crash_create) < 0){
+        printf("crash child error!\n");
+        return -1;
+    }
+    if (image_sb("clean_disk", &sb) < 0 || (sb.state & SB_STATE_CLEAN)){
+        printf("crashed image marked clean!\n");
+        return -1;
+    }
+    if ((fs = fs_mount("clean_disk", &opts)) == NULL){
+        printf("mount crashed image error!\n");
+        return -1;
+    }
+    if (fs->my_sb->inode_count != 6 || fs->my_sb->dblock_count != blocks || fsh_stat(fs, "k", &st) < 0){
+        printf("counts not rebuilt after a crash!\n");
+        return -1;
+    }
+
+    //S4 an unlinked file still open at unmount is freed, not left in a clean image
+    inodes = fs->my_sb->inode_count;
+    blocks = fs->my_sb->dblock_count;
+    if ((fd = fsh_open(fs, "o", FS_O_RDWR)) < 0 || fsh_write(fs, fd, "orphan", 6) != 6 || fsh_unlink(fs, "o") < 0){
+        printf("unlink open file error!\n");
+        return -1;
+    }
+    fs_unmount(fs);
+    if (image_sb("clean_disk", &sb) < 0 || !(sb.state & SB_STATE_CLEAN) || sb.inode_count != inodes || sb.dblock_count != blocks){
+        printf("unmount kept an open unlinked file!\n");
+        return -1;
+    }
+    remove("clean_disk");
+
+    //S5 fs_shutdown does the same for ./disk
+    fs_init();
+    if (fs_mkfs() < 0){
+        printf("mkfs error!\n");
+        return -1;
+    }
+    inodes = fs_default()->my_sb->inode_count;
+    if ((fd = fs_open("o", FS_O_RDWR)) < 0 || fs_unlink("o") < 0 || fs_shutdown() < 0){
+        printf("shutdown error!\n");
+        return -1;
+    }
+    if (image_sb("disk", &sb) < 0 || !(sb.state & SB_STATE_CLEAN) || sb.inode_count != inodes){
+        printf("shutdown didn't mark ./disk clean!\n");
+        return -1;
+    }
+
+    printf("clean flag test pass!\n");
+    return 0;
+}
+
+//run ./fsck with opt (or none) on image, return its exit status
+int run_fsck(char *opt, char *image){
+    int status;
+    pid_t pid = fork();
+    if (pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, 1);
+        if (opt)
+            execl("./fsck", "fsck", opt, image, (char *)NULL);
+        else
+            execl("./fsck", "fsck", image, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+void fsck_crash_orphan(){
+    fs_mount_opts opts = {FALSE, TRUE, FALSE, FALSE};
+    fs_t *fs = fs_mount("fsck_disk", &opts);
+    char buf[5000];
+    int fd;
+    bzero(buf, 5000);
+    //open and unlinked: its blocks were to go at fs_close
+    if (fs == NULL || (fd = fsh_open(fs, "o", FS_O_RDWR)) < 0 || fsh_write(fs, fd, buf, 5000) != 5000 || fsh_unlink(fs, "o") < 0)
+        _exit(1);
+    fsh_sync(fs);
+}
+
+//point the directory entry naming inode ino as name at new_ino, or clear it
+//if new_ino < 0; 0 if it was found
+int image_entry_patch(char *image, char *name, int ino, int new_ino){
+    char sector[BLOCK_SIZE];
+    int dev = block_open(image);
+    int i, k;
+    if (dev < 0)
+        return -1;
+    for(i=(SUPER_BLOCK+3+INODE_BLOCK_NUMBER)*8;i<FS_SIZE;i++){
+        dev_block_read(dev, i, sector);
+        dir_entry *e = (dir_entry *)sector;
+        for(k=0;k<BLOCK_SIZE/(int)sizeof(dir_entry);k++){
+            if (e[k].inode_id != ino || !same_string(e[k].file_name, name))
+                continue;
+            if (new_ino < 0)
+                bzero((char *)&e[k], sizeof(dir_entry));
+            else
+                e[k].inode_id = new_ino;
+            dev_block_write(dev, i, sector);
+            block_close(dev);
+            return 0;
+        }
+    }
+    block_close(dev);
+    return -1;
+}
+
+int fsck_test(){
+    fs_mount_opts opts = {TRUE, FALSE, FALSE, FALSE};
+    fs_t *fs;
+    int fd, i, res;
+    static char buf[10000], out[10000];
+    char clear[BLOCK_SIZE];
+    bzero(clear, BLOCK_SIZE);
+    pattern(buf, 10000, 7);
+
+    //S1 a clean image passes
+    if ((fs = fs_mount("fsck_disk", &opts)) == NULL){
+        printf("mount image error!\n");
+        return -1;
+    }
+    fsh_mkdir(fs, "/d");
+    if ((fd = fsh_open(fs, "/d/a", FS_O_RDWR)) < 0 || fsh_write(fs, fd, buf, 10000) != 10000){
+        printf("create file error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    fs_unmount(fs);
+    if ((res = run_fsck(NULL, "fsck_disk")) != 0 || run_fsck("-f", "fsck_disk") != 0){
+        printf("fsck of a good image returned %d!\n", res);
+        return -1;
+    }
+
+    //S2 an orphan left by a crash, and a data bitmap that was lost
+    if (crash_child(fsck_crash_orphan) < 0){
+        printf("crash child error!\n");
+        return -1;
+    }
+    int dev = block_open("fsck_disk");
+    if (dev < 0){
+        printf("open image error!\n");
+        return -1;
+    }
+    for (i = 0; i < NEW_BLOCK_SIZE/BLOCK_SIZE; i++)
+        dev_block_write(dev, 3*8+i, clear);//data block bitmap
+    block_close(dev);
+
+    //S3 found without -y and left alone, repaired with it, clean afterwards
+    if (run_fsck(NULL, "fsck_disk") != 4 || run_fsck(NULL, "fsck_disk") != 4){
+        printf("fsck missed the damage or changed the image without -y!\n");
+        return -1;
+    }
+    if (run_fsck("-y", "fsck_disk") != 1 || run_fsck("-f", "fsck_disk") != 0){
+        printf("fsck -y didn't repair the image!\n");
+        return -1;
+    }
+
+    //S4 the repaired image works: the orphan is gone, the file's blocks stay its own
+    opts.mkfs = FALSE;
+    opts.no_format = TRUE;
+    if ((fs = fs_mount("fsck_disk", &opts)) == NULL){
+        printf("mount repaired image error!\n");
+        return -1;
+    }
+    if (fs->my_sb->inode_count != 3){
+        printf("orphan inode not freed!\n");
+        return -1;
+    }
+    if ((fd = fsh_open(fs, "b", FS_O_RDWR)) < 0 || fsh_write(fs, fd, out, 10000) != 10000){
+        printf("write after repair error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if ((fd = fsh_open(fs, "/d/a", FS_O_RDONLY)) < 0 || fsh_read(fs, fd, out, 10000) != 10000){
+        printf("read after repair error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    for(i=0;i<10000;i++){
+        if(out[i] != buf[i]){
+            printf("repaired bitmap let a file's blocks be reused!\n");
+            return -1;
+        }
+    }
+
+    //S5 two directories naming each other, cut off from the root: named,
+    //so only a walk from the root finds them; a file also named from the
+    //tree stays
+    fileStat x, y, f;
+    int inodes = fs->my_sb->inode_count;
+    if (fsh_mkdir(fs, "/x") < 0 || fsh_mkdir(fs, "/x/y") < 0 || (fd = fsh_open(fs, "/x/y/f", FS_O_RDWR)) < 0){
+        printf("create tree error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if ((fd = fsh_open(fs, "/x/y/h", FS_O_RDWR)) < 0 || fsh_write(fs, fd, buf, 100) != 100 || fsh_link(fs, "/x/y/h", "/d/h") < 0){
+        printf("create link error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if (fsh_stat(fs, "/x", &x) < 0 || fsh_stat(fs, "/x/y", &y) < 0 || fsh_stat(fs, "/x/y/f", &f) < 0){
+        printf("stat tree error!\n");
+        return -1;
+    }
+    fs_unmount(fs);
+    if (image_entry_patch("fsck_disk", "f", f.inodeNo, x.inodeNo) < 0 || image_entry_patch("fsck_disk", "x", x.inodeNo, -1) < 0){
+        printf("patch image error!\n");
+        return -1;
+    }
+    if (run_fsck("-f", "fsck_disk") != 4 || run_fsck("-yf", "fsck_disk") != 1 || run_fsck("-f", "fsck_disk") != 0){
+        printf("fsck didn't free the unreachable directories!\n");
+        return -1;
+    }
+    if ((fs = fs_mount("fsck_disk", &opts)) == NULL){
+        printf("mount repaired image error!\n");
+        return -1;
+    }
+    if (fs->my_sb->inode_count != inodes+1 || (fd = fsh_open(fs, "/d/h", FS_O_RDONLY)) < 0 || fsh_read(fs, fd, out, 200) != 100){
+        printf("fsck freed the wrong inodes!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    fs_unmount(fs);
+    remove("fsck_disk");
+
+    printf("fsck test pass!\n");
+    return 0;
+}
+
+//overwrite a1 with log_writes, which frees its old block, then give b1 the
+//only free block and crash before the commit
+void log_writes_crash_reuse(){
+    fs_mount_opts opts = {FALSE, TRUE, TRUE, TRUE};
+    char buf[NEW_BLOCK_SIZE];
+    int fd;
+    fs_t *fs = fs_mount("log_disk", &opts);
+    if (fs == NULL || (fd = fsh_open(fs, "a1", FS_O_RDWR)) < 0)
+        _exit(1);
+    pattern(buf, NEW_BLOCK_SIZE, 2);
+    if (fsh_pwrite(fs, fd, buf, NEW_BLOCK_SIZE, 0) != NEW_BLOCK_SIZE)
+        _exit(1);
+    if ((fd = fsh_open(fs, "b1", FS_O_RDWR)) < 0)
+        _exit(1);
+    pattern(buf, NEW_BLOCK_SIZE, 3);
+    fsh_write(fs, fd, buf, NEW_BLOCK_SIZE);
+}
+
+int log_writes_test(){
+    fs_mount_opts opts = {TRUE, FALSE, TRUE, TRUE};
+    fs_t *fs;
+    int fd, fill, n;
+    char buf[NEW_BLOCK_SIZE];
+    char want[NEW_BLOCK_SIZE];
+    char old[NEW_BLOCK_SIZE];
+    fileStat st;
+
+    //S1 an overwrite moves the block and reads back like an in-place one
+    if ((fs = fs_mount("log_disk", &opts)) == NULL){
+        printf("mount log_writes image error!\n");
+        return -1;
+    }
+    if ((fd = fsh_open(fs, "a1", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    pattern(old, NEW_BLOCK_SIZE, 1);
+    if (fsh_write(fs, fd, old, NEW_BLOCK_SIZE) != NEW_BLOCK_SIZE){
+        printf("write data error!\n");
+        return -1;
+    }
+    fsh_sync(fs);
+    pattern(want, 100, 4);
+    if (fsh_pwrite(fs, fd, want, 100, 50) != 100 || fsh_pread(fs, fd, buf, NEW_BLOCK_SIZE, 0) != NEW_BLOCK_SIZE){
+        printf("overwrite error!\n");
+        return -1;
+    }
+    if (!same_bytes(buf, old, 50) || !same_bytes(buf+50, want, 100) || !same_bytes(buf+150, old+150, NEW_BLOCK_SIZE-150)){
+        printf("overwritten block reads back wrong!\n");
+        return -1;
+    }
+    fsh_pwrite(fs, fd, old+50, 100, 50);
+    fsh_close(fs, fd);
+
+    //S2 fill the volume and leave one block free
+    if ((fill = fsh_open(fs, "fill", FS_O_RDWR)) < 0){
+        printf("create file error!\n");
+        return -1;
+    }
+    bzero(buf, NEW_BLOCK_SIZE);
+    n = 0;
+    while (fsh_write(fs, fill, buf, NEW_BLOCK_SIZE) == NEW_BLOCK_SIZE)
+        n++;
+    if (n == 0 || fsh_ftruncate(fs, fill, (n-1)*NEW_BLOCK_SIZE) < 0){
+        printf("fill volume error!\n");
+        return -1;
+    }
+    fsh_close(fs, fill);
+    fs_unmount(fs);
+
+    //S3 a block freed by an uncommitted overwrite must not be handed out
+    //again, the replayed a1 still points at it
+    if (crash_child(log_writes_crash_reuse) < 0){
+        printf("crash child error!\n");
+        return -1;
+    }
+    opts.mkfs = FALSE;
+    opts.no_format = TRUE;
+    if ((fs = fs_mount("log_disk", &opts)) == NULL){
+        printf("mount after crash error!\n");
+        return -1;
+    }
+    pattern(want, NEW_BLOCK_SIZE, 2);
+    if ((fd = fsh_open(fs, "a1", FS_O_RDONLY)) < 0 || fsh_read(fs, fd, buf, NEW_BLOCK_SIZE) != NEW_BLOCK_SIZE){
+        printf("read after crash error!\n");
+        return -1;
+    }
+    if (!same_bytes(buf, old, NEW_BLOCK_SIZE) && !same_bytes(buf, want, NEW_BLOCK_SIZE)){
+        printf("replayed file holds another file's data!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if (fsh_stat(fs, "b1", &st) >= 0 && st.size > 0){
+        pattern(want, NEW_BLOCK_SIZE, 3);
+        if ((fd = fsh_open(fs, "b1", FS_O_RDONLY)) < 0 || fsh_read(fs, fd, buf, st.size) != st.size || !same_bytes(buf, want, st.size)){
+            printf("replayed file holds another file's data!\n");
+            return -1;
+        }
+        fsh_close(fs, fd);
+    }
+    fs_unmount(fs);
+    remove("log_disk");
+
+    printf("log writes test pass!\n");
+    return 0;
+}
+
+fs_ring ring;
+
+//queue one sqe on ring, tagged with its place in the batch
+fs_sqe *ring_sqe(int op, int fd, char *path, int flags, char *buf, int len, int offset, fileStat *st){
+    fs_sqe *e = fs_ring_get_sqe(&ring);
+    if (e == NULL)
+        return NULL;
+    e->op = op;
+    e->fd = fd;
+    e->path = path;
+    e->flags = flags;
+    e->buf = buf;
+    e->len = len;
+    e->offset = offset;
+    e->stat = st;
+    e->user_data = ring.sq_tail-ring.sq_submitted-1;
+    return e;
+}
+
+//submit what is queued and collect the res of each sqe in order
+int ring_wait(int *res){
+    int n = fs_ring_submit(&ring);
+    int i;
+    for(i=0;i<n;i++){
+        fs_cqe *c = fs_ring_peek_cqe(&ring, TRUE);
+        if (c->user_data != (uint64_t)i)
+            return -1;
+        res[i] = c->res;
+        fs_ring_cqe_seen(&ring);
+    }
+    return n;
+}
+
+int ring_test(){
+    static char data[8004];
+    static char buf[8200];
+    fileStat st[3];
+    int res[8];
+    int fd1, fd2;
+    fs_init();
+    if(fs_mkfs() < 0){
+        printf("mkfs error!");
+        return -1;
+    }
+    if (fs_ring_init(&ring, fs_default()) < 0){
+        printf("ring init error!\n");
+        return -1;
+    }
+    pattern(data, 8004, 5);
+
+    //S1 opens and a stat go as one namespace batch
+    ring_sqe(FS_OP_OPEN, 0, "r1", FS_O_RDWR, NULL, 0, 0, NULL);
+    ring_sqe(FS_OP_OPEN, 0, "r2", FS_O_RDWR, NULL, 0, 0, NULL);
+    ring_sqe(FS_OP_STAT, 0, "r1", 0, NULL, 0, 0, &st[0]);
+    ring_sqe(FS_OP_NOP, 0, NULL, 0, NULL, 0, 0, NULL);
+    if (ring_wait(res) != 4 || res[0] < 0 || res[1] < 0 || res[1] == res[0] || res[2] != 0 || res[3] != 0 || st[0].size != 0){
+        printf("ring open/stat error!\n");
+        return -1;
+    }
+    fd1 = res[0];
+    fd2 = res[1];
+
+    //S2 adjacent writes are merged, each sqe still gets its own length
+    ring_sqe(FS_OP_WRITE, fd1, NULL, 0, data, 100, 0, NULL);
+    ring_sqe(FS_OP_WRITE, fd1, NULL, 0, data+100, 5000, 100, NULL);
+    ring_sqe(FS_OP_WRITE, fd1, NULL, 0, data+5100, 10, 5100, NULL);
+    ring_sqe(FS_OP_WRITE, fd1, NULL, 0, data+8000, 4, 8000, NULL);
+    ring_sqe(FS_OP_WRITE, fd2, NULL, 0, data, 50, FS_RING_CURSOR, NULL);
+    ring_sqe(FS_OP_WRITE, fd2, NULL, 0, data+50, 70, FS_RING_CURSOR, NULL);
+    if (ring_wait(res) != 6 || res[0] != 100 || res[1] != 5000 || res[2] != 10 || res[3] != 4 || res[4] != 50 || res[5] != 70){
+        printf("ring write error!\n");
+        return -1;
+    }
+    ring_sqe(FS_OP_WRITE, fd1, NULL, 0, data+5110, 2890, 5110, NULL);
+    if (ring_wait(res) != 1 || res[0] != 2890){
+        printf("ring write error!\n");
+        return -1;
+    }
+
+    //S3 a merged read that runs past the end splits its result in order
+    bzero(buf, 8200);
+    ring_sqe(FS_OP_READ, fd1, NULL, 0, buf, 100, 0, NULL);
+    ring_sqe(FS_OP_READ, fd1, NULL, 0, buf+100, 5000, 100, NULL);
+    ring_sqe(FS_OP_READ, fd1, NULL, 0, buf+5100, 3000, 5100, NULL);
+    ring_sqe(FS_OP_READ, fd1, NULL, 0, buf+8100, 10, 8100, NULL);
+    if (ring_wait(res) != 4 || res[0] != 100 || res[1] != 5000 || res[2] != 2904 || res[3] != 0){
+        printf("ring merged read res error!\n");
+        return -1;
+    }
+    if (!same_bytes(buf, data, 8004)){
+        printf("ring read data error!\n");
+        return -1;
+    }
+    bzero(buf, 120);
+    if (fs_pread(fd2, buf, 200, 0) != 120 || !same_bytes(buf, data, 120)){
+        printf("ring cursor write data error!\n");
+        return -1;
+    }
+
+    //S4 an O_TRUNC open in the middle of a batch, the ops after it still run
+    ring_sqe(FS_OP_CLOSE, fd2, NULL, 0, NULL, 0, 0, NULL);
+    ring_sqe(FS_OP_OPEN, 0, "r2", FS_O_RDWR|FS_O_TRUNC, NULL, 0, 0, NULL);
+    ring_sqe(FS_OP_STAT, 0, "r2", 0, NULL, 0, 0, &st[1]);
+    ring_sqe(FS_OP_OPEN, 0, "r3", FS_O_RDWR, NULL, 0, 0, NULL);
+    ring_sqe(FS_OP_STAT, 0, "r1", 0, NULL, 0, 0, &st[2]);
+    ring_sqe(FS_OP_CLOSE, fd1, NULL, 0, NULL, 0, 0, NULL);
+    ring_sqe(FS_OP_STAT, 0, "none", 0, NULL, 0, 0, &st[0]);
+    if (ring_wait(res) != 7 || res[0] != fd2 || res[1] < 0 || res[2] != 0 || res[3] < 0 || res[4] != 0 || res[5] != fd1 || res[6] >= 0){
+        printf("ring namespace batch error!\n");
+        return -1;
+    }
+    if (st[1].size != 0 || st[1].numBlocks != 0 || st[2].size != 8004){
+        printf("ring stat result error!\n");
+        return -1;
+    }
+    if (fs_close(res[1]) < 0 || fs_close(res[3]) < 0 || fs_stat("r3", st) < 0){
+        printf("ring opened fd error!\n");
+        return -1;
+    }
+    fs_ring_exit(&ring);
+
+    printf("ring test pass!\n");
+    return 0;
+}
+
+//1 if a sector of image starts with the n bytes at pat
+int image_has(char *image, char *pat, int n){
+    char sector[BLOCK_SIZE];
+    int dev = block_open(image);
+    int i, found = 0;
+    if (dev < 0)
+        return 0;
+    for(i=0;i<FS_SIZE && !found;i++){
+        dev_block_read(dev, i, sector);
+        found = same_bytes(sector, pat, n);
+    }
+    block_close(dev);
+    return found;
+}
+
+int writeback_test(){
+    fs_mount_opts opts = {TRUE, FALSE, FALSE, FALSE};
+    fs_writeback_opts wb = {60000, 60000, 50, 90};//nothing expires while the test runs
+    fs_t *fs;
+    int fd, i;
+    char data[3][BLOCK_SIZE];
+    char buf[BLOCK_SIZE];
+    char name[4];
+    for(i=0;i<3;i++)
+        pattern(data[i], BLOCK_SIZE, 6+i);
+
+    //S1 with write-back on the data stays in the cache until fsh_writeback(NULL)
+    if ((fs = fs_mount("wb_disk", &opts)) == NULL || fsh_writeback(fs, &wb) < 0){
+        printf("write-back mount error!\n");
+        return -1;
+    }
+    if ((fd = fsh_open(fs, "w0", FS_O_RDWR)) < 0 || fsh_write(fs, fd, data[0], BLOCK_SIZE) != BLOCK_SIZE){
+        printf("write-back write error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if (image_has("wb_disk", data[0], BLOCK_SIZE)){
+        printf("write-back wrote through!\n");
+        return -1;
+    }
+    if (fsh_writeback(fs, NULL) < 0 || !image_has("wb_disk", data[0], BLOCK_SIZE)){
+        printf("turning write-back off didn't flush!\n");
+        return -1;
+    }
+
+    //S2 fsh_sync flushes and leaves the cache on
+    fsh_writeback(fs, &wb);
+    if ((fd = fsh_open(fs, "w1", FS_O_RDWR)) < 0 || fsh_write(fs, fd, data[1], BLOCK_SIZE) != BLOCK_SIZE){
+        printf("write-back write error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    if (fsh_sync(fs) < 0 || !image_has("wb_disk", data[1], BLOCK_SIZE)){
+        printf("sync didn't flush!\n");
+        return -1;
+    }
+
+    //S3 what is still cached at unmount is there after a remount
+    if ((fd = fsh_open(fs, "w2", FS_O_RDWR)) < 0 || fsh_write(fs, fd, data[2], BLOCK_SIZE) != BLOCK_SIZE){
+        printf("write-back write error!\n");
+        return -1;
+    }
+    fsh_close(fs, fd);
+    fs_unmount(fs);
+    opts.mkfs = FALSE;
+    opts.no_format = TRUE;
+    if ((fs = fs_mount("wb_disk", &opts)) == NULL){
+        printf("remount error!\n");
+        return -1;
+    }
+    for(i=0;i<3;i++){
+        sprintf(name, "w%d", i);
+        if ((fd = fsh_open(fs, name, FS_O_RDONLY)) < 0 || fsh_read(fs, fd, buf, BLOCK_SIZE) != BLOCK_SIZE || !same_bytes(buf, data[i], BLOCK_SIZE)){
+            printf("write-back data lost!\n");
+            return -1;
+        }
+        fsh_close(fs, fd);
+    }
+    fs_unmount(fs);
+    remove("wb_disk");
+
+    printf("write-back test pass!\n");
+    return 0;
+}
+
+//connect c to the server starting on sock, give it two seconds
+int server_connect(fs_client *c, char *sock){
+    int i;
+    for(i=0;i<200;i++){
+        if (fsc_connect(c, sock) == 0)
+            return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+//what the clients of a server on srv_sock see; the caller stops the server
+int server_clients(){
+    static char data[FSP_MAX_DATA+NEW_BLOCK_SIZE];
+    static char buf[FSP_MAX_DATA+NEW_BLOCK_SIZE];
+    fs_client a, b, raw;
+    fsc_req reqs[6];
+    fileStat st;
+    fsp_req q;
+    fsp_rep rep;
+    int fd, big, i;
+    pattern(data, FSP_MAX_DATA+NEW_BLOCK_SIZE, 9);
+    if (server_connect(&a, "srv_sock") < 0){
+        printf("start server error!\n");
+        return -1;
+    }
+
+    //S1 the synchronous calls round trip, in the connection's own directory
+    if (fsc_mkdir(&a, "d") < 0 || fsc_cd(&a, "d") < 0 || (fd = fsc_open(&a, "f", FS_O_RDWR)) < 0){
+        printf("server open error!\n");
+        return -1;
+    }
+    if (fsc_write(&a, fd, data, 5000) != 5000 || fsc_pread(&a, fd, buf, 6000, 0) != 5000 || !same_bytes(buf, data, 5000)){
+        printf("server read/write error!\n");
+        return -1;
+    }
+    if (fsc_stat(&a, "f", &st) < 0 || st.size != 5000){
+        printf("server stat error!\n");
+        return -1;
+    }
+
+    //S2 pipelined requests go out in one write, run as one batch and come
+    //back in order
+    bzero((char *)reqs, sizeof(reqs));
+    for(i=0;i<3;i++){
+        reqs[i].op = FSP_WRITE;
+        reqs[i].fd = fd;
+        reqs[i].buf = data+i*NEW_BLOCK_SIZE;
+        reqs[i].len = NEW_BLOCK_SIZE;
+        reqs[i].offset = i*NEW_BLOCK_SIZE;
+    }
+    reqs[3].op = FSP_READ;
+    reqs[3].fd = fd;
+    reqs[3].buf = buf;
+    reqs[3].len = 3*NEW_BLOCK_SIZE;
+    reqs[3].offset = 0;
+    reqs[4].op = FSP_STAT;
+    reqs[4].path = "f";
+    reqs[4].stat = &st;
+    reqs[5].op = FSP_STAT;
+    reqs[5].path = "none";
+    reqs[5].stat = &st;
+    bzero(buf, 3*NEW_BLOCK_SIZE);
+    for(i=0;i<6;i++)
+        if (fsc_send(&a, &reqs[i]) < 0){
+            printf("server send error!\n");
+            return -1;
+        }
+    if (fsc_wait(&a, &reqs[5]) >= 0 || reqs[4].res != 0 || st.size != 3*NEW_BLOCK_SIZE){
+        printf("server pipelined stat error!\n");
+        return -1;
+    }
+    for(i=0;i<3;i++)
+        if (!reqs[i].done || reqs[i].res != NEW_BLOCK_SIZE){
+            printf("server pipelined write error!\n");
+            return -1;
+        }
+    if (reqs[3].res != 3*NEW_BLOCK_SIZE || !same_bytes(buf, data, 3*NEW_BLOCK_SIZE)){
+        printf("server pipelined read error!\n");
+        return -1;
+    }
+
+    //S3 another client can't use a's fds and starts at "/"
+    if (server_connect(&b, "srv_sock") < 0){
+        printf("second client error!\n");
+        return -1;
+    }
+    if (fsc_read(&b, fd, buf, 10) >= 0 || fsc_pwrite(&b, fd, data, 10, 0) >= 0 || fsc_close(&b, fd) >= 0){
+        printf("client used another client's fd!\n");
+        return -1;
+    }
+    if (fsc_stat(&b, "f", &st) >= 0 || fsc_stat(&b, "d/f", &st) < 0 || fsc_pread(&a, fd, buf, 10, 0) != 10){
+        printf("client sessions not separate!\n");
+        return -1;
+    }
+
+    //S4 the library splits what is too big for one request, the server
+    //fails an oversized read alone and drops a client with an oversized payload
+    if ((big = fsc_open(&b, "big", FS_O_RDWR)) < 0 || fsc_pwrite(&b, big, data, FSP_MAX_DATA+NEW_BLOCK_SIZE, 0) != FSP_MAX_DATA+NEW_BLOCK_SIZE){
+        printf("server big write error!\n");
+        return -1;
+    }
+    bzero(buf, FSP_MAX_DATA+NEW_BLOCK_SIZE);
+    if (fsc_pread(&b, big, buf, FSP_MAX_DATA+NEW_BLOCK_SIZE, 0) != FSP_MAX_DATA+NEW_BLOCK_SIZE || !same_bytes(buf, data, FSP_MAX_DATA+NEW_BLOCK_SIZE)){
+        printf("server big read error!\n");
+        return -1;
+    }
+    reqs[0].op = FSP_READ;
+    reqs[0].fd = big;
+    reqs[0].buf = buf;
+    reqs[0].len = FSP_MAX_DATA+1;
+    if (fsc_send(&b, &reqs[0]) >= 0 || server_connect(&raw, "srv_sock") < 0){
+        printf("client sent an oversized read!\n");
+        return -1;
+    }
+    bzero((char *)&q, sizeof(q));
+    q.op = FSP_READ;
+    q.fd = big;
+    q.arg = FSP_MAX_DATA+1;
+    q.tag = 7;
+    if (send(raw.sock, &q, sizeof(q), 0) != sizeof(q) || recv(raw.sock, &rep, sizeof(rep), MSG_WAITALL) != sizeof(rep)
+        || rep.tag != 7 || rep.res >= 0 || rep.len != 0){
+        printf("server oversized read error!\n");
+        return -1;
+    }
+    q.op = FSP_WRITE;
+    q.len = FSP_MAX_PAYLOAD+1;
+    if (send(raw.sock, &q, sizeof(q), 0) != sizeof(q) || recv(raw.sock, &rep, sizeof(rep), 0) != 0){
+        printf("server kept a client with an oversized request!\n");
+        return -1;
+    }
+    fsc_disconnect(&raw);
+    if (fsc_close(&b, big) != big || fsc_sync(&b) < 0){
+        printf("server stopped serving!\n");
+        return -1;
+    }
+    fsc_disconnect(&b);
+    fsc_disconnect(&a);
+    return 0;
+}
+
+int server_test(){
+    char buf[3*NEW_BLOCK_SIZE];
+    char data[3*NEW_BLOCK_SIZE];
+    int fd, res, status;
+    remove("srv_disk");
+    pid_t pid = fork();
+    if (pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, 1);
+        execl("./fs_server", "fs_server", "srv_disk", "srv_sock", (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0){
+        printf("fork error!\n");
+        return -1;
+    }
+    res = server_clients();
+    if (kill(pid, SIGTERM) < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        printf("server exit error!\n");
+        return -1;
+    }
+    if (res < 0)
+        return -1;
+
+    //S5 the data is in the image after the server shuts down
+    fs_mount_opts opts = {FALSE, TRUE, FALSE, FALSE};
+    fs_t *fs = fs_mount("srv_disk", &opts);
+    pattern(data, 3*NEW_BLOCK_SIZE, 9);
+    if (fs == NULL || (fd = fsh_open(fs, "/d/f", FS_O_RDONLY)) < 0 || fsh_read(fs, fd, buf, 3*NEW_BLOCK_SIZE) != 3*NEW_BLOCK_SIZE
+        || !same_bytes(buf, data, 3*NEW_BLOCK_SIZE)){
+        printf("served data lost!\n");
+        return -1;
+    }
+    fs_unmount(fs);
+    remove("srv_disk");
+
+    printf("server test pass!\n");
+    return 0;
+}
+
 int main(int argc,char*argv[])
 {	
     if(argc < 7){
@@ -250,19 +1932,36 @@ int main(int argc,char*argv[])
 	file_count = atoi(argv[6]);
     printf("Intput: sb1:%d, sb2:%d fs_size:%d max_inode:%d\n",sb1,sb2,fs_size,inode);
 
-    int result[3] = {-1,-1,-1};
+    int result[TEST_NUM];
     result[0]=superblock_test(sb1,sb2);
     result[1]=path_lookup_test();
     result[2]=rmdir_test(fs_size,inode, file_count, other_use);
+    result[3]=rename_test();
+    result[4]=journal_test();
+    result[5]=readdir_plus_test();
+    result[6]=dir_holes_test();
+    result[7]=create_many_test();
+    result[8]=pread_pwrite_test();
+    result[9]=readv_writev_test();
+    result[10]=copy_reflink_test();
+    result[11]=truncate_append_test();
+    result[12]=mmap_test();
+    result[13]=at_calls_test();
+    result[14]=clean_flag_test();
+    result[15]=fsck_test();
+    result[16]=log_writes_test();
+    result[17]=ring_test();
+    result[18]=writeback_test();
+    result[19]=server_test();
 
     int i=0;
     int pass=0;
-    for(;i<3;i++){
+    for(;i<TEST_NUM;i++){
         if(0 == result[i])
             pass++;
     }
     
-    printf("PASS %d of 3 TEST\n",pass);
+    printf("PASS %d of %d TEST\n",pass,TEST_NUM);
 
     
 	return 0;
@@ -261,27 +261,29 @@ static void shell_cd( void) {
 static void shell_ls( void) {
     //should a system call print to the screen?
 
-    //trick to change dir and save pwd
-    fileStat pwd_stat;
-    fs_stat(".",&pwd_stat);
-    if(argv[1]) 
-    {
-        if(strlen(argv[1])>0){
-            // printf("argv[1]:%s\n", argv[1]);   
-            if(fs_cd(argv[1])<0){
-                writeStr("No such dir!\n");
-                return ;
-            }
-        }
-    }
-    //open dir to read entries
-    int dir_fd=fs_open(".",FS_O_RDONLY);
-    if(dir_fd<0)
+    //open dir to read entries and their attributes in batches
+    int dir_fd;
+    if(argv[1] && strlen(argv[1])>0)
+        dir_fd=fs_open(argv[1],FS_O_RDONLY);
+    else
+        dir_fd=fs_open(".",FS_O_RDONLY);
+
+    dirent_plus entries[DIR_ENTRY_PER_BLOCK];
+    int cookie=0;
+    int n=-1;
+    if(dir_fd>=0)
+        n=fs_readdir_plus(dir_fd,&cookie,entries,DIR_ENTRY_PER_BLOCK);
+    if(n<0)
     {
-    	writeStr("Problem with ls\n");
-    	return ;
+        if(dir_fd>=0)
+            fs_close(dir_fd);
+        if(argv[1] && strlen(argv[1])>0)
+            writeStr("No such dir!\n");
+        else
+            writeStr("Problem with ls\n");
+        return ;
     }
-    int i;
+    int i,k;
 // Code/pseudocode you can use somewhere to get the same ls output as the tests
 	writeStr("Name");
 	for(i=0;i<MAX_FILE_NAME-3;i++)
@@ -292,27 +294,26 @@ static void shell_ls( void) {
 	writeChar(' ');
 	writeStr("Size\n");
 
-    dir_entry temp_entry;
-	fileStat temp_stat;
-    while(fs_read(dir_fd,(char *)&temp_entry,sizeof(dir_entry)))
+    while(n>0)
     {
-    	fs_stat(temp_entry.file_name,&temp_stat);
-		writeStr(temp_entry.file_name);
-		int namelen=strlen(temp_entry.file_name);
+        for(k=0;k<n;k++)
+        {
+		writeStr(entries[k].name);
+		int namelen=strlen(entries[k].name);
 		for(i=0;i<MAX_FILE_NAME-namelen+1;i++)
 			writeChar(' ');
-		writeStr((temp_stat.type==DIRECTORY)? "D" : "F");
+		writeStr((entries[k].type==DIRECTORY)? "D" : "F");
 		for(i=0;i<4;i++)
 			writeChar(' ');
-		writeInt(temp_stat.inodeNo);
+		writeInt(entries[k].inodeNo);
 		for(i=0;i<5;i++)
 			writeChar(' ');
-		writeInt(temp_stat.size);
-		writeStr("\n");   	
+		writeInt(entries[k].size);
+		writeStr("\n");
+        }
+        n=fs_readdir_plus(dir_fd,&cookie,entries,DIR_ENTRY_PER_BLOCK);
     }
     fs_close(dir_fd);
-
-    fs_cd_inode_id(pwd_stat.inodeNo);
 }
 
 static void shell_link( void) {